@@ -76,12 +76,68 @@
  * 3) When free is called, the program will set the block to be free (if
  *    the pointer is not NULL), then merge the consecutive free blocks.
  *    The free block will be inserted back to free list.
+ * 
+ * Small objects:
+ *    Requests of up to SLAB_MAX bytes do not get a block of their own.
+ *    They are served from runs: blocks of RUN_SIZE bytes whose payload is
+ *    aligned on RUN_SIZE, so that runs next to each other fill whole
+ *    pages, holding objects of a single size, rounded up to 8 bytes, with
+ *    no header or footer.
+ *    +---------------------------------------+
+ *    |  object size      |  free objects     |
+ *    |  next run offset  |  prev run offset  |
+ *    |  free object bitmap (64 bytes)        |
+ *    |  object #0                            |
+ *    |  object #1                            |
+ *    |  ....                                 |
+ *    +---------------------------------------+
+ *    1) Runs with free objects are kept in a list for each object size,
+ *       whose heads are in a table allocated in mm_init. malloc takes the
+ *       first free object of the first run of the list.
+ *    2) free finds the run of an object by rounding its address down to
+ *       RUN_SIZE, and the object size in the run header. Whether an
+ *       address is in a run at all is told by a bitmap with a bit per
+ *       RUN_SIZE page of the heap, in a block that grows with the heap.
+ *    3) A run whose objects are all free is given back to the free lists,
+ *       unless it is the last run of its list.
+ *    4) A run is placed in a free block, split around it, or in a block
+ *       at the end of the heap, extended so that it can hold it.
+ *    Runs are only used in the default mode: with -DTHREADS, the thread
+ *    caches serve the small requests.
+ * 
+ * Heap segments:
+ *    The heap grows by extending the block at its end, over the epilogue.
+ *    When another arena (see below) has the end of the heap, the new block
+ *    gets a segment of its own instead, with padding, prologue and
+ *    epilogue as in the initial heap. The padding word of each segment
+ *    holds the offset of the next one, 0 for the last.
+ * 
+ * Thread-safe mode:
+ *    Compiled with -DTHREADS, the allocator may be called from several
+ *    threads at once. The heap is then split into ARENA_NUM arenas, each
+ *    with its own free list table, segments and lock, and the threads are
+ *    given an arena in turn. The global variables are per thread, and
+ *    describe the arena the thread has locked.
+ *    1) An allocated block records its arena in bits 1-2 of its header
+ *       and footer, so free returns it to the right one. This is what
+ *       limits the arenas to 4.
+ *    2) A block freed by a thread of another arena is pushed on a lock-free
+ *       stack of its arena, which the arena empties the next time its own
+ *       threads lock it, so freeing never waits on another arena.
+ *    3) Each thread keeps up to TCACHE_CNT freed blocks of each size up to
+ *       TCACHE_MAX in a cache of its own, which malloc takes from first
+ *       without any lock. These blocks stay allocated in their arena.
+ *    4) mem_sbrk is shared by all arenas, and guarded by a spin lock.
  */
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#ifdef THREADS
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 #include "mm.h"
 #include "memlib.h"
@@ -122,6 +178,24 @@
 #define FREE        0x0         /* Block is free */
 #define ALLOC       0x1         /* Block is allocated */
 
+/* Runs of small objects, see the top of the file */
+#define RUN_SIZE    (1 << 12)   /* Run size and alignment (bytes) */
+#define RUN_MAPSIZE 64          /* Bitmap of free objects of a run (bytes) */
+#define RUN_HSIZE   (4 * WSIZE + RUN_MAPSIZE) /* Run header size (bytes) */
+#define SLAB_MAX    128         /* Largest object kept in runs */
+#define SLAB_NUM    (SLAB_MAX / DSIZE) /* Numbers of object sizes */
+
+/* Thread-safe mode, see the top of the file */
+#ifdef THREADS
+#define ARENA_NUM   4           /* Numbers of arenas, at most 4 */
+#define TCACHE_MAX  128         /* Largest block size kept in thread caches */
+#define TCACHE_CNT  7           /* Blocks of each size in a thread cache */
+#define TCACHE_NUM  ((TCACHE_MAX - 2 * DSIZE) / DSIZE + 1) /* Sizes kept */
+#define THREAD_LOCAL __thread
+#else
+#define THREAD_LOCAL
+#endif
+
 /* Pack a size and allocated bit into a word */
 #define PACK(size, alloc)   ((size) | (alloc))
 
@@ -132,6 +206,7 @@
 /* Read the size, previous allocated, and allocated fields from address p */
 #define GET_SIZE(p)         (GET(p) & ~0x7)
 #define GET_ALLOC(p)        (GET(p) & 0x1)
+#define GET_ARENA(p)        ((GET(p) >> 1) & 0x3)
 
 /* Given a block pointer bp, compute address of its header and footer */
 #define HDRP(bp)            ((char *)(bp) - WSIZE)
@@ -149,11 +224,73 @@
 #define NEXT_BLKP(bp)       ((char *)(bp) + GET_SIZE(((char *)(bp) - WSIZE)))
 #define PREV_BLKP(bp) 	    ((char *)(bp) - GET_SIZE(((char *)(bp) - DSIZE)))
 
+/* Given a run pointer rp, compute address of its header fields */
+#define RUN_FREE(rp)        ((char *)(rp) + WSIZE)
+#define RUN_NEXT(rp)        ((char *)(rp) + 2 * WSIZE)
+#define RUN_PREV(rp)        ((char *)(rp) + 3 * WSIZE)
+#define RUN_MAP(rp)         ((unsigned long *)((char *)(rp) + 4 * WSIZE))
+
+/* Given a run pointer rp, compute address of its first object */
+#define RUN_OBJS(rp)        ((char *)(rp) + RUN_HSIZE)
+
+/* Given an object pointer bp, compute address of its run */
+#define RUNP(bp)            ((char *)((size_t)(bp) & ~(size_t)(RUN_SIZE - 1)))
+
+/* Given an object size, compute the number of objects in a run */
+#define RUN_CAP(size)       ((RUN_SIZE - DSIZE - RUN_HSIZE) / (size))
+
+/* Given a block pointer bp in a thread cache or a remote free stack,
+ * compute address of the next block pointer */
+#define NEXT_LINK(bp)       (*(void **)(bp))
+
+#ifdef THREADS
+/*
+ * Header of an arena. The pointers are those of the global variables
+ * below, kept while no thread has the arena locked.
+ */
+typedef struct arena {
+    pthread_mutex_t lock;
+    void *remote;       /* blocks freed by the threads of other arenas */
+    size_t id;          /* number stored in the blocks of the arena */
+    char *heap_basep;
+    char *first_listp;
+    char *last_listp;
+    char *heap_endp;
+    char *last_segp;
+} Arena;
+
+/*
+ * Thread cache, with a stack of freed blocks for each size
+ */
+typedef struct tcache {
+    void *lists[TCACHE_NUM];
+    int counts[TCACHE_NUM];
+} TCache;
+#endif
+
 /* Global variables */
-static char *heap_listp = 0; /* free block count in heap */
-static char *heap_basep = 0; /* point to the footer of prologue block */
-static char *first_listp = 0;/* point to the first block of free list table */
-static char *last_listp = 0; /* point to the last block of free list table */
+static THREAD_LOCAL char *heap_listp = 0;  /* free block count in heap */
+static THREAD_LOCAL char *heap_basep = 0;  /* footer of prologue block */
+static THREAD_LOCAL char *first_listp = 0; /* first block of list table */
+static THREAD_LOCAL char *last_listp = 0;  /* last block of list table */
+static THREAD_LOCAL char *heap_endp = 0;   /* past the last epilogue */
+static THREAD_LOCAL char *last_segp = 0;   /* padding of last segment */
+
+#ifndef THREADS
+static char *slab_listp = 0;    /* table of the lists of runs */
+static char *page_mapp = 0;     /* bitmap of the heap pages that are runs */
+static size_t map_pages = 0;    /* pages the bitmap covers */
+#endif
+
+#ifdef THREADS
+static Arena **arenas = 0;              /* arena table, in the heap */
+static size_t next_arena = 0;           /* arena of the next new thread */
+static int sbrk_lock = 0;               /* held while calling mem_sbrk */
+static pthread_key_t tcache_key;        /* flushes thread caches on exit */
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+static __thread Arena *my_arena = 0;    /* arena of the thread */
+static __thread TCache *tcache = 0;     /* cache of the thread */
+#endif
 
 /* Function prototypes */
 static inline void ins_free_blk(void *bp, size_t index);
@@ -163,12 +300,50 @@ static inline void place(void *bp, size_t asize);
 static inline void* coalesce(void *bp);
 static inline void* extend_heap(size_t words);
 static inline void *find_fit(size_t asize);
+static inline size_t adjust_size(size_t size);
+static inline void *alloc_block(size_t asize);
+static inline void free_block(void *bp);
+static inline void lock_sbrk(void);
+static inline void unlock_sbrk(void);
+static int init_lists(void);
+
+#ifndef THREADS
+/* Helper functions for the runs of small objects */
+static inline size_t run_front(void *bp);
+static inline void *find_run_fit(void);
+static inline void *place_run(void *bp);
+static int set_run_page(void *rp, int is_run);
+static inline int in_run(void *bp);
+static inline void link_run(char *rp, char *listp);
+static inline void unlink_run(char *rp, char *listp);
+static void *new_run(size_t size);
+static inline void *slab_alloc(size_t size);
+static inline void slab_free(void *bp);
+#endif
+
+#ifdef THREADS
+/* Helper functions for the thread-safe mode */
+static void make_tcache_key(void);
+static inline Arena *get_arena(void);
+static inline void enter_arena(Arena *a);
+static inline void leave_arena(Arena *a);
+static inline void drain_remote(Arena *a);
+static void *arena_malloc(size_t asize);
+static void arena_free(void *bp);
+static inline void *tcache_get(size_t asize);
+static inline int tcache_put(void *bp);
+static void flush_tcache(void *arg);
+#endif
 
 /* Helper functions for heap checking */
 static void check_heap_init(int lineno);
 static void check_epi_and_pro(int lineno);
 static size_t check_each_block(int lineno);
 static size_t check_free_list(int lineno);
+static void check_arena(int lineno);
+#ifndef THREADS
+static void check_runs(int lineno);
+#endif
 
 /*******************
  * Helper functions
@@ -326,8 +501,32 @@ static inline void* extend_heap(size_t words) {
     
     /* Change the size to even word number */
     size = (words % 2) ? WSIZE * (words + 1) : WSIZE * words;
-    if ((long)(bp = mem_sbrk(size)) == -1)
-        return NULL;
+    
+    lock_sbrk();
+    if ((char *)mem_heap_hi() + 1 == heap_endp) {
+        /* The new block starts over the epilogue */
+        if ((long)(bp = mem_sbrk(size)) == -1) {
+            unlock_sbrk();
+            return NULL;
+        }
+    }
+    else {
+        /* Another arena has the end of the heap, start a new segment */
+        if ((long)(bp = mem_sbrk(size + 2 * DSIZE)) == -1) {
+            unlock_sbrk();
+            return NULL;
+        }
+        
+        /* Set padding and prologue, and link the segment to the last */
+        PUT(bp, 0);
+        PUT(bp + WSIZE, PACK(DSIZE, ALLOC));
+        PUT(bp + 2 * WSIZE, PACK(DSIZE, ALLOC));
+        PUT(last_segp, (long)bp - (long)first_listp);
+        last_segp = bp;
+        bp += 2 * DSIZE;
+    }
+    unlock_sbrk();
+    heap_endp = bp + size;
     
     /* Set values to header/footer of the new block and the epilogue */
     PUT(HDRP(bp), PACK(size, FREE));
@@ -389,25 +588,95 @@ static inline void *find_fit(size_t asize) {
     
 }
 
-/***********************
- * End helper functions
- ***********************/
+/*
+ * adjust_size - Returns the block size to hold size bytes of payload
+ */
+static inline size_t adjust_size(size_t size) {
+    /* Adjust size to include header and footer */
+    if (size <= DSIZE) {
+        return 2 * DSIZE;
+    }
+    else {
+        return DSIZE * ((size + DSIZE + DSIZE - 1) / DSIZE);
+    }
+}
 
 /*
- * Initialize - initialize the heap. Return -1 on error, 0 on success.
+ * alloc_block - Allocate a block of asize bytes from the free lists,
+ * extending the heap if needed. Returns NULL if the heap is full.
  */
-int mm_init(void) {
+static inline void *alloc_block(size_t asize) {
+    size_t extendsize;
+    void *bp;
+    
+    /* Find the suitable free block to hold the data */
+    if ((bp = find_fit(asize)) != NULL) {
+        place(bp, asize);
+        return bp;
+    }
+    
+    /* If cannot find, extend the heap so that there is enough space */
+    extendsize = asize > CHUNKSIZE ? asize : CHUNKSIZE;
+    if ((bp = extend_heap(extendsize / WSIZE)) != NULL) {
+        place(bp, asize);
+        return bp;
+    }
+    
+    return NULL;
+}
+
+/*
+ * free_block - Set the block to be free and put it back to the free lists
+ */
+static inline void free_block(void *bp) {
+    size_t size = GET_SIZE(HDRP(bp));
+    
+    /* Change alloc bit in header and footer of the block to free */
+    PUT(HDRP(bp), PACK(size, FREE));
+    PUT(FTRP(bp), PACK(size, FREE));
+    
+    coalesce(bp);
+}
+
+/*
+ * lock_sbrk - Wait until no other thread is calling mem_sbrk
+ */
+static inline void lock_sbrk(void) {
+#ifdef THREADS
+    while (__atomic_exchange_n(&sbrk_lock, 1, __ATOMIC_ACQUIRE))
+        sched_yield();
+#endif
+}
+
+/*
+ * unlock_sbrk - Let other threads call mem_sbrk
+ */
+static inline void unlock_sbrk(void) {
+#ifdef THREADS
+    __atomic_store_n(&sbrk_lock, 0, __ATOMIC_RELEASE);
+#endif
+}
+
+/*
+ * init_lists - Create a free list table, followed by padding, prologue
+ * and epilogue, and a first free block. Returns -1 on error.
+ */
+static int init_lists(void) {
     /* size to hold a free list table plus padding, prologue and epilogue */
     size_t size = (LIST_NUM * 2 + 4) * WSIZE; 
     
     /* checks if requested size is allocated */
-    if ((heap_listp = mem_sbrk(size)) == (void *)-1)
+    lock_sbrk();
+    heap_listp = mem_sbrk(size);
+    unlock_sbrk();
+    if (heap_listp == (void *)-1)
         return -1;
     
     /* initialize pointers */
     heap_basep = heap_listp;
     first_listp = heap_listp;
     last_listp = first_listp + (LIST_NUM - 1) * DSIZE;
+    heap_endp = heap_listp + size;
     
     /* initialize free list offset table */
     size_t offset = 0;
@@ -424,6 +693,7 @@ int mm_init(void) {
     PUT(heap_listp + 2 * WSIZE, PACK(DSIZE, ALLOC));
     PUT(heap_listp + 3 * WSIZE, PACK(0, ALLOC));
     heap_basep = heap_listp + 2 * WSIZE;
+    last_segp = heap_listp;
     
     /* extend the empty heap */
     if (extend_heap(INISIZE / WSIZE) == NULL) {
@@ -433,42 +703,476 @@ int mm_init(void) {
     return 0;
 }
 
+#ifndef THREADS
+/*
+ * run_front - Returns the distance from bp to the first address a run can
+ * start at in its block, leaving room for a free block before it
+ */
+static inline size_t run_front(void *bp) {
+    size_t front = -(size_t)bp & (RUN_SIZE - 1);
+    
+    if (front != 0 && front < 2 * DSIZE)
+        front += RUN_SIZE;
+    
+    return front;
+}
+
+/*
+ * find_run_fit - finds a free block that can hold a run
+ */
+static inline void *find_run_fit(void) {
+    size_t asize = RUN_SIZE;
+    char *start_listp = first_listp + list_index(asize) * DSIZE;
+    void *bp;
+    
+    /* first fit */
+    for (void *list_head = start_listp; list_head != last_listp + DSIZE;
+        list_head = (char *)list_head + DSIZE) {
+        
+        bp = NEXT_EMPT_BLKP(list_head);
+        while (bp != list_head) {
+            if (GET_SIZE(HDRP(bp)) >= run_front(bp) + asize)
+                return bp;
+            bp = NEXT_EMPT_BLKP(bp);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * place_run - Place a run in the free block bp, and returns the run. The
+ * part of the block before the run is put back into the free list.
+ */
+static inline void *place_run(void *bp) {
+    size_t bsize = GET_SIZE(HDRP(bp));
+    size_t front = run_front(bp);
+    
+    if (front > 0) { // Split the block before the run
+        del_free_blk(bp);
+        
+        PUT(HDRP(bp), PACK(front, FREE));
+        PUT(FTRP(bp), PACK(front, FREE));
+        ins_free_blk(bp, list_index(front));
+        
+        bp = NEXT_BLKP(bp);
+        PUT(HDRP(bp), PACK(bsize - front, FREE));
+        PUT(FTRP(bp), PACK(bsize - front, FREE));
+        ins_free_blk(bp, list_index(bsize - front));
+    }
+    
+    place(bp, RUN_SIZE);
+    return bp;
+}
+
+/*
+ * set_run_page - Mark the page of the run rp as a run or not, growing the
+ * page bitmap if needed. Returns -1 if the heap is full.
+ */
+static int set_run_page(void *rp, int is_run) {
+    size_t page = ((size_t)rp - (size_t)first_listp) / RUN_SIZE;
+    
+    if (page >= map_pages) {
+        /* Double the bitmap, in pages of 64 bits */
+        size_t pages = (2 * page + 64) & ~(size_t)63;
+        char *mapp = alloc_block(adjust_size(pages / 8));
+        
+        if (mapp == NULL)
+            return -1;
+        memset(mapp, 0, pages / 8);
+        if (page_mapp != NULL) {
+            memcpy(mapp, page_mapp, map_pages / 8);
+            free_block(page_mapp);
+        }
+        page_mapp = mapp;
+        map_pages = pages;
+    }
+    
+    if (is_run)
+        page_mapp[page / 8] |= 1 << (page % 8);
+    else
+        page_mapp[page / 8] &= ~(1 << (page % 8));
+    return 0;
+}
+
+/*
+ * in_run - Returns whether the block pointer bp is an object of a run
+ */
+static inline int in_run(void *bp) {
+    size_t page = ((size_t)bp - (size_t)first_listp) / RUN_SIZE;
+    
+    return page < map_pages && (page_mapp[page / 8] >> (page % 8)) & 1;
+}
+
+/*
+ * link_run - Insert run to the head of the list of runs
+ */
+static inline void link_run(char *rp, char *listp) {
+    size_t offset = rp - first_listp;
+    
+    PUT(RUN_NEXT(rp), GET(listp));
+    PUT(RUN_PREV(rp), 0);
+    if (GET(listp) != 0)
+        PUT(RUN_PREV(first_listp + GET(listp)), offset);
+    PUT(listp, offset);
+}
+
+/*
+ * unlink_run - Delete run from the list of runs
+ */
+static inline void unlink_run(char *rp, char *listp) {
+    if (GET(RUN_PREV(rp)) != 0)
+        PUT(RUN_NEXT(first_listp + GET(RUN_PREV(rp))), GET(RUN_NEXT(rp)));
+    else
+        PUT(listp, GET(RUN_NEXT(rp)));
+    
+    if (GET(RUN_NEXT(rp)) != 0)
+        PUT(RUN_PREV(first_listp + GET(RUN_NEXT(rp))), GET(RUN_PREV(rp)));
+}
+
+/*
+ * new_run - Create a run of objects of size bytes, all free. Returns NULL
+ * if the heap is full.
+ */
+static void *new_run(size_t size) {
+    size_t cap = RUN_CAP(size);
+    char *rp;
+    
+    /* Find a free block to hold the run, or extend the heap for one */
+    if ((rp = find_run_fit()) == NULL) {
+        size_t extendsize = run_front(heap_endp) + RUN_SIZE;
+        if ((rp = extend_heap(extendsize / WSIZE)) == NULL)
+            return NULL;
+    }
+    rp = place_run(rp);
+    
+    if (set_run_page(rp, 1) < 0) {
+        free_block(rp);
+        return NULL;
+    }
+    
+    /* Set the header, with the bits of the cap objects set */
+    PUT(rp, size);
+    PUT(RUN_FREE(rp), cap);
+    memset(RUN_MAP(rp), 0, RUN_MAPSIZE);
+    for (size_t i = 0; i < cap / 64; ++i)
+        RUN_MAP(rp)[i] = ~0UL;
+    if (cap % 64 != 0)
+        RUN_MAP(rp)[cap / 64] = (1UL << (cap % 64)) - 1;
+    
+    return rp;
+}
+
+/*
+ * slab_alloc - Returns a free object of size bytes from its list of runs,
+ * or NULL if the heap is full
+ */
+static inline void *slab_alloc(size_t size) {
+    size_t idx = (size - 1) / DSIZE;
+    char *listp = slab_listp + idx * WSIZE;
+    unsigned long *map;
+    char *rp;
+    size_t i;
+    
+    /* All runs of the size are full, make a new one */
+    if (GET(listp) == 0) {
+        if ((rp = new_run((idx + 1) * DSIZE)) == NULL)
+            return NULL;
+        link_run(rp, listp);
+    }
+    rp = first_listp + GET(listp);
+    
+    /* Take the first free object, there is one in the first run */
+    map = RUN_MAP(rp);
+    for (i = 0; map[i] == 0; ++i)
+        ;
+    size_t bit = __builtin_ctzl(map[i]);
+    map[i] &= map[i] - 1;
+    
+    /* Delete the run from the list once it is full */
+    PUT(RUN_FREE(rp), GET(RUN_FREE(rp)) - 1);
+    if (GET(RUN_FREE(rp)) == 0)
+        unlink_run(rp, listp);
+    
+    return RUN_OBJS(rp) + (i * 64 + bit) * GET(rp);
+}
+
+/*
+ * slab_free - Set the object free in its run. A run that was full goes
+ * back to its list, and a run that is empty is freed, unless it is the
+ * last of its list.
+ */
+static inline void slab_free(void *bp) {
+    char *rp = RUNP(bp);
+    size_t size = GET(rp);
+    char *listp = slab_listp + (size / DSIZE - 1) * WSIZE;
+    size_t i = ((char *)bp - RUN_OBJS(rp)) / size;
+    size_t free_cnt = GET(RUN_FREE(rp)) + 1;
+    
+    RUN_MAP(rp)[i / 64] |= 1UL << (i % 64);
+    PUT(RUN_FREE(rp), free_cnt);
+    
+    if (free_cnt == 1) {
+        link_run(rp, listp);
+    }
+    else if (free_cnt == RUN_CAP(size) &&
+             (GET(listp) != (size_t)(rp - first_listp) ||
+              GET(RUN_NEXT(rp)) != 0)) {
+        unlink_run(rp, listp);
+        set_run_page(rp, 0);
+        free_block(rp);
+    }
+}
+#endif
+
+#ifdef THREADS
+/*
+ * make_tcache_key - Create the key whose destructor flushes the cache of
+ * an exiting thread
+ */
+static void make_tcache_key(void) {
+    pthread_key_create(&tcache_key, flush_tcache);
+}
+
+/*
+ * get_arena - Returns the arena of the calling thread, giving it the next
+ * one in turn on its first call
+ */
+static inline Arena *get_arena(void) {
+    if (my_arena == NULL) {
+        size_t i = __atomic_fetch_add(&next_arena, 1, __ATOMIC_RELAXED);
+        my_arena = arenas[i % ARENA_NUM];
+    }
+    return my_arena;
+}
+
+/*
+ * enter_arena - Lock the arena and load its pointers to the globals
+ */
+static inline void enter_arena(Arena *a) {
+    pthread_mutex_lock(&a->lock);
+    heap_basep = a->heap_basep;
+    first_listp = a->first_listp;
+    last_listp = a->last_listp;
+    heap_endp = a->heap_endp;
+    last_segp = a->last_segp;
+}
+
+/*
+ * leave_arena - Store the globals back to the arena and unlock it
+ */
+static inline void leave_arena(Arena *a) {
+    a->heap_endp = heap_endp;
+    a->last_segp = last_segp;
+    pthread_mutex_unlock(&a->lock);
+}
+
+/*
+ * drain_remote - Free the blocks other threads pushed on the remote free
+ * stack of the arena, which the caller has locked
+ */
+static inline void drain_remote(Arena *a) {
+    void *bp, *next;
+    
+    if (__atomic_load_n(&a->remote, __ATOMIC_RELAXED) == NULL)
+        return;
+    
+    bp = __atomic_exchange_n(&a->remote, NULL, __ATOMIC_ACQUIRE);
+    while (bp != NULL) {
+        next = NEXT_LINK(bp);
+        free_block(bp);
+        bp = next;
+    }
+}
+
+/*
+ * arena_malloc - Allocate a block of asize bytes from the arena of the
+ * thread, and mark it with the arena number
+ */
+static void *arena_malloc(size_t asize) {
+    Arena *a = get_arena();
+    void *bp;
+    
+    enter_arena(a);
+    drain_remote(a);
+    if ((bp = alloc_block(asize)) != NULL) {
+        size_t size = GET_SIZE(HDRP(bp));
+        PUT(HDRP(bp), PACK(size, (a->id << 1) | ALLOC));
+        PUT(FTRP(bp), PACK(size, (a->id << 1) | ALLOC));
+    }
+    leave_arena(a);
+    
+    return bp;
+}
+
+/*
+ * arena_free - Free the block to its arena, or push it on the remote
+ * free stack of the arena if it is not the one of the thread
+ */
+static void arena_free(void *bp) {
+    Arena *a = arenas[GET_ARENA(HDRP(bp))];
+    void *head;
+    
+    if (a == get_arena()) {
+        enter_arena(a);
+        drain_remote(a);
+        free_block(bp);
+        leave_arena(a);
+        return;
+    }
+    
+    head = __atomic_load_n(&a->remote, __ATOMIC_RELAXED);
+    do {
+        NEXT_LINK(bp) = head;
+    } while (!__atomic_compare_exchange_n(&a->remote, &head, bp, 1,
+                                          __ATOMIC_RELEASE,
+                                          __ATOMIC_RELAXED));
+}
+
+/*
+ * tcache_get - Returns a block of asize bytes from the thread cache, or
+ * NULL if it has none. Creates the cache on the first call.
+ */
+static inline void *tcache_get(size_t asize) {
+    size_t idx = (asize - 2 * DSIZE) / DSIZE;
+    void *bp;
+    
+    if (asize > TCACHE_MAX)
+        return NULL;
+    
+    if (tcache == NULL) {
+        pthread_once(&tcache_once, make_tcache_key);
+        if ((tcache = arena_malloc(adjust_size(sizeof(TCache)))) == NULL)
+            return NULL;
+        memset(tcache, 0, sizeof(TCache));
+        pthread_setspecific(tcache_key, tcache);
+        return NULL;
+    }
+    
+    if ((bp = tcache->lists[idx]) == NULL)
+        return NULL;
+    tcache->lists[idx] = NEXT_LINK(bp);
+    --tcache->counts[idx];
+    return bp;
+}
+
+/*
+ * tcache_put - Keep the block in the thread cache. Returns 0 if it is too
+ * large or the cache is full.
+ */
+static inline int tcache_put(void *bp) {
+    size_t size = GET_SIZE(HDRP(bp));
+    size_t idx = (size - 2 * DSIZE) / DSIZE;
+    
+    if (tcache == NULL || size > TCACHE_MAX ||
+        tcache->counts[idx] == TCACHE_CNT)
+        return 0;
+    
+    NEXT_LINK(bp) = tcache->lists[idx];
+    tcache->lists[idx] = bp;
+    ++tcache->counts[idx];
+    return 1;
+}
+
+/*
+ * flush_tcache - Free the blocks of the cache of an exiting thread, and
+ * the cache itself
+ */
+static void flush_tcache(void *arg) {
+    TCache *t = arg;
+    void *bp;
+    
+    tcache = NULL;
+    for (size_t i = 0; i < TCACHE_NUM; ++i) {
+        while ((bp = t->lists[i]) != NULL) {
+            t->lists[i] = NEXT_LINK(bp);
+            arena_free(bp);
+        }
+    }
+    arena_free(t);
+}
+#endif
+
+/***********************
+ * End helper functions
+ ***********************/
+
+/*
+ * Initialize - initialize the heap. Return -1 on error, 0 on success.
+ */
+int mm_init(void) {
+#ifdef THREADS
+    tcache = NULL;
+    my_arena = NULL;
+    next_arena = 0;
+    
+    /* the arena table comes first, then each arena with its lists */
+    if ((arenas = mem_sbrk(ARENA_NUM * sizeof(Arena *))) == (void *)-1)
+        return -1;
+    
+    for (size_t i = 0; i < ARENA_NUM; ++i) {
+        Arena *a = mem_sbrk(ALIGN(sizeof(Arena)));
+        if (a == (void *)-1 || init_lists() < 0)
+            return -1;
+        
+        pthread_mutex_init(&a->lock, NULL);
+        a->remote = NULL;
+        a->id = i;
+        a->heap_basep = heap_basep;
+        a->first_listp = first_listp;
+        a->last_listp = last_listp;
+        a->heap_endp = heap_endp;
+        a->last_segp = last_segp;
+        arenas[i] = a;
+    }
+    
+    return 0;
+#else
+    page_mapp = NULL;
+    map_pages = 0;
+    
+    if (init_lists() < 0)
+        return -1;
+    
+    /* allocate the table of the lists of runs, all empty */
+    if ((slab_listp = alloc_block(adjust_size(SLAB_NUM * WSIZE))) == NULL)
+        return -1;
+    memset(slab_listp, 0, SLAB_NUM * WSIZE);
+    
+    return 0;
+#endif
+}
+
 /*
  * malloc - returns pointer to allocated block if successful, else returns 
  * NULL
  */
 void *malloc (size_t size) {
     size_t adjustsize;
-    size_t extendsize;
-    void *bp;
     
     /* Ignore requests of 0 payload*/
     if (size == 0) {
         return NULL;
     }
     
-    /* Adjust size to include header and footer */
-    if (size <= DSIZE) {
-        adjustsize = 2 * DSIZE;
-    }
-    else {
-        adjustsize = DSIZE * ((size + DSIZE + DSIZE - 1) / DSIZE);
-    }
+    adjustsize = adjust_size(size);
     
-    /* Find the suitable free block to hold the data */
-    if ((bp = find_fit(adjustsize)) != NULL) {
-        place(bp, adjustsize);
+#ifdef THREADS
+    void *bp;
+    
+    /* Take a block of the size from the thread cache first */
+    if ((bp = tcache_get(adjustsize)) != NULL) {
         return bp;
     }
     
-    /* If cannot find, extend the heap so that there is enough space */
-    extendsize = adjustsize > CHUNKSIZE ? adjustsize : CHUNKSIZE;
-    if ((bp = extend_heap(extendsize / WSIZE)) != NULL) {
-        place(bp, adjustsize);
-        return bp;
+    return arena_malloc(adjustsize);
+#else
+    /* Small objects go to the runs */
+    if (size <= SLAB_MAX) {
+        return slab_alloc(size);
     }
     
-    return NULL;
+    return alloc_block(adjustsize);
+#endif
 }
 
 /*
@@ -478,13 +1182,18 @@ void *malloc (size_t size) {
 void free (void *ptr) {
     if(!ptr) return;
     
-    size_t size = GET_SIZE(HDRP(ptr));
-    
-    /* Change alloc bit in header and footer of the block to free */
-    PUT(HDRP(ptr), PACK(size, FREE));
-    PUT(FTRP(ptr), PACK(size, FREE));
-    
-    coalesce(ptr);
+#ifdef THREADS
+    if (!tcache_put(ptr)) {
+        arena_free(ptr);
+    }
+#else
+    if (in_run(ptr)) {
+        slab_free(ptr);
+    }
+    else {
+        free_block(ptr);
+    }
+#endif
 }
 
 /*
@@ -512,7 +1221,11 @@ void *realloc(void *oldptr, size_t size) {
     }
     
     /* Copy the old data and fre the old block. */
+#ifdef THREADS
     oldsize = GET_SIZE(HDRP(oldptr));
+#else
+    oldsize = in_run(oldptr) ? GET(RUNP(oldptr)) : GET_SIZE(HDRP(oldptr));
+#endif
     if (oldsize > size) {
         oldsize = size;
     }
@@ -583,7 +1296,7 @@ static void check_epi_and_pro(int lineno) {
         printf("%d: Prologue block footer error!\n", lineno);
     }
     
-    if (GET((char *)mem_heap_hi() - 3) != PACK(0, ALLOC)) {
+    if (GET(heap_endp - WSIZE) != PACK(0, ALLOC)) {
         printf("%d: Epilogue block error!\n", lineno);
     }
     
@@ -596,7 +1309,7 @@ static void check_epi_and_pro(int lineno) {
         printf("%d: Prologue block footer not in heap!\n", lineno);
     }
     
-    if (!in_heap((char *)mem_heap_hi() - 3)) {
+    if (!in_heap(heap_endp - WSIZE)) {
         printf("%d: Epilogue block not in heap!\n", lineno);
     }
 }
@@ -606,6 +1319,7 @@ static void check_epi_and_pro(int lineno) {
  */
 static size_t check_each_block(int lineno) {
 	char *iter = heap_basep + WSIZE;    // pointer to traverse heap
+    char *segp = heap_basep - 2 * WSIZE;// padding of current segment
     size_t free_cnt1 = 0;               // free block count in heap
     
     /* 
@@ -642,6 +1356,12 @@ static size_t check_each_block(int lineno) {
 		}
 		
 		iter = HDRP(NEXT_BLKP(iter));      // next block header
+		
+        /* Go on with the first block of the next segment */
+        if (GET(iter) == PACK(0, ALLOC) && GET(segp) != 0) {
+            segp = first_listp + GET(segp);
+            iter = segp + 3 * WSIZE;
+        }
 	}
     
     return free_cnt1;
@@ -691,10 +1411,54 @@ static size_t check_free_list(int lineno) {
     return free_cnt2;
 }
 
+#ifndef THREADS
 /*
- * mm_checkheap
+ * Checks the lists of runs
  */
-void mm_checkheap(int lineno) {
+static void check_runs(int lineno) {
+    for (size_t idx = 0; idx < SLAB_NUM; ++idx) {
+        char *listp = slab_listp + idx * WSIZE;
+        size_t offset = GET(listp);
+        size_t prev = 0;
+        
+        while (offset != 0) {
+            char *rp = first_listp + offset;
+            size_t free_cnt = 0;
+            
+            /* Checks the run is an allocated block marked in the bitmap */
+            if (RUNP(rp) != rp || !GET_ALLOC(HDRP(rp)) ||
+                GET_SIZE(HDRP(rp)) < RUN_SIZE || !in_run(rp)) {
+                printf("Run 0x%lx is not a run block!\n", (long)rp);
+                printf("Line number is %d\n", lineno);
+            }
+            
+            /* Checks the object size and the link to the previous run */
+            if (GET(rp) != (idx + 1) * DSIZE || GET(RUN_PREV(rp)) != prev) {
+                printf("Run 0x%lx in wrong list!\n", (long)rp);
+                printf("Line number is %d\n", lineno);
+            }
+            
+            /* Checks the count of free objects matches the bitmap */
+            for (size_t i = 0; i < RUN_MAPSIZE / sizeof(long); ++i)
+                free_cnt += __builtin_popcountl(RUN_MAP(rp)[i]);
+            if (free_cnt != GET(RUN_FREE(rp)) || free_cnt == 0 ||
+                free_cnt > RUN_CAP(GET(rp))) {
+                printf("Run 0x%lx free count %u, bitmap %lu!\n",
+                       (long)rp, GET(RUN_FREE(rp)), (long)free_cnt);
+                printf("Line number is %d\n", lineno);
+            }
+            
+            prev = offset;
+            offset = GET(RUN_NEXT(rp));
+        }
+    }
+}
+#endif
+
+/*
+ * Checks the heap of one arena, or the whole heap
+ */
+static void check_arena(int lineno) {
     size_t free_cnt1;            // free block count in heap
     size_t free_cnt2;            // free block count in free list
     
@@ -712,3 +1476,20 @@ void mm_checkheap(int lineno) {
     }
     
 }
+
+/*
+ * mm_checkheap
+ */
+void mm_checkheap(int lineno) {
+#ifdef THREADS
+    for (size_t i = 0; i < ARENA_NUM; ++i) {
+        enter_arena(arenas[i]);
+        check_arena(lineno);
+        leave_arena(arenas[i]);
+    }
+#else
+    check_arena(lineno);
+    
+    check_runs(lineno);
+#endif
+}
@@ -0,0 +1,225 @@
+/*
+ * affinity.c
+ *
+ * The pinning of threads to CPUs, so that a connection is served on one
+ * core from its first packet to its last. A thread left to the scheduler
+ * may move between cores while it serves a request, and the socket
+ * buffers, the rio_t and the cache lines it touches then follow it from
+ * one L2 cache to the other.
+ *
+ * The CPUs to use are given as a list, e.g. "0-3,6". A connection is
+ * served on the CPU its packets arrive on, which SO_INCOMING_CPU tells,
+ * if that one is in the list, so that the softirq that received its
+ * data has left it in the cache of that core. Otherwise it is given the
+ * next CPU of the list in turn. Worker processes each take a CPU of the
+ * list, and a listening socket of their own in the same SO_REUSEPORT
+ * group, marked with their CPU, so that the kernel hands them the
+ * connections arriving there.
+ *
+ * The requests served on each CPU are counted, so that the balance
+ * between the cores can be seen. Each counter has a cache line of its
+ * own, since the cores bump them at once.
+ *
+ * This file needs _GNU_SOURCE for the cpu_set_t macros, which csapp.h
+ * does not build with, so it uses the system calls directly and reports
+ * errors to the caller.
+ */
+
+#define _GNU_SOURCE
+#include <sched.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include "affinity.h"
+
+#ifndef SO_INCOMING_CPU
+#define SO_INCOMING_CPU 49
+#endif
+
+static int cpu_list[MAX_CPUS];
+static int cpu_count = 0;           /* 0 while pinning is off */
+static char in_list[MAX_CPUS];      /* by CPU, whether it is listed */
+static unsigned long next_cpu = 0;  /* turn of the connections spread */
+static AffinityStats stats;
+
+static struct {
+    unsigned long requests;
+} __attribute__((aligned(64))) counters[MAX_CPUS];
+
+/*
+ * affinity_init - pin threads to the CPUs of list, such as "0-3,6".
+ * Return the number of CPUs in it, or -1 if it is malformed or names a
+ * CPU the process may not run on.
+ */
+int affinity_init(char *list)
+{
+    cpu_set_t allowed;
+    char *pos = list, *end;
+    long first, last;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+        return -1;
+    cpu_count = 0;
+    memset(in_list, 0, sizeof(in_list));
+    while (*pos != '\0') {
+        first = strtol(pos, &end, 10);
+        if (end == pos || first < 0)
+            return -1;
+        last = first;
+        if (*end == '-') {
+            pos = end + 1;
+            last = strtol(pos, &end, 10);
+            if (end == pos || last < first)
+                return -1;
+        }
+        if (last >= MAX_CPUS || (*end != ',' && *end != '\0'))
+            return -1;
+        for (long cpu = first; cpu <= last; ++cpu) {
+            if (!CPU_ISSET(cpu, &allowed))
+                return -1;
+            if (!in_list[cpu]) {
+                in_list[cpu] = 1;
+                cpu_list[cpu_count++] = cpu;
+            }
+        }
+        pos = *end == ',' ? end + 1 : end;
+    }
+    stats.cpus = cpu_count;
+    return cpu_count > 0 ? cpu_count : -1;
+}
+
+/*
+ * affinity_cpu - the i-th CPU of the list, wrapping around, or -1 if
+ * pinning is off
+ */
+int affinity_cpu(int i)
+{
+    return cpu_count > 0 ? cpu_list[i % cpu_count] : -1;
+}
+
+/*
+ * pin_thread - run the calling thread, and the threads it creates from
+ * now on, only on cpu. Return -1 if it cannot be pinned.
+ */
+int pin_thread(int cpu)
+{
+    cpu_set_t set;
+
+    if (cpu < 0 || cpu >= MAX_CPUS)
+        return -1;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0 ?
+           0 : -1;
+}
+
+/*
+ * connection_cpu - the CPU to serve connfd on: the one its packets
+ * arrive on if it is in the list, or else the next CPU of the list. -1
+ * if pinning is off.
+ */
+int connection_cpu(int connfd)
+{
+    socklen_t len = sizeof(int);
+    int cpu;
+
+    if (cpu_count == 0)
+        return -1;
+    if (getsockopt(connfd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == 0 &&
+        cpu >= 0 && cpu < MAX_CPUS && in_list[cpu]) {
+        __atomic_fetch_add(&stats.steered, 1, __ATOMIC_RELAXED);
+        return cpu;
+    }
+    __atomic_fetch_add(&stats.spread, 1, __ATOMIC_RELAXED);
+    return cpu_list[__atomic_fetch_add(&next_cpu, 1, __ATOMIC_RELAXED) %
+                    cpu_count];
+}
+
+/*
+ * open_steered_listenfd - open a listening socket on port, as
+ * open_listenfd does, that shares the port with the others opened for
+ * the other CPUs, and is preferred for the connections arriving on cpu.
+ * Return -1 on error.
+ */
+int open_steered_listenfd(char *port, int cpu)
+{
+    struct addrinfo hints, *listp, *p;
+    int listenfd = -1, optval = 1;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG | AI_NUMERICSERV;
+    if (getaddrinfo(NULL, port, &hints, &listp) != 0)
+        return -1;
+
+    for (p = listp; p; p = p->ai_next) {
+        if ((listenfd = socket(p->ai_family, p->ai_socktype,
+                               p->ai_protocol)) < 0)
+            continue;
+        // the CPU is set before bind, so that the socket is already
+        // marked when it joins the group
+        if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &optval,
+                       sizeof(int)) == 0 &&
+            setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &optval,
+                       sizeof(int)) == 0 &&
+            setsockopt(listenfd, SOL_SOCKET, SO_INCOMING_CPU, &cpu,
+                       sizeof(int)) == 0 &&
+            bind(listenfd, p->ai_addr, p->ai_addrlen) == 0)
+            break;
+        close(listenfd);
+    }
+    freeaddrinfo(listp);
+    if (!p)
+        return -1;
+
+    if (listen(listenfd, STEERED_LISTENQ) < 0) {
+        close(listenfd);
+        return -1;
+    }
+    return listenfd;
+}
+
+/*
+ * count_request - count a request served on the CPU of the caller
+ */
+void count_request(void)
+{
+    int cpu = sched_getcpu();
+
+    if (cpu >= 0 && cpu < MAX_CPUS)
+        __atomic_fetch_add(&counters[cpu].requests, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * get_cpu_requests - store in out, which holds max entries, the CPUs
+ * that served requests and how many. Return the number stored.
+ */
+int get_cpu_requests(CpuRequests *out, int max)
+{
+    int n = 0;
+
+    for (int cpu = 0; cpu < MAX_CPUS && n < max; ++cpu) {
+        unsigned long requests = __atomic_load_n(&counters[cpu].requests,
+                                                 __ATOMIC_RELAXED);
+        if (requests == 0)
+            continue;
+        out[n].cpu = cpu;
+        out[n].requests = requests;
+        ++n;
+    }
+    return n;
+}
+
+/*
+ * get_affinity_stats - copy the counters of the choice of CPUs to out
+ */
+void get_affinity_stats(AffinityStats *out)
+{
+    out->cpus = cpu_count;
+    out->steered = __atomic_load_n(&stats.steered, __ATOMIC_RELAXED);
+    out->spread = __atomic_load_n(&stats.spread, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,46 @@
+/*
+ * affinity.h
+ *
+ * Header file for the pinning of threads and connections to CPUs
+ */
+
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#define MAX_CPUS        256     /* CPUs counted and pinned to, at most */
+#define STEERED_LISTENQ 1024    /* backlog, as LISTENQ of csapp.h */
+
+/*
+ * requests served on a CPU, see get_cpu_requests
+ */
+typedef struct cpu_requests {
+    int cpu;
+    unsigned long requests;
+} CpuRequests;
+
+/*
+ * counters of the choice of CPUs for connections, see connection_cpu
+ */
+typedef struct affinity_stats {
+    int cpus;                   /* CPUs in the list, 0 if none */
+    unsigned long steered;      /* served where their packets arrive */
+    unsigned long spread;       /* given the next CPU of the list */
+} AffinityStats;
+
+int affinity_init(char *list);
+
+int affinity_cpu(int i);
+
+int pin_thread(int cpu);
+
+int connection_cpu(int connfd);
+
+int open_steered_listenfd(char *port, int cpu);
+
+void count_request(void);
+
+int get_cpu_requests(CpuRequests *out, int max);
+
+void get_affinity_stats(AffinityStats *stats);
+
+#endif
@@ -0,0 +1,101 @@
+/*
+ * arena.c
+ *
+ * Bump arenas for the buffers of a request. A connection takes an arena
+ * from a pool when it starts and gives it back when it is done, so that
+ * once the pool is warm a request allocates its buffers by moving a
+ * pointer, without calling malloc. An allocation that does not fit in
+ * the arena still succeeds, from the heap, and is freed on reset.
+ */
+
+#include "csapp.h"
+#include "arena.h"
+
+static Arena *idle_arenas = NULL;
+static int idle_count = 0;
+static pthread_mutex_t arena_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * arena_get - take an empty arena from the pool, or make a new one if
+ * the pool is empty
+ */
+Arena *arena_get(void)
+{
+    Arena *arena;
+
+    pthread_mutex_lock(&arena_mutex);
+    if ((arena = idle_arenas) != NULL) {
+        idle_arenas = arena->next;
+        --idle_count;
+    }
+    pthread_mutex_unlock(&arena_mutex);
+
+    if (arena == NULL) {
+        arena = Malloc(sizeof(Arena) + ARENA_SIZE);
+        arena->overflow = NULL;
+        arena->used = 0;
+    }
+    arena->next = NULL;
+    return arena;
+}
+
+/*
+ * arena_put - reset an arena and give it back to the pool. It is freed
+ * if the pool already holds MAX_IDLE_ARENAS.
+ */
+void arena_put(Arena *arena)
+{
+    arena_reset(arena);
+    pthread_mutex_lock(&arena_mutex);
+    if (idle_count < MAX_IDLE_ARENAS) {
+        arena->next = idle_arenas;
+        idle_arenas = arena;
+        ++idle_count;
+        arena = NULL;
+    }
+    pthread_mutex_unlock(&arena_mutex);
+    Free(arena);
+}
+
+/*
+ * arena_alloc - allocate size bytes, aligned to ARENA_ALIGN, that live
+ * until the arena is reset. The memory is not cleared.
+ */
+void *arena_alloc(Arena *arena, size_t size)
+{
+    size_t start = (arena->used + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+    ArenaBlock *block;
+
+    if (start <= ARENA_SIZE && size <= ARENA_SIZE - start) {
+        arena->used = start + size;
+        return arena->data + start;
+    }
+    block = Malloc(sizeof(ArenaBlock) + size);
+    block->next = arena->overflow;
+    arena->overflow = block;
+    return block->data;
+}
+
+/*
+ * arena_string - allocate a buffer of size bytes holding the empty string
+ */
+char *arena_string(Arena *arena, size_t size)
+{
+    char *s = arena_alloc(arena, size);
+
+    s[0] = '\0';
+    return s;
+}
+
+/*
+ * arena_reset - free everything allocated from an arena
+ */
+void arena_reset(Arena *arena)
+{
+    while (arena->overflow != NULL) {
+        ArenaBlock *block = arena->overflow;
+        arena->overflow = block->next;
+        Free(block);
+    }
+    arena->used = 0;
+}
@@ -0,0 +1,44 @@
+/*
+ * arena.h
+ *
+ * Header file for the per-connection bump arenas
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+#define ARENA_SIZE       (640 * 1024)   /* enough for a request and reply */
+#define ARENA_ALIGN      16
+#define MAX_IDLE_ARENAS  64             /* arenas kept in the pool */
+
+/*
+ * memory taken from the heap when an arena is full, freed on reset
+ */
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    char data[] __attribute__((aligned(ARENA_ALIGN)));
+} ArenaBlock;
+
+/*
+ * a bump arena. Its memory follows the struct in the same block.
+ */
+typedef struct Arena {
+    struct Arena *next;         /* next idle arena in the pool */
+    ArenaBlock *overflow;       /* allocations that did not fit */
+    size_t used;
+    char data[] __attribute__((aligned(ARENA_ALIGN)));
+} Arena;
+
+Arena *arena_get(void);
+
+void arena_put(Arena *arena);
+
+void *arena_alloc(Arena *arena, size_t size);
+
+char *arena_string(Arena *arena, size_t size);
+
+void arena_reset(Arena *arena);
+
+#endif
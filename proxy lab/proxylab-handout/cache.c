@@ -3,139 +3,894 @@
  * Xi Lin(xlin2)
  *
  * Implementations of cache module functions
+ *
+ * Cache lines are kept in a list ordered by recent use, and found through
+ * a hash index on the cache key. Each bucket of the index is a cache line
+ * holding the 64-bit hashes of a few lines, as fingerprints, next to the
+ * pointers to them, and a lookup only reads a line, and the key kept at
+ * its end, when the fingerprint matches. Writers (add_object and
+ * eviction) are serialized by read_insert_lock. Readers either
+ * 1) take read_insert_lock and read_update_lock, and move the line found
+ *    to the head of the list (the default), or
+ * 2) take no lock at all (set_cache_lockfree). They only walk the index,
+ *    which writers update with atomic stores, and mark the line found as
+ *    referenced. Eviction gives a referenced line a second chance instead
+ *    of relying on its position in the list.
+ * In both modes a removed line is not freed right away. It is retired
+ * with the current epoch, and the cache drops its reference to the line
+ * once every reader that could have found it in the index has left the
+ * epoch (epoch-based reclamation). A reader only stays in the epoch for
+ * the lookup, and takes its own reference to the line it found, so a
+ * slow client holds back its own line rather than the epoch.
+ *
+ * The budget, the object size limit and the eviction watermarks can be
+ * changed at any time. When the cache grows past the high watermark, or
+ * past the budget after a shrink, a background evictor removes lines in
+ * small batches until it is back under the low watermark, so a request
+ * never has to wait for a large eviction.
+ *
+ * An object is stored as a head, the headers of a response, and a body.
+ * The body may be compressed (add_response), in which case it is charged
+ * to the budget by its compressed length, and the reader decides whether
+ * to decompress it. With deduplication on (set_cache_dedup), bodies are
+ * also found by a 128-bit hash of their content, and lines with the same
+ * body share one copy, charged to the budget once. The hash alone
+ * decides, without comparing the bytes.
+ *
+ * An object past the object limit may instead go to a chunked line
+ * (start_object), whose body is a list of CHUNK_SIZE chunks appended as
+ * the response arrives. Chunked lines have a list and a budget of their
+ * own, so a few large files cannot push out the many small hot objects,
+ * and each chunk is charged as it is added. A chunked line is in the
+ * index from its first byte: readers follow it as it fills, waiting on
+ * its condition variable for more, and stop if filling is given up. It
+ * is evicted whole, by least recent use, to make room for a new chunk.
+ *
+ * The other lines are split into partitions by the host of their key
+ * (add_cache_partition), each with a list and a byte quota of its own;
+ * the hosts no pattern matches share the default partition. A partition
+ * may grow past its quota while the budget has room, but eviction takes
+ * the lines of partitions over their quota first, so the scan of one
+ * host cannot push out the lines another host keeps within its quota.
+ * Otherwise the least recently used line of all partitions goes, found
+ * by comparing the stamps of their tails.
+ *
+ * The few hottest objects would make every core write the same line and
+ * locks on each hit. With replicas on (set_cache_replicas), each core
+ * samples the hits it sees, and gives a line hit often enough a read-only
+ * copy of its own, checked before the shared cache under a lock only that
+ * core uses. Writers note the hash of every line they remove in a ring,
+ * which a core reads to drop its stale copies once it has moved; a core
+ * that fell too far behind drops them all. A copy shares the body of its
+ * line, and a sample of its hits still updates the line's recency.
+ *
+ * The heads and bodies of the lines come from payload_alloc, which takes
+ * them from a huge-page arena sized to the budget if it is on
+ * (set_cache_arena), and from the heap otherwise. The chunks of the
+ * chunked lines always come from the heap.
+ *
+ * The replacement policy decides what a hit does to its line (LRU, CLOCK
+ * or FIFO), and the admission policy which missed objects are cached at
+ * all. Both exist so that the trace replay in cachesim.c can compare
+ * them; the proxy uses LRU and admits everything by default.
+ *
+ * Built with LOCK_PROFILE, every acquisition of the two rwlocks is timed
+ * and counted by the place it is made at (dump_cache_locks), to tell
+ * which of them the readers and writers queue on.
  */
 
+#include <limits.h>
+#include <sched.h>
 #include "cache.h"
 #include "csapp.h"
+#include "payload.h"
+#include "lockprof.h"
+
+/* In glibc, but only declared with _GNU_SOURCE, which csapp.h does not
+ * build with */
+int sched_getcpu(void);
+
+#define INDEX_SIZE (1 << INDEX_BITS)
+#define INDEX_MASK (INDEX_SIZE - 1)
+#define BUCKET_COUNT (1 << BUCKET_BITS)
+#define BUCKET_MASK  (BUCKET_COUNT - 1)
+#define SEEN_SIZE  (1 << SEEN_BITS)
+#define SEEN_MASK  (SEEN_SIZE - 1)
+
+Partition partitions[MAX_PARTITIONS]; /* lists of the lines by host */
+int part_count = 1;             /* partitions, the default one included */
+unsigned long c_tick = 0;       /* stamp of the last line put at a head */
+IndexBucket c_index[BUCKET_COUNT]; /* lines by the hash of their key */
+CacheBody *b_index[INDEX_SIZE]; /* bodies by content hash, for dedup */
+CacheList large_list;           /* list of the chunked lines */
+CacheLine *c_retired[3];        /* removed lines, by epoch modulo 3 */
+long retired_bytes = 0;         /* size of the lines in c_retired */
+long remain_size = DEFAULT_CACHE_SIZE; /* negative after a shrink */
+int c_count = 0;                /* number of lines in the list */
+int l_count = 0;                /* number of chunked lines */
+long large_remain = DEFAULT_LARGE_SIZE; /* negative after a shrink */
+int c_lockfree = 0;             /* readers take no lock */
+pthread_rwlock_t read_update_lock = PTHREAD_RWLOCK_INITIALIZER;
+pthread_rwlock_t read_insert_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* Places the rwlocks are taken at, profiled with LOCK_PROFILE */
+#define SITE_GET_READ       0
+#define SITE_GET_INDEX      1
+#define SITE_GET_PROMOTE    2
+#define SITE_ADD_INSERT     3
+#define SITE_START          4
+#define SITE_APPEND         5
+#define SITE_FINISH         6
+#define SITE_EVICT          7
+#define SITE_REPLICA        8
+#define SITE_TOUCH          9
+#define SITE_TOUCH_PROMOTE  10
+#define SITE_ADMIN          11
+#define LOCK_SITES          12
+#define SITE(name)          (&lock_sites[SITE_##name])
+
+#ifdef LOCK_PROFILE
+LockSite lock_sites[LOCK_SITES] = {
+	[SITE_GET_READ] = {"read_insert_lock", "get_object_read"},
+	[SITE_GET_INDEX] = {"read_update_lock", "get_object_index"},
+	[SITE_GET_PROMOTE] = {"read_update_lock", "get_object_promote"},
+	[SITE_ADD_INSERT] = {"read_insert_lock", "add_object_insert"},
+	[SITE_START] = {"read_insert_lock", "start_object"},
+	[SITE_APPEND] = {"read_insert_lock", "append_object"},
+	[SITE_FINISH] = {"read_insert_lock", "finish_object"},
+	[SITE_EVICT] = {"read_insert_lock", "evictor"},
+	[SITE_REPLICA] = {"read_insert_lock", "replica_check"},
+	[SITE_TOUCH] = {"read_insert_lock", "touch_origin"},
+	[SITE_TOUCH_PROMOTE] = {"read_update_lock", "touch_origin_promote"},
+	[SITE_ADMIN] = {"read_insert_lock", "limits_and_stats"},
+};
+#endif
+
+/* Runtime limits, changed under read_insert_lock */
+long c_budget = DEFAULT_CACHE_SIZE;
+int object_limit = DEFAULT_OBJECT_SIZE;
+int high_mark = DEFAULT_HIGH_MARK;
+int low_mark = DEFAULT_LOW_MARK;
+int c_policy = POLICY_LRU;
+int c_admission = ADMIT_ALL;
+int c_dedup = 0;
+int c_arena = 0;
+long large_budget = DEFAULT_LARGE_SIZE;
+
+/* Hot-object replicas, one set per core */
+int c_replicas = 0;
+ReplicaSet *replica_sets = NULL;
+int replica_count = 0;
+unsigned long inval_seq = 0;    /* lines removed, changed under
+                                   read_insert_lock */
+unsigned long inval_ring[INVAL_RING]; /* hashes of the last ones */
 
-CacheLine *c_head = NULL;
-CacheLine *c_tail = NULL;
-unsigned remain_size = MAX_CACHE_SIZE;
-pthread_rwlock_t read_update_lock;
-pthread_rwlock_t read_insert_lock;
+/* Doorkeeper of ADMIT_SECOND, one bit per hash of a missed object */
+unsigned long c_seen[SEEN_SIZE / 64];
+int c_seen_count = 0;
 
-/* 
+/* Counters of the writers, changed under read_insert_lock */
+CacheStats c_stats;
+
+/* Background evictor */
+int evictor_running = 0;
+int evict_pending = 0;
+pthread_mutex_t evict_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t evict_cond = PTHREAD_COND_INITIALIZER;
+
+/* Epoch-based reclamation */
+unsigned long global_epoch = 0;
+EpochSlot *epoch_slots = NULL;  /* reader records, never freed */
+static __thread EpochSlot *my_slot = NULL;
+static pthread_key_t slot_key;
+static pthread_once_t slot_once = PTHREAD_ONCE_INIT;
+
+/* Helper function declaration */
+static CacheLine *find_line(char *key, unsigned long hash);
+static void mark_referenced(CacheLine *line);
+static int admit_object(unsigned long hash);
+static long eviction_target();
+static void wake_evictor();
+static void *evictor_job(void *arg);
+static void epoch_enter();
+static void epoch_exit();
+static EpochSlot *acquire_slot();
+static void release_slot(void *slot);
+static void make_slot_key();
+static void unref_line(CacheLine *line);
+static CacheList *list_of(CacheLine *line);
+static Partition *victim_partition();
+static int find_partition(char *key);
+static int host_matches(char *pattern, char *host, int len);
+static void count_lookup(char *key, CacheLine *line);
+static void free_list(CacheList *list);
+static CacheLine *make_line(char *key, unsigned long hash, char *head,
+                            int head_length);
+static void unlink_line(CacheLine *line);
+static int add_chunk(CacheLine *line);
+static CacheStream *new_stream();
+static void end_stream(CacheStream *stream, int state);
+static void free_stream(CacheStream *stream);
+static long saved_bytes(CacheLine *line);
+static CacheBody *new_body(char *data, int length);
+static long attach_body(CacheLine *line, CacheBody *body);
+static long detach_body(CacheLine *line);
+static void unref_body(CacheBody *body);
+static void hash_body(char *data, int length, unsigned long *digest);
+static ReplicaSet *my_replica_set();
+static CacheLine *replica_get(char *key, unsigned long hash);
+static void note_hit(CacheLine *line);
+static void make_replica(ReplicaSet *set, CacheLine *line);
+static void drop_replica(Replica *replica);
+static void apply_removals(ReplicaSet *set);
+static void touch_origin(CacheLine *origin);
+static void note_removal(CacheLine *line);
+
+/*
  * init_cache - initialize cache data, set head and tail pointers to be
- * NULL, and set the available size to be MAX_CACHE_SIZE
+ * NULL, and set the available size to be the budget. The locks are
+ * initialized statically, so the cache can be emptied with free_cache
+ * and initialized again, and the limits may be set before this.
  */
 void init_cache() {
-	c_head = NULL;
-	c_tail = NULL;
-	remain_size = MAX_CACHE_SIZE;
+	for (int i = 0; i < part_count; ++i) {
+		Partition *part = &partitions[i];
+		part->list.head = NULL;
+		part->list.tail = NULL;
+		part->stats.used = 0;
+		part->stats.lines = 0;
+		part->stats.hits = 0;
+		part->stats.misses = 0;
+		part->stats.evictions = 0;
+	}
+	large_list.head = NULL;
+	large_list.tail = NULL;
+	memset(c_retired, 0, sizeof(c_retired));
+	retired_bytes = 0;
+	c_count = 0;
+	l_count = 0;
+	memset(c_index, 0, sizeof(c_index));
+	memset(b_index, 0, sizeof(b_index));
+	memset(c_seen, 0, sizeof(c_seen));
+	memset(&c_stats, 0, sizeof(c_stats));
+	c_seen_count = 0;
+	remain_size = c_budget;
+	large_remain = large_budget;
+
+	if (c_replicas && replica_sets == NULL) {
+		replica_count = sysconf(_SC_NPROCESSORS_CONF);
+		if (replica_count < 1)
+			replica_count = 1;
+		if (posix_memalign((void **)&replica_sets, 64,
+		                   replica_count * sizeof(ReplicaSet)) != 0)
+			app_error("posix_memalign error");
+		memset(replica_sets, 0, replica_count * sizeof(ReplicaSet));
+		for (int i = 0; i < replica_count; ++i)
+			pthread_mutex_init(&replica_sets[i].lock, NULL);
+	}
+	for (int i = 0; i < replica_count; ++i)
+		replica_sets[i].seen = inval_seq;
+
+	// a quarter more than the budget, for the lines retired but not
+	// freed yet and the block tags. Mapped once, for good.
+	if (c_arena)
+		payload_init(c_budget + c_budget / 4);
+}
+
+/*
+ * set_cache_lockfree - choose whether get_object takes locks. It must
+ * not be changed while any reader is in the cache.
+ */
+void set_cache_lockfree(int enable) {
+	c_lockfree = enable;
+}
+
+/*
+ * set_cache_budget - change the total size of the cache. After a shrink,
+ * the lines over the new budget are evicted in the background if the
+ * evictor runs, or right away otherwise.
+ */
+void set_cache_budget(long budget) {
+	PROFILED_WRLOCK(&read_insert_lock, SITE(ADMIN));
+	remain_size += budget - c_budget;
+	c_budget = budget;
+	if (!evictor_running && remain_size < 0) {
+		evict_cache_line(0, -1);
+		reclaim_cache_lines();
+	}
+	PROFILED_UNLOCK(&read_insert_lock, SITE(ADMIN));
+
+	if (evictor_running)
+		wake_evictor();
+}
+
+/*
+ * set_object_limit - change the size of the largest object cached, at
+ * most MAX_OBJECT_LIMIT
+ */
+void set_object_limit(int limit) {
+	if (limit > MAX_OBJECT_LIMIT)
+		limit = MAX_OBJECT_LIMIT;
+	__atomic_store_n(&object_limit, limit, __ATOMIC_RELAXED);
+}
+
+/*
+ * set_cache_watermarks - the evictor starts when more than high percent
+ * of the budget is used, and stops at low percent
+ */
+void set_cache_watermarks(int high, int low) {
+	PROFILED_WRLOCK(&read_insert_lock, SITE(ADMIN));
+	high_mark = high;
+	low_mark = low;
+	PROFILED_UNLOCK(&read_insert_lock, SITE(ADMIN));
+
+	if (evictor_running)
+		wake_evictor();
+}
+
+/*
+ * set_cache_policy - choose what a hit does to its line, one of
+ * POLICY_LRU, POLICY_CLOCK and POLICY_FIFO. Lock-free readers cannot move
+ * lines, so they treat LRU as CLOCK.
+ */
+void set_cache_policy(int policy) {
+	__atomic_store_n(&c_policy, policy, __ATOMIC_RELAXED);
+}
+
+/*
+ * set_cache_admission - choose which missed objects are cached, either
+ * ADMIT_ALL or ADMIT_SECOND
+ */
+void set_cache_admission(int admission) {
+	__atomic_store_n(&c_admission, admission, __ATOMIC_RELAXED);
+}
+
+/*
+ * set_cache_dedup - choose whether lines with the same body share it.
+ * It must be set before init_cache.
+ */
+void set_cache_dedup(int enable) {
+	c_dedup = enable;
+}
+
+/*
+ * set_cache_arena - choose whether the heads and bodies of the lines are
+ * kept in a huge-page arena. Called before init_cache.
+ */
+void set_cache_arena(int enable) {
+	c_arena = enable;
+}
+
+/*
+ * set_cache_replicas - choose whether hot lines are replicated to each
+ * core. Called before init_cache.
+ */
+void set_cache_replicas(int enable) {
+	c_replicas = enable;
 }
 
-/* 
+/*
+ * add_cache_partition - give the hosts matching pattern a partition of
+ * their own, of quota bytes, or of no quota if quota is 0. A pattern is
+ * a host, "*.domain" for the domain and its subdomains, or "*" for any
+ * host; the first one added that matches decides. It must be called
+ * before init_cache. Return the index of the partition, or -1 if there
+ * are too many or the pattern is too long.
+ */
+int add_cache_partition(char *pattern, long quota) {
+	Partition *part;
+
+	if (part_count == MAX_PARTITIONS || strlen(pattern) >= PATTERN_SIZE)
+		return -1;
+	part = &partitions[part_count];
+	strcpy(part->stats.pattern, pattern);
+	part->stats.quota = quota;
+	return part_count++;
+}
+
+/*
+ * set_large_budget - change the total size of the chunked lines. After a
+ * shrink, the chunked lines over the new budget are evicted right away.
+ */
+void set_large_budget(long budget) {
+	PROFILED_WRLOCK(&read_insert_lock, SITE(ADMIN));
+	large_remain += budget - large_budget;
+	large_budget = budget;
+	if (large_remain < 0) {
+		evict_large_line(0, NULL);
+		reclaim_cache_lines();
+	}
+	PROFILED_UNLOCK(&read_insert_lock, SITE(ADMIN));
+}
+
+long get_cache_budget() {
+	return __atomic_load_n(&c_budget, __ATOMIC_RELAXED);
+}
+
+int get_object_limit() {
+	return __atomic_load_n(&object_limit, __ATOMIC_RELAXED);
+}
+
+long get_cache_used() {
+	return __atomic_load_n(&c_budget, __ATOMIC_RELAXED) -
+	       __atomic_load_n(&remain_size, __ATOMIC_RELAXED);
+}
+
+long get_large_budget() {
+	return __atomic_load_n(&large_budget, __ATOMIC_RELAXED);
+}
+
+long get_large_used() {
+	return __atomic_load_n(&large_budget, __ATOMIC_RELAXED) -
+	       __atomic_load_n(&large_remain, __ATOMIC_RELAXED);
+}
+
+void get_cache_watermarks(int *high, int *low) {
+	*high = __atomic_load_n(&high_mark, __ATOMIC_RELAXED);
+	*low = __atomic_load_n(&low_mark, __ATOMIC_RELAXED);
+}
+
+/*
+ * get_cache_stats - copy the writer counters to stats. Hits and misses
+ * are not counted here, to keep readers from sharing a counter.
+ */
+void get_cache_stats(CacheStats *stats) {
+	PROFILED_RDLOCK(&read_insert_lock, SITE(ADMIN));
+	*stats = c_stats;
+	stats->rejects = __atomic_load_n(&c_stats.rejects, __ATOMIC_RELAXED);
+	stats->retired_bytes = retired_bytes;
+	PROFILED_UNLOCK(&read_insert_lock, SITE(ADMIN));
+
+	// the counters of a core are only read here, racing with its hits
+	for (int i = 0; i < replica_count; ++i) {
+		stats->replicas += __atomic_load_n(&replica_sets[i].made,
+		                                   __ATOMIC_RELAXED);
+		stats->replica_hits += __atomic_load_n(&replica_sets[i].hits,
+		                                       __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * get_partition_stats - copy the counters of up to max partitions to
+ * stats, the default one first. Return how many were copied.
+ */
+int get_partition_stats(PartitionStats *stats, int max) {
+	int count = part_count < max ? part_count : max;
+
+	PROFILED_RDLOCK(&read_insert_lock, SITE(ADMIN));
+	for (int i = 0; i < count; ++i) {
+		stats[i] = partitions[i].stats;
+		stats[i].hits = __atomic_load_n(&partitions[i].stats.hits,
+		                                __ATOMIC_RELAXED);
+		stats[i].misses = __atomic_load_n(&partitions[i].stats.misses,
+		                                  __ATOMIC_RELAXED);
+	}
+	PROFILED_UNLOCK(&read_insert_lock, SITE(ADMIN));
+	return count;
+}
+
+/*
+ * dump_cache_locks - print the acquisitions of the cache rwlocks, with
+ * their wait and hold times, to buf, which holds size bytes. Return the
+ * length printed, which only says the profiler is off unless the cache
+ * was built with LOCK_PROFILE.
+ */
+int dump_cache_locks(char *buf, int size) {
+#ifdef LOCK_PROFILE
+	return dump_lock_sites(lock_sites, LOCK_SITES, buf, size);
+#else
+	int n = snprintf(buf, size, "lock profiling is off, build with "
+	                 "make LOCK_PROFILE=1\n");
+
+	return n < size ? n : size - 1;
+#endif
+}
+
+/*
+ * start_evictor - create the background evictor thread
+ */
+void start_evictor() {
+	pthread_t tid;
+
+	evictor_running = 1;
+	Pthread_create(&tid, NULL, evictor_job, NULL);
+}
+
+/*
  * get_object - search for a specific object from cache accroding to the
- * given uri string
+ * given cache key and its hash. The line returned stays valid until
+ * release_object is called on it, even if it is evicted meanwhile.
  */
-CacheLine *get_object(char *uri) {
-	CacheLine *cursor = c_head;
-	int found = 0;
-	
-	// get read lock so that when traversing the cache, no other thread
-	// is able to change the position a cache line or add a new line 
-	pthread_rwlock_rdlock(&read_insert_lock);
-	pthread_rwlock_rdlock(&read_update_lock);
-	
-	while (cursor != NULL) {
-		if (strcmp(cursor->tag, uri) == 0) {
-			found = 1;
-			break;
+CacheLine *get_object(char *key, unsigned long hash) {
+	CacheLine *cursor;
+	int policy = __atomic_load_n(&c_policy, __ATOMIC_RELAXED);
+
+	if (c_replicas && (cursor = replica_get(key, hash)) != NULL)
+		return cursor;
+
+	epoch_enter();
+
+	if (c_lockfree) {
+		cursor = find_line(key, hash);
+		count_lookup(key, cursor);
+		if (cursor == NULL) {
+			epoch_exit();
+			return NULL;
 		}
-		cursor = cursor->next;
+		if (policy != POLICY_FIFO)
+			mark_referenced(cursor);
+		__atomic_add_fetch(&cursor->refs, 1, __ATOMIC_RELAXED);
+		epoch_exit();
+		if (c_replicas)
+			note_hit(cursor);
+		return cursor;
 	}
-	pthread_rwlock_unlock(&read_update_lock);
-	
+
+	// get read lock so that when traversing the cache, no other thread
+	// is able to change the position a cache line or add a new line
+	PROFILED_RDLOCK(&read_insert_lock, SITE(GET_READ));
+	PROFILED_RDLOCK(&read_update_lock, SITE(GET_INDEX));
+	cursor = find_line(key, hash);
+	PROFILED_UNLOCK(&read_update_lock, SITE(GET_INDEX));
+	count_lookup(key, cursor);
+
 	// if not found, release the lock and return
-	if (found == 0) {
-		pthread_rwlock_unlock(&read_insert_lock);
+	if (cursor == NULL) {
+		PROFILED_UNLOCK(&read_insert_lock, SITE(GET_READ));
+		epoch_exit();
 		return NULL;
 	}
-	
+
+	__atomic_add_fetch(&cursor->refs, 1, __ATOMIC_RELAXED);
+
 	// if found, move the cache line to the head of cache list
-	pthread_rwlock_wrlock(&read_update_lock);
-	remove_cache_line(cursor);
-	insert_cache_line(cursor);
-	pthread_rwlock_unlock(&read_update_lock);
-	
-	pthread_rwlock_unlock(&read_insert_lock);
-	
+	if (policy == POLICY_LRU) {
+		PROFILED_WRLOCK(&read_update_lock, SITE(GET_PROMOTE));
+		remove_cache_line(cursor);
+		insert_cache_line(cursor);
+		PROFILED_UNLOCK(&read_update_lock, SITE(GET_PROMOTE));
+	}
+	else if (policy == POLICY_CLOCK) {
+		mark_referenced(cursor);
+	}
+
+	PROFILED_UNLOCK(&read_insert_lock, SITE(GET_READ));
+	epoch_exit();
+	if (c_replicas)
+		note_hit(cursor);
+
 	return cursor;
 }
 
-/* 
+/*
+ * release_object - tell the cache that a line returned by get_object is
+ * no longer used, so that it can be freed after being evicted
+ */
+void release_object(CacheLine *line) {
+	unref_line(line);
+}
+
+/*
  * add_object - add a new cache line to the cache
  */
-void add_object(char *uri, char *object, int length)
+void add_object(char *key, unsigned long hash, char *object, int length)
+{
+	add_response(key, hash, object, length, 0, 0);
+}
+
+/*
+ * add_response - add a new cache line whose object is head_length bytes
+ * of headers followed by a body. With raw_length not 0, the body is
+ * gzipped, and the object is raw_length bytes long once decompressed.
+ * The size limit applies to length, and so does the budget, except for
+ * a body already cached by another line.
+ */
+void add_response(char *key, unsigned long hash, char *object, int length,
+                  int head_length, int raw_length)
 {
-	pthread_rwlock_wrlock(&read_insert_lock);
-	
-	CacheLine *new_line = Malloc(sizeof(CacheLine));
-	
-	// set each field of new cache line
-	new_line->prev = NULL;
-	new_line->next = NULL;
+	CacheLine *new_line;
+	CacheLine *old_line;
+	CacheBody *body;
+	long charge;
+
+	if (length > get_object_limit() || !admit_object(hash)) {
+		__atomic_add_fetch(&c_stats.rejects, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	// the body is copied and hashed before taking the lock, even if a
+	// shared one replaces it
+	new_line = make_line(key, hash, object, head_length);
 	new_line->length = length;
-	new_line->tag = Malloc(MAXLINE);
-	new_line->object = Malloc(MAX_OBJECT_SIZE);
-	strcpy(new_line->tag, uri);
-	strncpy(new_line->object, object, length);
-	
+	new_line->raw_length = raw_length;
+	body = new_body(object + head_length, length - head_length);
+
+	PROFILED_WRLOCK(&read_insert_lock, SITE(ADD_INSERT));
+
+	// another thread may have cached the same object in the meantime,
+	// the new line replaces it
+	if ((old_line = find_line(key, hash)) != NULL)
+		unlink_line(old_line);
+
+	// the line takes its own reference to the body it uses
+	charge = attach_body(new_line, body);
+	unref_body(body);
+
 	// if remaining size is not enough, evict cache lines that have not
-	// been accessed for a long time
-	if (remain_size < length) {
-		evict_cache_line(length);
+	// been accessed for a long time. While the evictor works off a
+	// shrink, the object is not cached rather than evicting here.
+	if (remain_size < charge) {
+		if (remain_size >= 0 || !evictor_running)
+			evict_cache_line(charge, -1);
+		if (remain_size < charge) {
+			detach_body(new_line);
+			reclaim_cache_lines();
+			__atomic_add_fetch(&c_stats.rejects, 1, __ATOMIC_RELAXED);
+			PROFILED_UNLOCK(&read_insert_lock, SITE(ADD_INSERT));
+			free_cache_line(new_line);
+			return;
+		}
 	}
-	remain_size -= length;
+	remain_size -= charge;
 	insert_cache_line(new_line);
-	
-	pthread_rwlock_unlock(&read_insert_lock);
+	insert_index(new_line);
+	++c_count;
+	partitions[new_line->partition].stats.used += length;
+	++partitions[new_line->partition].stats.lines;
+	++c_stats.inserts;
+	if (raw_length > 0) {
+		++c_stats.compressed;
+		c_stats.saved_bytes += saved_bytes(new_line);
+	}
+
+	reclaim_cache_lines();
+
+	if (evictor_running && eviction_target() > remain_size)
+		wake_evictor();
+
+	PROFILED_UNLOCK(&read_insert_lock, SITE(ADD_INSERT));
+}
+
+/*
+ * start_object - add a chunked line for an object past the object
+ * limit, whose headers are known and whose body is to come through
+ * append_object. expected is the length of the body if known, or -1.
+ * Return the line, which the caller must give to finish_object, or NULL
+ * if it is not cached: it cannot fit in the large budget, or another
+ * request is already filling a line for it.
+ */
+CacheLine *start_object(char *key, unsigned long hash, char *head,
+                        int head_length, long expected)
+{
+	CacheLine *line;
+	CacheLine *old_line;
+
+	if (head_length + (expected > 0 ? expected : CHUNK_SIZE) >
+	    get_large_budget() || !admit_object(hash)) {
+		__atomic_add_fetch(&c_stats.rejects, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+	line = make_line(key, hash, head, head_length);
+	line->stream = new_stream();
+	line->refs = 2;     // one for the cache, one for the filler
+
+	PROFILED_WRLOCK(&read_insert_lock, SITE(START));
+
+	if ((old_line = find_line(key, hash)) != NULL) {
+		if (old_line->stream != NULL &&
+		    old_line->stream->state == STREAM_FILLING) {
+			PROFILED_UNLOCK(&read_insert_lock, SITE(START));
+			free_cache_line(line);
+			return NULL;
+		}
+		unlink_line(old_line);
+	}
+	if (large_remain < head_length &&
+	    !evict_large_line(head_length, NULL)) {
+		reclaim_cache_lines();
+		__atomic_add_fetch(&c_stats.rejects, 1, __ATOMIC_RELAXED);
+		PROFILED_UNLOCK(&read_insert_lock, SITE(START));
+		free_cache_line(line);
+		return NULL;
+	}
+	large_remain -= head_length;
+	insert_cache_line(line);
+	insert_index(line);
+	++l_count;
+	++c_stats.large_objects;
+
+	reclaim_cache_lines();
+	PROFILED_UNLOCK(&read_insert_lock, SITE(START));
+	return line;
+}
+
+/*
+ * append_object - add length bytes to the body of a chunked line being
+ * filled, and wake its readers. Return -1 if the line is not filled
+ * anymore, as it was evicted or outgrew the large budget, else 0.
+ */
+int append_object(CacheLine *line, char *data, int length)
+{
+	CacheStream *stream = line->stream;
+	long filled = stream->filled;
+
+	if (__atomic_load_n(&stream->state, __ATOMIC_RELAXED) != STREAM_FILLING)
+		return -1;
+	while (length > 0) {
+		int offset = filled % CHUNK_SIZE;
+		int n = CHUNK_SIZE - offset < length ? CHUNK_SIZE - offset : length;
+
+		if (offset == 0 && add_chunk(line) < 0)
+			return -1;
+		memcpy(stream->last->data + offset, data, n);
+		data += n;
+		length -= n;
+		filled += n;
+	}
+
+	pthread_mutex_lock(&stream->mutex);
+	stream->filled = filled;
+	pthread_cond_broadcast(&stream->cond);
+	pthread_mutex_unlock(&stream->mutex);
+	return 0;
+}
+
+/*
+ * finish_object - the filler of a chunked line is done with it. If the
+ * whole object was appended, readers may serve it from now on; otherwise
+ * the line leaves the cache.
+ */
+void finish_object(CacheLine *line, int complete)
+{
+	PROFILED_WRLOCK(&read_insert_lock, SITE(FINISH));
+	if (line->stream->state == STREAM_FILLING) {
+		if (complete)
+			end_stream(line->stream, STREAM_DONE);
+		else
+			unlink_line(line);
+	}
+	reclaim_cache_lines();
+	PROFILED_UNLOCK(&read_insert_lock, SITE(FINISH));
+
+	unref_line(line);
+}
+
+/*
+ * read_stream - the next part of the body of a chunked line, from byte
+ * pos on. *chunk is the chunk of the previous part, or NULL for the first
+ * part, and must be given back as is. While the line is filled, wait for
+ * the part to arrive. Store the start of the part in *data, and return
+ * its length, 0 at the end of the body, or -1 if filling was given up
+ * before pos.
+ */
+long read_stream(CacheLine *line, long pos, CacheChunk **chunk,
+                 char **data)
+{
+	CacheStream *stream = line->stream;
+	int offset = pos % CHUNK_SIZE, state;
+	long filled;
+
+	pthread_mutex_lock(&stream->mutex);
+	while ((filled = stream->filled) <= pos &&
+	       stream->state == STREAM_FILLING)
+		pthread_cond_wait(&stream->cond, &stream->mutex);
+	state = stream->state;
+	pthread_mutex_unlock(&stream->mutex);
+
+	if (filled <= pos)
+		return state == STREAM_DONE ? 0 : -1;
+	if (*chunk == NULL)
+		*chunk = stream->first;
+	else if (offset == 0)
+		*chunk = (*chunk)->next;
+	*data = (*chunk)->data + offset;
+	return filled - pos < CHUNK_SIZE - offset ? filled - pos :
+	       CHUNK_SIZE - offset;
 }
 
-/* 
- * insert_cache_line - insert a cache line to the head of the list
+/*
+ * insert_cache_line - insert a cache line to the head of its list
  */
 void insert_cache_line(CacheLine *target) {
-	if (c_head == NULL) {
-		c_head = target;
-		c_tail = target;
+	CacheList *list = list_of(target);
+
+	target->prev = NULL;
+	target->stamp = ++c_tick;
+	if (list->head == NULL) {
+		target->next = NULL;
+		list->head = target;
+		list->tail = target;
 	}
 	else {
-		target->next = c_head;
-		c_head->prev = target;
-		c_head = target;
+		target->next = list->head;
+		list->head->prev = target;
+		list->head = target;
 	}
 }
 
-/* 
- * evict_cache_line - remove some cache lines that haven't been accessed 
+/*
+ * evict_cache_line - remove some cache lines that haven't been accessed
  * for a long time, so that the remaining size is enough to hold a new
- * line.
+ * line. A line referenced by a lock-free reader since it was last looked
+ * at is moved back to the head once instead. At most max_lines lines are
+ * evicted, or all that are needed if max_lines is negative. Return 1 if
+ * the remaining size is now enough.
  */
-void evict_cache_line(int size)
+int evict_cache_line(long size, int max_lines)
 {
-	CacheLine *cursor = c_tail;
-	unsigned temp_size = remain_size;
-	// search for evict lines from the tail of the cache
-	while (cursor != NULL && temp_size < size) {
-		temp_size += cursor->length;
-		remove_cache_line(cursor);
-		free_cache_line(cursor);
-		cursor = c_tail;
+	Partition *part;
+	int chances = c_count;
+
+	// search for evict lines from the tails of the partitions, those
+	// over their quota first
+	while (remain_size < size && max_lines != 0 &&
+	       (part = victim_partition()) != NULL) {
+		CacheLine *cursor = part->list.tail;
+		if (chances > 0 &&
+		    __atomic_load_n(&cursor->referenced, __ATOMIC_RELAXED)) {
+			__atomic_store_n(&cursor->referenced, 0, __ATOMIC_RELAXED);
+			remove_cache_line(cursor);
+			insert_cache_line(cursor);
+			--chances;
+		}
+		else {
+			unlink_line(cursor);
+			++c_stats.evictions;
+			c_stats.evicted_bytes += cursor->length;
+			++part->stats.evictions;
+			--max_lines;
+		}
+	}
+	return remain_size >= size;
+}
+
+/*
+ * evict_large_line - remove chunked lines, least recently used first,
+ * until size bytes of the large budget are free. keep, the line that
+ * needs the room, is never removed. A referenced line gets a second
+ * chance, as in evict_cache_line. Return 1 if there is room now.
+ */
+int evict_large_line(long size, CacheLine *keep)
+{
+	CacheLine *cursor = large_list.tail;
+	int chances = l_count;
+
+	while (cursor != NULL && large_remain < size) {
+		CacheLine *prev = cursor->prev;
+
+		if (cursor == keep) {
+			cursor = prev;
+			continue;
+		}
+		if (chances > 0 &&
+		    __atomic_load_n(&cursor->referenced, __ATOMIC_RELAXED)) {
+			__atomic_store_n(&cursor->referenced, 0, __ATOMIC_RELAXED);
+			remove_cache_line(cursor);
+			insert_cache_line(cursor);
+			--chances;
+		}
+		else {
+			unlink_line(cursor);
+			++c_stats.evictions;
+			c_stats.evicted_bytes += cursor->length;
+		}
+		cursor = prev;
 	}
-	remain_size = temp_size;
+	return large_remain >= size;
 }
 
-/* 
- * remove_cache_line - remove a cache line from the cache list
+/*
+ * remove_cache_line - remove a cache line from its list
  */
 void remove_cache_line(CacheLine *target)
 {
-	if (c_head == target) {
-		c_head = target->next;
+	CacheList *list = list_of(target);
+
+	if (list->head == target) {
+		list->head = target->next;
 	}
-	if (c_tail == target) {
-		c_tail = target->prev;
+	if (list->tail == target) {
+		list->tail = target->prev;
 	}
 	if (target->prev) {
 		target->prev->next = target->next;
@@ -145,41 +900,1000 @@ void remove_cache_line(CacheLine *target)
 	}
 }
 
-/* 
+/*
+ * insert_index - add a cache line to a free way of its index bucket, or
+ * to the chain past them. The fingerprint is stored before the line,
+ * which is published with a release store, so a lock-free reader that
+ * finds it also sees its fingerprint and all of its fields.
+ */
+void insert_index(CacheLine *target)
+{
+	IndexBucket *bucket = &c_index[target->hash & BUCKET_MASK];
+
+	for (int i = 0; i < BUCKET_WAYS; ++i) {
+		if (bucket->lines[i] == NULL) {
+			__atomic_store_n(&bucket->fingerprints[i], target->hash,
+			                 __ATOMIC_RELAXED);
+			__atomic_store_n(&bucket->lines[i], target,
+			                 __ATOMIC_RELEASE);
+			return;
+		}
+	}
+	target->hnext = bucket->overflow;
+	__atomic_store_n(&bucket->overflow, target, __ATOMIC_RELEASE);
+}
+
+/*
+ * remove_index - unlink a cache line from its index bucket. The
+ * fingerprint of a way is left behind, and a line in the chain keeps its
+ * own hnext, so that a reader standing on it can still go on.
+ */
+void remove_index(CacheLine *target)
+{
+	IndexBucket *bucket = &c_index[target->hash & BUCKET_MASK];
+	CacheLine **cursor = &bucket->overflow;
+
+	for (int i = 0; i < BUCKET_WAYS; ++i) {
+		if (bucket->lines[i] == target) {
+			__atomic_store_n(&bucket->lines[i], NULL,
+			                 __ATOMIC_RELEASE);
+			return;
+		}
+	}
+	while (*cursor != NULL && *cursor != target) {
+		cursor = &(*cursor)->hnext;
+	}
+	if (*cursor != NULL) {
+		__atomic_store_n(cursor, target->hnext, __ATOMIC_RELEASE);
+	}
+}
+
+/*
+ * retire_cache_line - queue a removed cache line to be released when no
+ * reader can find it anymore
+ */
+void retire_cache_line(CacheLine *target)
+{
+	CacheLine **bucket = &c_retired[global_epoch % 3];
+
+	target->next = *bucket;
+	*bucket = target;
+	retired_bytes += target->length;
+}
+
+/*
+ * reclaim_cache_lines - advance the epoch if every active reader has
+ * seen the current one, then drop the cache's reference to the lines
+ * retired two epochs ago. A reader active in epoch e entered after
+ * everything retired before e - 1 was unlinked, so it cannot find any of
+ * those lines anymore; it may only hold its own reference to one.
+ *
+ * Lines retired in epoch e go to bucket e % 3. When the epoch becomes e,
+ * bucket (e + 1) % 3 holds the lines of e - 2, and is emptied, so it is
+ * free again for the lines of e + 1.
+ */
+void reclaim_cache_lines()
+{
+	unsigned long epoch = global_epoch;
+	CacheLine **bucket;
+	EpochSlot *slot;
+
+	if (c_retired[0] == NULL && c_retired[1] == NULL &&
+	    c_retired[2] == NULL)
+		return;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	slot = __atomic_load_n(&epoch_slots, __ATOMIC_ACQUIRE);
+	while (slot != NULL) {
+		unsigned long state = __atomic_load_n(&slot->state, __ATOMIC_SEQ_CST);
+		if ((state & 1) && (state >> 1) != epoch)
+			break;
+		slot = slot->next;
+	}
+	if (slot == NULL) {
+		++epoch;
+		__atomic_store_n(&global_epoch, epoch, __ATOMIC_SEQ_CST);
+	}
+
+	bucket = &c_retired[(epoch + 1) % 3];
+	while (*bucket != NULL) {
+		CacheLine *target = *bucket;
+		*bucket = target->next;
+		retired_bytes -= target->length;
+		unref_line(target);
+	}
+}
+
+/*
  * free_cache - free the whole cache line by line
  */
-void free_cache() 
+void free_cache()
 {
-	CacheLine *cursor = c_head;
-	while (cursor != NULL) {
-		c_head = c_head->next;
-		free_cache_line(cursor);
-		cursor = c_head;
+	CacheLine *cursor;
+
+	// the replicas reference lines about to be freed
+	for (int i = 0; i < replica_count; ++i)
+		for (int j = 0; j < HOT_REPLICAS; ++j)
+			drop_replica(&replica_sets[i].replicas[j]);
+
+	for (int i = 0; i < part_count; ++i)
+		free_list(&partitions[i].list);
+	free_list(&large_list);
+
+	for (int i = 0; i < 3; ++i) {
+		cursor = c_retired[i];
+		while (cursor != NULL) {
+			c_retired[i] = c_retired[i]->next;
+			free_cache_line(cursor);
+			cursor = c_retired[i];
+		}
 	}
-	c_tail = NULL;
+	retired_bytes = 0;
+	memset(c_index, 0, sizeof(c_index));
+	memset(b_index, 0, sizeof(b_index));
 }
 
-/* 
+/*
  * free_cache_line - free a specific cache line from the list
  */
 void free_cache_line(CacheLine *target)
 {
-	Free(target->tag);
-	Free(target->object);
+	payload_free(target->head);
+	if (target->stream != NULL)
+		free_stream(target->stream);
+	else
+		unref_body(target->body);
 	Free(target);
 }
 
-/* 
+/*
  * traverse_cache - for debug use. Traverse the whole cache and output
  * each line
  */
 void traverse_cache()
 {
-	CacheLine *cursor = c_head;
-	
-	while (cursor != NULL) {
-		printf("tag: %s, element: %s\n", cursor->tag, cursor->object);
-		cursor = cursor->next;
+	CacheLine *cursor;
+
+	for (int i = 0; i < part_count; ++i) {
+		cursor = partitions[i].list.head;
+		while (cursor != NULL) {
+			printf("tag: %s, length: %d\n", cursor->tag, cursor->length);
+			cursor = cursor->next;
+		}
 	}
-	printf("remain size: %d\n", remain_size);
+	printf("remain size: %ld\n", remain_size);
+
+	for (cursor = large_list.head; cursor != NULL; cursor = cursor->next)
+		printf("tag: %s, chunked length: %d\n", cursor->tag,
+		       cursor->length);
+	printf("large remain size: %ld\n", large_remain);
+}
+
+/*
+ * find_line - look in the index bucket of hash for the line with the
+ * given key. Only the lines whose fingerprint is hash are read, and
+ * their own hash is checked again, as a way may have been given to
+ * another line since its fingerprint was read. Safe without locks, since
+ * writers only change a bucket with atomic stores.
+ */
+static CacheLine *find_line(char *key, unsigned long hash)
+{
+	IndexBucket *bucket = &c_index[hash & BUCKET_MASK];
+	CacheLine *cursor;
+
+	for (int i = 0; i < BUCKET_WAYS; ++i) {
+		cursor = __atomic_load_n(&bucket->lines[i], __ATOMIC_ACQUIRE);
+		if (cursor != NULL &&
+		    __atomic_load_n(&bucket->fingerprints[i],
+		                    __ATOMIC_RELAXED) == hash &&
+		    cursor->hash == hash && strcmp(cursor->tag, key) == 0)
+			return cursor;
+	}
+	cursor = __atomic_load_n(&bucket->overflow, __ATOMIC_ACQUIRE);
+	while (cursor != NULL) {
+		if (cursor->hash == hash && strcmp(cursor->tag, key) == 0)
+			return cursor;
+		cursor = __atomic_load_n(&cursor->hnext, __ATOMIC_ACQUIRE);
+	}
+	return NULL;
+}
+
+/*
+ * mark_referenced - give a line a second chance at the next eviction.
+ * The flag is only written when it changes, so that a hot line stays
+ * shared between cores instead of bouncing on every hit.
+ */
+static void mark_referenced(CacheLine *line)
+{
+	if (!__atomic_load_n(&line->referenced, __ATOMIC_RELAXED))
+		__atomic_store_n(&line->referenced, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * admit_object - whether a missed object with the given hash should be
+ * cached. With ADMIT_SECOND the first miss only sets a bit in the
+ * doorkeeper, so objects requested once do not push out the ones
+ * requested again. The doorkeeper is cleared when half of it is set, to
+ * forget old misses. Races only make it a little less exact.
+ */
+static int admit_object(unsigned long hash)
+{
+	unsigned long bit, old;
+
+	if (__atomic_load_n(&c_admission, __ATOMIC_RELAXED) == ADMIT_ALL)
+		return 1;
+
+	// the index uses the low bits of the hash, so use the high ones
+	bit = (hash >> 32) & SEEN_MASK;
+	old = __atomic_fetch_or(&c_seen[bit / 64], 1UL << (bit % 64),
+	                        __ATOMIC_RELAXED);
+	if (old & (1UL << (bit % 64)))
+		return 1;
+
+	if (__atomic_add_fetch(&c_seen_count, 1, __ATOMIC_RELAXED) >=
+	    SEEN_SIZE / 2) {
+		__atomic_store_n(&c_seen_count, 0, __ATOMIC_RELAXED);
+		for (int i = 0; i < SEEN_SIZE / 64; ++i)
+			__atomic_store_n(&c_seen[i], 0, __ATOMIC_RELAXED);
+	}
+	return 0;
+}
+
+/*
+ * eviction_target - the remaining size the evictor should reach, or
+ * LONG_MIN if the cache is under the high watermark. Called with
+ * read_insert_lock held.
+ */
+static long eviction_target()
+{
+	long used = c_budget - remain_size;
+
+	if (remain_size >= 0 && used <= c_budget / 100 * high_mark)
+		return LONG_MIN;
+	return c_budget - c_budget / 100 * low_mark;
+}
+
+/*
+ * wake_evictor - tell the evictor to check the cache size
+ */
+static void wake_evictor()
+{
+	pthread_mutex_lock(&evict_mutex);
+	evict_pending = 1;
+	pthread_cond_signal(&evict_cond);
+	pthread_mutex_unlock(&evict_mutex);
+}
+
+/*
+ * evictor_job - the background evictor. It also wakes up every second to
+ * free retired lines when there are no writers to do it.
+ */
+static void *evictor_job(void *arg)
+{
+	struct timespec deadline;
+
+	pthread_detach(pthread_self());
+	while (1) {
+		int done = 0;
+
+		pthread_mutex_lock(&evict_mutex);
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += 1;
+		while (!evict_pending &&
+		       pthread_cond_timedwait(&evict_cond, &evict_mutex,
+		                              &deadline) != ETIMEDOUT)
+			;
+		evict_pending = 0;
+		pthread_mutex_unlock(&evict_mutex);
+
+		// take the lock for one small batch at a time, so requests
+		// waiting for it are not held up by a large eviction
+		PROFILED_WRLOCK(&read_insert_lock, SITE(EVICT));
+		long target = eviction_target();
+		while (!done) {
+			done = target == LONG_MIN ||
+			       evict_cache_line(target, EVICT_BATCH);
+			reclaim_cache_lines();
+			PROFILED_UNLOCK(&read_insert_lock, SITE(EVICT));
+			if (done)
+				break;
+			sched_yield();
+			PROFILED_WRLOCK(&read_insert_lock, SITE(EVICT));
+		}
+	}
+	return NULL;
+}
+
+/*
+ * epoch_enter - announce that this thread may hold cache lines. The
+ * announcement is ordered before any read of the index.
+ */
+static void epoch_enter()
+{
+	EpochSlot *slot = my_slot;
+
+	if (slot == NULL)
+		slot = my_slot = acquire_slot();
+	if (slot->depth++ == 0) {
+		unsigned long epoch = __atomic_load_n(&global_epoch,
+		                                      __ATOMIC_ACQUIRE);
+		__atomic_store_n(&slot->state, (epoch << 1) | 1, __ATOMIC_SEQ_CST);
+	}
+}
+
+/*
+ * epoch_exit - this thread holds no cache line anymore
+ */
+static void epoch_exit()
+{
+	EpochSlot *slot = my_slot;
+
+	if (--slot->depth == 0)
+		__atomic_store_n(&slot->state, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * acquire_slot - take a free reader record, or add a new one. The record
+ * is given back when the thread exits.
+ */
+static EpochSlot *acquire_slot()
+{
+	EpochSlot *slot;
+
+	pthread_once(&slot_once, make_slot_key);
+
+	slot = __atomic_load_n(&epoch_slots, __ATOMIC_ACQUIRE);
+	while (slot != NULL) {
+		int expected = 0;
+		if (__atomic_compare_exchange_n(&slot->in_use, &expected, 1, 0,
+		                                __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+			break;
+		slot = slot->next;
+	}
+
+	if (slot == NULL) {
+		if (posix_memalign((void **)&slot, sizeof(EpochSlot),
+		                   sizeof(EpochSlot)) != 0)
+			app_error("posix_memalign error");
+		memset(slot, 0, sizeof(EpochSlot));
+		slot->in_use = 1;
+		slot->next = __atomic_load_n(&epoch_slots, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&epoch_slots, &slot->next, slot,
+		                                    0, __ATOMIC_RELEASE,
+		                                    __ATOMIC_RELAXED))
+			;
+	}
+
+	pthread_setspecific(slot_key, slot);
+	return slot;
+}
+
+/*
+ * release_slot - give back the reader record of an exiting thread
+ */
+static void release_slot(void *slot)
+{
+	EpochSlot *target = slot;
+
+	target->depth = 0;
+	__atomic_store_n(&target->state, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&target->in_use, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * unref_line - drop a reference to a line, and free it with the last one
+ */
+static void unref_line(CacheLine *line)
+{
+	if (__atomic_sub_fetch(&line->refs, 1, __ATOMIC_ACQ_REL) == 0)
+		free_cache_line(line);
+}
+
+/*
+ * list_of - the list a line belongs to
+ */
+static CacheList *list_of(CacheLine *line)
+{
+	return line->stream ? &large_list : &partitions[line->partition].list;
+}
+
+/*
+ * victim_partition - the partition whose tail should be evicted next:
+ * of the partitions over their quota if any, else of all, the one whose
+ * tail was put at the head the longest ago. NULL if all are empty.
+ * Called with read_insert_lock held.
+ */
+static Partition *victim_partition()
+{
+	Partition *victim = NULL;
+	int victim_over = 0;
+
+	for (int i = 0; i < part_count; ++i) {
+		Partition *part = &partitions[i];
+		int over = part->stats.quota > 0 &&
+		           part->stats.used > part->stats.quota;
+
+		if (part->list.tail == NULL)
+			continue;
+		if (victim == NULL || over > victim_over ||
+		    (over == victim_over &&
+		     part->list.tail->stamp < victim->list.tail->stamp)) {
+			victim = part;
+			victim_over = over;
+		}
+	}
+	return victim;
+}
+
+/*
+ * find_partition - index of the partition of the host of a cache key,
+ * 0 for the default one
+ */
+static int find_partition(char *key)
+{
+	char *host = strstr(key, "://");
+	int len;
+
+	if (part_count == 1 || host == NULL)
+		return 0;
+	host += 3;
+	len = strcspn(host, ":/?#");
+	for (int i = 1; i < part_count; ++i)
+		if (host_matches(partitions[i].stats.pattern, host, len))
+			return i;
+	return 0;
+}
+
+/*
+ * host_matches - whether the len bytes of host match a pattern, see
+ * add_cache_partition. Hosts are case-insensitive.
+ */
+static int host_matches(char *pattern, char *host, int len)
+{
+	int pattern_len;
+
+	if (strcmp(pattern, "*") == 0)
+		return 1;
+	if (strncmp(pattern, "*.", 2) == 0) {
+		pattern += 2;
+		pattern_len = strlen(pattern);
+		if (len > pattern_len && host[len - pattern_len - 1] == '.')
+			return strncasecmp(host + len - pattern_len, pattern,
+			                   pattern_len) == 0;
+	}
+	pattern_len = strlen(pattern);
+	return len == pattern_len && strncasecmp(host, pattern, len) == 0;
+}
+
+/*
+ * count_lookup - count a hit on line, or a miss on key if line is NULL,
+ * in its partition. Lookups are only counted once partitions are added,
+ * to keep readers from sharing a counter otherwise.
+ */
+static void count_lookup(char *key, CacheLine *line)
+{
+	PartitionStats *stats;
+
+	if (part_count == 1)
+		return;
+	if (line != NULL) {
+		stats = &partitions[line->partition].stats;
+		__atomic_add_fetch(&stats->hits, 1, __ATOMIC_RELAXED);
+	}
+	else {
+		stats = &partitions[find_partition(key)].stats;
+		__atomic_add_fetch(&stats->misses, 1, __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * free_list - free the lines of a list, and empty it
+ */
+static void free_list(CacheList *list)
+{
+	CacheLine *cursor = list->head;
+
+	while (cursor != NULL) {
+		list->head = cursor->next;
+		free_cache_line(cursor);
+		cursor = list->head;
+	}
+	list->tail = NULL;
+}
+
+/*
+ * make_line - a line for key, not cached yet, holding a copy of the
+ * head_length bytes of headers at head and no body. The key is copied
+ * after the fields, in the same allocation, sized to it.
+ */
+static CacheLine *make_line(char *key, unsigned long hash, char *head,
+                            int head_length)
+{
+	CacheLine *line = Malloc(sizeof(CacheLine) + strlen(key) + 1);
+
+	line->prev = NULL;
+	line->next = NULL;
+	line->hnext = NULL;
+	line->length = head_length;
+	line->head_length = head_length;
+	line->raw_length = 0;
+	line->hash = hash;
+	line->referenced = 0;
+	line->refs = 1;
+	line->body = NULL;
+	line->stream = NULL;
+	line->partition = find_partition(key);
+	line->stamp = 0;
+	line->head = payload_alloc(head_length);
+	strcpy(line->tag, key);
+	memcpy(line->head, head, head_length);
+	return line;
+}
+
+/*
+ * unlink_line - take a line out of its list and the index, give its
+ * bytes back to its budget and retire it. A chunked line still being
+ * filled is given up, so that its readers stop waiting. Called with
+ * read_insert_lock held.
+ */
+static void unlink_line(CacheLine *line)
+{
+	remove_cache_line(line);
+	remove_index(line);
+	note_removal(line);
+	if (line->stream != NULL) {
+		large_remain += line->length;
+		--l_count;
+		if (line->stream->state == STREAM_FILLING) {
+			end_stream(line->stream, STREAM_ABORTED);
+			++c_stats.large_aborts;
+		}
+	}
+	else {
+		remain_size += detach_body(line);
+		c_stats.saved_bytes -= saved_bytes(line);
+		--c_count;
+		partitions[line->partition].stats.used -= line->length;
+		--partitions[line->partition].stats.lines;
+	}
+	retire_cache_line(line);
+}
+
+/*
+ * add_chunk - charge a new chunk to the large budget, evicting other
+ * chunked lines if needed, and append it to a line being filled. A line
+ * that cannot get one leaves the cache. Return -1 if the line is not
+ * filled anymore, else 0.
+ */
+static int add_chunk(CacheLine *line)
+{
+	CacheStream *stream = line->stream;
+	CacheChunk *chunk = Malloc(sizeof(CacheChunk));
+	int ok;
+
+	PROFILED_WRLOCK(&read_insert_lock, SITE(APPEND));
+	ok = stream->state == STREAM_FILLING &&
+	     (large_remain >= CHUNK_SIZE || evict_large_line(CHUNK_SIZE, line));
+	if (ok) {
+		large_remain -= CHUNK_SIZE;
+		line->length += CHUNK_SIZE;
+	}
+	else if (stream->state == STREAM_FILLING) {
+		unlink_line(line);
+	}
+	reclaim_cache_lines();
+	PROFILED_UNLOCK(&read_insert_lock, SITE(APPEND));
+
+	if (!ok) {
+		Free(chunk);
+		return -1;
+	}
+	// readers only follow the link once filled covers the chunk
+	chunk->next = NULL;
+	if (stream->last != NULL)
+		stream->last->next = chunk;
+	else
+		stream->first = chunk;
+	stream->last = chunk;
+	return 0;
+}
+
+/*
+ * new_stream - an empty chunked body, being filled
+ */
+static CacheStream *new_stream()
+{
+	CacheStream *stream = Malloc(sizeof(CacheStream));
+
+	stream->first = NULL;
+	stream->last = NULL;
+	stream->filled = 0;
+	stream->state = STREAM_FILLING;
+	pthread_mutex_init(&stream->mutex, NULL);
+	pthread_cond_init(&stream->cond, NULL);
+	return stream;
+}
+
+/*
+ * end_stream - a chunked body is not filled anymore, tell its readers.
+ * Called with read_insert_lock held.
+ */
+static void end_stream(CacheStream *stream, int state)
+{
+	pthread_mutex_lock(&stream->mutex);
+	__atomic_store_n(&stream->state, state, __ATOMIC_RELAXED);
+	pthread_cond_broadcast(&stream->cond);
+	pthread_mutex_unlock(&stream->mutex);
+}
+
+/*
+ * free_stream - free a chunked body and its chunks
+ */
+static void free_stream(CacheStream *stream)
+{
+	CacheChunk *chunk = stream->first;
+
+	while (chunk != NULL) {
+		CacheChunk *next = chunk->next;
+		Free(chunk);
+		chunk = next;
+	}
+	pthread_mutex_destroy(&stream->mutex);
+	pthread_cond_destroy(&stream->cond);
+	Free(stream);
+}
+
+/*
+ * make_slot_key - create the key whose destructor gives back the reader
+ * record of a thread
+ */
+static void make_slot_key()
+{
+	pthread_key_create(&slot_key, release_slot);
+}
+
+/*
+ * saved_bytes - bytes a line saves by storing its body compressed
+ */
+static long saved_bytes(CacheLine *line)
+{
+	return line->raw_length > 0 ? line->raw_length - line->length : 0;
+}
+
+/*
+ * new_body - a body holding a copy of data, with its hash if bodies are
+ * shared, used by no line yet
+ */
+static CacheBody *new_body(char *data, int length)
+{
+	CacheBody *body = Malloc(sizeof(CacheBody));
+
+	body->hnext = NULL;
+	body->data = payload_alloc(length);
+	body->length = length;
+	body->users = 0;
+	body->refs = 1;
+	memcpy(body->data, data, length);
+	if (c_dedup)
+		hash_body(data, length, body->digest);
+	return body;
+}
+
+/*
+ * attach_body - give a line about to be cached its body: one with the
+ * same hash if bodies are shared and there is one, or else body. Return
+ * the bytes to charge to the budget for the line. Called with
+ * read_insert_lock held.
+ */
+static long attach_body(CacheLine *line, CacheBody *body)
+{
+	CacheBody **bucket, *cursor;
+
+	if (!c_dedup) {
+		line->body = body;
+		body->users = 1;
+		__atomic_add_fetch(&body->refs, 1, __ATOMIC_RELAXED);
+		return line->head_length + body->length;
+	}
+
+	bucket = &b_index[body->digest[0] & INDEX_MASK];
+	cursor = *bucket;
+	while (cursor != NULL &&
+	       (cursor->digest[0] != body->digest[0] ||
+	        cursor->digest[1] != body->digest[1] ||
+	        cursor->length != body->length))
+		cursor = cursor->hnext;
+	if (cursor != NULL) {
+		line->body = cursor;
+		++cursor->users;
+		__atomic_add_fetch(&cursor->refs, 1, __ATOMIC_RELAXED);
+		++c_stats.deduplicated;
+		c_stats.shared_bytes += cursor->length;
+		return line->head_length;
+	}
+
+	line->body = body;
+	body->users = 1;
+	__atomic_add_fetch(&body->refs, 1, __ATOMIC_RELAXED);
+	body->hnext = *bucket;
+	*bucket = body;
+	return line->head_length + body->length;
+}
+
+/*
+ * detach_body - a line leaves the cache. Return the bytes that leave the
+ * budget with it: its body too if no other line in the cache uses it.
+ * The body itself is freed with the last line. Called with
+ * read_insert_lock held.
+ */
+static long detach_body(CacheLine *line)
+{
+	CacheBody *body = line->body;
+	CacheBody **cursor;
+
+	if (--body->users > 0) {
+		c_stats.shared_bytes -= body->length;
+		return line->head_length;
+	}
+	if (c_dedup) {
+		cursor = &b_index[body->digest[0] & INDEX_MASK];
+		while (*cursor != NULL && *cursor != body)
+			cursor = &(*cursor)->hnext;
+		if (*cursor != NULL)
+			*cursor = body->hnext;
+	}
+	return line->head_length + body->length;
+}
+
+/*
+ * unref_body - drop a reference to a body, and free it with the last one
+ */
+static void unref_body(CacheBody *body)
+{
+	if (__atomic_sub_fetch(&body->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		payload_free(body->data);
+		Free(body);
+	}
+}
+
+/*
+ * hash_body - 128-bit hash of a body, MurmurHash3 x64 128 with seed 0
+ */
+static void hash_body(char *data, int length, unsigned long *digest)
+{
+	const unsigned long c1 = 0x87c37b91114253d5UL;
+	const unsigned long c2 = 0x4cf5ad432745937fUL;
+	unsigned char *tail = (unsigned char *)data + (length & ~15);
+	unsigned long h1 = 0, h2 = 0, k1, k2;
+
+	for (int i = 0; i + 16 <= length; i += 16) {
+		memcpy(&k1, data + i, 8);
+		memcpy(&k2, data + i + 8, 8);
+		k1 *= c1; k1 = (k1 << 31) | (k1 >> 33); k1 *= c2; h1 ^= k1;
+		h1 = (h1 << 27) | (h1 >> 37); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+		k2 *= c2; k2 = (k2 << 33) | (k2 >> 31); k2 *= c1; h2 ^= k2;
+		h2 = (h2 << 31) | (h2 >> 33); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+	}
+
+	// the last length % 16 bytes
+	k1 = 0;
+	k2 = 0;
+	for (int i = (length & 15) - 1; i >= 8; --i)
+		k2 = (k2 << 8) | tail[i];
+	for (int i = ((length & 15) < 8 ? (length & 15) : 8) - 1; i >= 0; --i)
+		k1 = (k1 << 8) | tail[i];
+	if (length & 15) {
+		k2 *= c2; k2 = (k2 << 33) | (k2 >> 31); k2 *= c1; h2 ^= k2;
+		k1 *= c1; k1 = (k1 << 31) | (k1 >> 33); k1 *= c2; h1 ^= k1;
+	}
+
+	h1 ^= length;
+	h2 ^= length;
+	h1 += h2;
+	h2 += h1;
+	for (int i = 0; i < 2; ++i) {
+		unsigned long *h = i ? &h2 : &h1;
+		*h ^= *h >> 33;
+		*h *= 0xff51afd7ed558ccdUL;
+		*h ^= *h >> 33;
+		*h *= 0xc4ceb93fe53ba87bUL;
+		*h ^= *h >> 33;
+	}
+	h1 += h2;
+	h2 += h1;
+	digest[0] = h1;
+	digest[1] = h2;
+}
+
+/*
+ * my_replica_set - the replica set of the core the thread runs on
+ */
+static ReplicaSet *my_replica_set()
+{
+	int cpu = sched_getcpu();
+
+	return &replica_sets[(cpu < 0 ? 0 : cpu) % replica_count];
+}
+
+/*
+ * replica_get - look key up in the replicas of this core. Return a copy
+ * with a reference taken for the caller, or NULL if there is none or
+ * another thread is using the set. A sample of the hits updates the
+ * recency of the shared line, so that a hot line is not evicted as cold.
+ */
+static CacheLine *replica_get(char *key, unsigned long hash)
+{
+	ReplicaSet *set = my_replica_set();
+	CacheLine *copy = NULL;
+
+	if (pthread_mutex_trylock(&set->lock) != 0)
+		return NULL;
+	if (__atomic_load_n(&inval_seq, __ATOMIC_ACQUIRE) != set->seen) {
+		PROFILED_RDLOCK(&read_insert_lock, SITE(REPLICA));
+		apply_removals(set);
+		PROFILED_UNLOCK(&read_insert_lock, SITE(REPLICA));
+	}
+	for (int i = 0; i < HOT_REPLICAS; ++i) {
+		Replica *replica = &set->replicas[i];
+		if (replica->copy != NULL && replica->copy->hash == hash &&
+		    strcmp(replica->copy->tag, key) == 0) {
+			copy = replica->copy;
+			__atomic_add_fetch(&copy->refs, 1, __ATOMIC_RELAXED);
+			if (__atomic_add_fetch(&set->hits, 1, __ATOMIC_RELAXED) %
+			    HOT_SAMPLE == 0)
+				touch_origin(replica->origin);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&set->lock);
+
+	if (copy != NULL)
+		count_lookup(key, copy);
+	return copy;
+}
+
+/*
+ * note_hit - sample a hit on a shared line. The samples are counted by
+ * the low bits of the hash; a line that takes a counter from another
+ * has to wear it down first. A line counted HOT_THRESHOLD times is
+ * replicated, and the counts are halved every HOT_DECAY samples so that
+ * objects that cooled down make room.
+ */
+static void note_hit(CacheLine *line)
+{
+	ReplicaSet *set;
+	int i = line->hash & (HOT_SLOTS - 1);
+
+	if (line->stream != NULL)
+		return;
+	set = my_replica_set();
+	if (pthread_mutex_trylock(&set->lock) != 0)
+		return;
+	if (++set->sampled % HOT_SAMPLE == 0) {
+		if (set->hot_hash[i] == line->hash) {
+			++set->hot_count[i];
+		}
+		else if (--set->hot_count[i] <= 0) {
+			set->hot_hash[i] = line->hash;
+			set->hot_count[i] = 1;
+		}
+		if (set->hot_hash[i] == line->hash &&
+		    set->hot_count[i] >= HOT_THRESHOLD) {
+			set->hot_count[i] = 0;
+			make_replica(set, line);
+		}
+		if (++set->samples % HOT_DECAY == 0)
+			for (int j = 0; j < HOT_SLOTS; ++j)
+				set->hot_count[j] /= 2;
+	}
+	pthread_mutex_unlock(&set->lock);
+}
+
+/*
+ * make_replica - copy a hot line to the replicas of a core, in place of
+ * the oldest one. The caller holds a reference to the line. The line
+ * must still be in the index once the removals are applied, or it could
+ * be removed without the copy ever hearing of it. Called with the lock
+ * of the set held.
+ */
+static void make_replica(ReplicaSet *set, CacheLine *line)
+{
+	Replica *replica;
+	CacheLine *copy;
+	int cached;
+
+	PROFILED_RDLOCK(&read_insert_lock, SITE(REPLICA));
+	apply_removals(set);
+	cached = find_line(line->tag, line->hash) == line;
+	PROFILED_UNLOCK(&read_insert_lock, SITE(REPLICA));
+	if (!cached)
+		return;
+	for (int i = 0; i < HOT_REPLICAS; ++i)
+		if (set->replicas[i].origin == line)
+			return;
+
+	replica = &set->replicas[set->next];
+	set->next = (set->next + 1) % HOT_REPLICAS;
+	drop_replica(replica);
+
+	copy = make_line(line->tag, line->hash, line->head, line->head_length);
+	copy->length = line->length;
+	copy->raw_length = line->raw_length;
+	copy->body = line->body;
+	__atomic_add_fetch(&copy->body->refs, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&line->refs, 1, __ATOMIC_RELAXED);
+	replica->copy = copy;
+	replica->origin = line;
+	__atomic_add_fetch(&set->made, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * drop_replica - give up a replica. Readers still using the copy keep
+ * it until they release it.
+ */
+static void drop_replica(Replica *replica)
+{
+	if (replica->copy == NULL)
+		return;
+	unref_line(replica->copy);
+	unref_line(replica->origin);
+	replica->copy = NULL;
+	replica->origin = NULL;
+}
+
+/*
+ * apply_removals - drop the replicas of a core whose lines were removed
+ * since it last looked, or all of them if the ring no longer holds every
+ * removal since then. Called with the lock of the set and
+ * read_insert_lock held.
+ */
+static void apply_removals(ReplicaSet *set)
+{
+	if (inval_seq - set->seen > INVAL_RING) {
+		for (int i = 0; i < HOT_REPLICAS; ++i)
+			drop_replica(&set->replicas[i]);
+		set->seen = inval_seq;
+		return;
+	}
+	for (; set->seen != inval_seq; ++set->seen) {
+		unsigned long hash = inval_ring[set->seen & (INVAL_RING - 1)];
+		for (int i = 0; i < HOT_REPLICAS; ++i)
+			if (set->replicas[i].copy != NULL &&
+			    set->replicas[i].copy->hash == hash)
+				drop_replica(&set->replicas[i]);
+	}
+}
+
+/*
+ * touch_origin - count a hit of a replica on its shared line, the way a
+ * hit on the line itself would be. A line already removed is left alone.
+ */
+static void touch_origin(CacheLine *origin)
+{
+	int policy = __atomic_load_n(&c_policy, __ATOMIC_RELAXED);
+
+	if (policy == POLICY_CLOCK || (policy == POLICY_LRU && c_lockfree)) {
+		mark_referenced(origin);
+		return;
+	}
+	if (policy != POLICY_LRU)
+		return;
+	PROFILED_RDLOCK(&read_insert_lock, SITE(TOUCH));
+	if (find_line(origin->tag, origin->hash) == origin) {
+		PROFILED_WRLOCK(&read_update_lock, SITE(TOUCH_PROMOTE));
+		remove_cache_line(origin);
+		insert_cache_line(origin);
+		PROFILED_UNLOCK(&read_update_lock, SITE(TOUCH_PROMOTE));
+	}
+	PROFILED_UNLOCK(&read_insert_lock, SITE(TOUCH));
+}
+
+/*
+ * note_removal - add the hash of a line leaving the index to the ring
+ * the replicas are checked against. Called with read_insert_lock held.
+ */
+static void note_removal(CacheLine *line)
+{
+	inval_ring[inval_seq & (INVAL_RING - 1)] = line->hash;
+	__atomic_store_n(&inval_seq, inval_seq + 1, __ATOMIC_RELEASE);
 }
@@ -9,35 +9,285 @@
 #define CACHE_H
 
 #include <string.h>
+#include <pthread.h>
 
-#define MAX_CACHE_SIZE  1049000
-#define MAX_OBJECT_SIZE 102400
+/* Defaults of the runtime limits, see set_cache_budget and friends */
+#define DEFAULT_CACHE_SIZE  1049000
+#define DEFAULT_OBJECT_SIZE 102400
+#define DEFAULT_HIGH_MARK   100     /* percent of budget */
+#define DEFAULT_LOW_MARK    100     /* percent of budget */
+#define MAX_OBJECT_LIMIT    (256 << 20) /* largest object size limit */
+#define DEFAULT_LARGE_SIZE  (16 << 20)  /* budget of the chunked lines */
+
+#define CHUNK_SIZE      (64 << 10) /* bytes per chunk of a large object */
+
+#define EVICT_BATCH     32      /* lines evicted per background step */
+
+#define INDEX_BITS      14      /* the body index has 2^INDEX_BITS buckets */
+#define BUCKET_BITS     12      /* the line index has 2^BUCKET_BITS buckets */
+#define BUCKET_WAYS     3       /* lines a bucket holds inline */
+
+/* Replacement policies, see set_cache_policy */
+#define POLICY_LRU      0       /* a hit moves the line to the head */
+#define POLICY_CLOCK    1       /* a hit gives the line a second chance */
+#define POLICY_FIFO     2       /* a hit changes nothing */
+
+/* Admission policies, see set_cache_admission */
+#define ADMIT_ALL       0       /* cache every object that fits */
+#define ADMIT_SECOND    1       /* cache an object on its second miss */
+
+#define SEEN_BITS       16      /* the doorkeeper has 2^SEEN_BITS bits */
+
+#define MAX_PARTITIONS  16      /* host partitions, the default included */
+#define PATTERN_SIZE    128     /* longest host pattern, with its NUL */
+
+/* States of a chunked line, see read_stream */
+#define STREAM_FILLING  0       /* the object is still being received */
+#define STREAM_DONE     1       /* the whole object is cached */
+#define STREAM_ABORTED  2       /* filling was given up */
+
+#define HOT_REPLICAS    4       /* objects replicated per core */
+#define HOT_SLOTS       64      /* sampled hit counters per core */
+#define HOT_SAMPLE      16      /* one hit in HOT_SAMPLE is sampled */
+#define HOT_THRESHOLD   8       /* samples that make an object hot */
+#define HOT_DECAY       1024    /* samples between halvings of the counts */
+#define INVAL_RING      256     /* removals remembered, a power of two */
+
+/*
+ * the body of one or more cached objects. With deduplication on, lines
+ * whose bodies have the same content hash share one.
+ */
+typedef struct body {
+	struct body *hnext;      /* next body in the same index bucket */
+	unsigned long digest[2]; /* 128-bit hash of the data */
+	char *data;
+	int length;
+	int users;               /* lines in the cache using it */
+	int refs;                /* lines not freed yet using it */
+} CacheBody;
+
+/*
+ * one chunk of the body of a large object
+ */
+typedef struct chunk {
+	struct chunk *next;
+	char data[CHUNK_SIZE];
+} CacheChunk;
+
+/*
+ * the body of an object past the object limit, kept in chunks charged to
+ * a budget of their own. Readers may follow it while it is filled.
+ */
+typedef struct stream {
+	CacheChunk *first;
+	CacheChunk *last;        /* only used by the filling thread */
+	long filled;             /* bytes of the body readers may use */
+	int state;               /* changed with read_insert_lock held too */
+	pthread_mutex_t mutex;   /* guards filled and state */
+	pthread_cond_t cond;     /* broadcast when either changes */
+} CacheStream;
 
 /*
  * structure of each cache line
  */
 typedef struct line {
 	struct line* prev;
-	struct line* next;
-	char *tag;        /* used for indexing a specific cache line */
-	char *object;     /* stores the data */
-	int length;       /* length of the data stored in the cache line */
-	
-} CacheLine; 
+	struct line* next;  /* also links retired lines waiting for readers */
+	struct line* hnext; /* next line past the ways of its index bucket */
+	unsigned long hash; /* hash of tag, its fingerprint in the index */
+	char *head;       /* headers of the object, not shared */
+	int head_length;
+	CacheBody *body;  /* rest of the object, maybe shared */
+	CacheStream *stream; /* or the chunked body of a large object */
+	int length;       /* length of the head and the body, or for a
+	                     chunked line, of the head and its chunks */
+	int raw_length;   /* length once the body is decompressed, or 0 if
+	                     the body is not gzipped */
+	int referenced;   /* set by lock-free readers instead of moving the line */
+	int refs;         /* one for the cache until reclaimed, one per reader */
+	int partition;    /* index of the partition of its host */
+	unsigned long stamp; /* when it was last put at the head of its list */
+	char tag[];       /* the key, only read once the fingerprint matched */
+} CacheLine;
+
+/*
+ * a bucket of the line index, one cache line holding the fingerprints of
+ * up to BUCKET_WAYS lines next to the lines themselves, so that a lookup
+ * only reads a line whose fingerprint is that of its key. More lines go
+ * to a chain linked by hnext.
+ */
+typedef struct bucket {
+	unsigned long fingerprints[BUCKET_WAYS];
+	CacheLine *lines[BUCKET_WAYS];  /* NULL for a free way */
+	CacheLine *overflow;
+} __attribute__((aligned(64))) IndexBucket;
+
+/*
+ * a list of cache lines, most recently used first
+ */
+typedef struct list {
+	CacheLine *head;
+	CacheLine *tail;
+} CacheList;
+
+/*
+ * counters of a host partition, see get_partition_stats. The default
+ * partition, for the hosts no pattern matches, has the empty pattern.
+ */
+typedef struct partition_stats {
+	char pattern[PATTERN_SIZE];  /* host, "*.domain" or "*" */
+	long quota;                  /* bytes, or 0 for none */
+	long used;                   /* length of its lines */
+	int lines;
+	unsigned long hits;          /* only counted with partitions added */
+	unsigned long misses;
+	unsigned long evictions;
+} PartitionStats;
+
+/*
+ * the lines of the hosts matching a pattern, in a list of their own
+ */
+typedef struct partition {
+	CacheList list;
+	PartitionStats stats;
+} Partition;
+
+/*
+ * per-thread reader record of the epoch-based reclamation
+ */
+typedef struct epoch_slot {
+	unsigned long state;     /* (epoch << 1) | 1 while reading, else 0 */
+	int depth;               /* nesting depth of get_object calls */
+	int in_use;              /* owned by a live thread */
+	struct epoch_slot *next;
+	char pad[40];            /* keep each slot in its own cache line */
+} EpochSlot;
+
+/*
+ * a read-only copy of a hot line, served instead of the shared one. The
+ * copy has its own head and references the body of the line.
+ */
+typedef struct replica {
+	CacheLine *copy;         /* NULL if unused */
+	CacheLine *origin;       /* the shared line, referenced */
+} Replica;
+
+/*
+ * the hit counters and replicas of one core. Only tried, never waited
+ * for, so a thread that finds it taken goes to the shared cache.
+ */
+typedef struct replica_set {
+	pthread_mutex_t lock;
+	unsigned long seen;      /* removals applied to the replicas */
+	unsigned long sampled;   /* hits on shared lines, for sampling */
+	unsigned long samples;   /* hits counted, for the decay */
+	unsigned long hits;      /* hits served by the replicas */
+	unsigned long made;      /* replicas made */
+	int next;                /* replica to replace next */
+	unsigned long hot_hash[HOT_SLOTS];  /* by the low bits of the hash */
+	int hot_count[HOT_SLOTS];
+	Replica replicas[HOT_REPLICAS];
+} __attribute__((aligned(64))) ReplicaSet;
+
+/*
+ * counters of the cache writers, see get_cache_stats
+ */
+typedef struct cache_stats {
+	unsigned long inserts;       /* objects added */
+	unsigned long rejects;       /* objects too large or not admitted */
+	unsigned long evictions;     /* lines evicted to make room */
+	unsigned long evicted_bytes;
+	long retired_bytes;          /* removed, waiting for the epoch to pass */
+	unsigned long compressed;    /* objects added with a gzip body */
+	long saved_bytes;            /* saved by the gzip bodies now cached */
+	unsigned long deduplicated;  /* objects added with a shared body */
+	long shared_bytes;           /* saved by the bodies now shared */
+	unsigned long large_objects; /* chunked lines started */
+	unsigned long large_aborts;  /* chunked lines given up unfilled */
+	unsigned long replicas;      /* hot lines replicated to a core */
+	unsigned long replica_hits;  /* hits served by those replicas */
+} CacheStats;
 
 void init_cache();
 
-CacheLine *get_object(char *uri);
+void set_cache_lockfree(int enable);
+
+void set_cache_budget(long budget);
+
+void set_object_limit(int limit);
+
+void set_cache_watermarks(int high, int low);
+
+void set_cache_policy(int policy);
+
+void set_cache_admission(int admission);
+
+void set_cache_dedup(int enable);
+
+void set_cache_replicas(int enable);
+
+void set_cache_arena(int enable);
+
+int add_cache_partition(char *pattern, long quota);
+
+void set_large_budget(long budget);
+
+long get_cache_budget();
+
+int get_object_limit();
+
+long get_cache_used();
+
+long get_large_budget();
 
-void add_object(char *uri, char *object, int length);
+long get_large_used();
+
+void get_cache_watermarks(int *high, int *low);
+
+void get_cache_stats(CacheStats *stats);
+
+int get_partition_stats(PartitionStats *stats, int max);
+
+int dump_cache_locks(char *buf, int size);
+
+void start_evictor();
+
+CacheLine *get_object(char *key, unsigned long hash);
+
+void release_object(CacheLine *line);
+
+void add_object(char *key, unsigned long hash, char *object, int length);
+
+void add_response(char *key, unsigned long hash, char *object, int length,
+                  int head_length, int raw_length);
+
+CacheLine *start_object(char *key, unsigned long hash, char *head,
+                        int head_length, long expected);
+
+int append_object(CacheLine *line, char *data, int length);
+
+void finish_object(CacheLine *line, int complete);
+
+long read_stream(CacheLine *line, long pos, CacheChunk **chunk,
+                 char **data);
 
 /* Helper functions */
 void insert_cache_line(CacheLine *target);
 
-void evict_cache_line(int size);
+int evict_cache_line(long size, int max_lines);
+
+int evict_large_line(long size, CacheLine *keep);
 
 void remove_cache_line(CacheLine *target);
 
+void insert_index(CacheLine *target);
+
+void remove_index(CacheLine *target);
+
+void retire_cache_line(CacheLine *target);
+
+void reclaim_cache_lines();
+
 void free_cache();
 
 void free_cache_line(CacheLine *target);
@@ -0,0 +1,596 @@
+/*
+ * cachebench.c
+ *
+ * Benchmark of concurrent cache lookups and inserts without the network.
+ * The cache is filled with a fixed set of objects, then 1, 2, 4 ... N
+ * worker threads call get_object and add_object for a fixed time, once
+ * with the locking readers and once with the lock-free ones. For each run
+ * the throughput, its scaling from one thread, the hit ratio and the
+ * latency percentiles of the lookups and inserts are printed, so that a
+ * change to the locking or the index can be compared quickly.
+ *
+ * A worker looks up a key in -r percent of its operations (all of them by
+ * default) and adds its object in the others. Keys are drawn from a key
+ * space twice as large as the budget holds, uniformly or, with -z, from
+ * a Zipf distribution of the given skew, so that the hottest keys are the
+ * ones cached first. Objects are all -o bytes, or with -o min,max, of a
+ * size of their own spread log-uniformly between the two, as the sizes of
+ * web objects are. One operation in LATENCY_SAMPLE is timed, to keep the
+ * clock from weighing on the throughput.
+ *
+ * Meanwhile background writer threads (-w) keep adding objects from the
+ * whole key space, uniformly, so that lookups race with inserts,
+ * evictions and the reclamation of retired lines.
+ *
+ * With -b, a lookup reads the whole body of each object it finds, as a
+ * hit sends it, instead of its first byte. With -A, the objects are kept
+ * in the huge-page arena. The dTLB load misses of each run are counted
+ * in user space with perf_event_open where the machine exposes them.
+ *
+ * Built with LOCK_PROFILE, the wait and hold times of the cache locks
+ * over all the runs are printed at the end.
+ */
+
+#include <math.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include "csapp.h"
+#include "cache.h"
+#include "cachekey.h"
+#include "payload.h"
+#include "lockprof.h"
+
+#define BENCH_OBJECT_SIZE 1024
+#define LATENCY_SAMPLE    8     /* one operation timed in this many */
+#define LATENCY_BUCKETS   (64 + 58 * 32)    /* see latency_bucket */
+#define PERCENTILES       4
+
+static const char *usage =
+"Usage: %s [-Ab] [-t max threads] [-w writers] [-k keys] [-m milliseconds] "
+"[-r read percent] [-z skew] [-o size[,max]]\n";
+
+static const double percentiles[PERCENTILES] = {50, 90, 99, 99.9};
+
+/* Benchmark parameters */
+static int max_threads = 8;
+static int writer_count = 1;
+static int key_count = 512;
+static int duration_ms = 1000;
+static int read_body = 0;
+static int read_percent = 100;
+static double zipf_skew = 0;
+static int min_size = BENCH_OBJECT_SIZE;
+static int max_size = BENCH_OBJECT_SIZE;
+
+static char (*keys)[64];
+static unsigned long *hashes;
+static int *sizes;              /* of the object of each key */
+static double *zipf_cdf;        /* by rank, NULL for uniform keys */
+static volatile int running;
+
+/*
+ * sampled times of the operations of a worker, in nanoseconds, see
+ * latency_bucket
+ */
+typedef struct {
+    unsigned long reads[LATENCY_BUCKETS];
+    unsigned long writes[LATENCY_BUCKETS];
+} Latency;
+
+/*
+ * per-thread counters, each in its own cache line. Background writers
+ * count their inserts in writes, and have no latency.
+ */
+typedef struct {
+    unsigned long reads;
+    unsigned long writes;
+    unsigned long misses;
+    unsigned seed;
+    Latency *latency;
+} __attribute__((aligned(64))) Worker;
+
+/*
+ * what a run measured
+ */
+typedef struct {
+    double ops;                 /* per second, of the workers */
+    double inserts;             /* per second, of the background writers */
+    double hit_ratio;           /* of the lookups */
+    double tlb;                 /* dTLB misses per operation, or -1 */
+    long read_ns[PERCENTILES];  /* -1 without lookups */
+    long write_ns[PERCENTILES]; /* -1 without inserts */
+} Result;
+
+/* Helper function declaration */
+void make_keys();
+void make_zipf();
+void fill_cache();
+void run_workers(int threads, Result *result);
+void print_result(int threads, char *mode, Result *result, double base);
+int open_dtlb_counter();
+void *worker_job(void *arg);
+void *writer_job(void *arg);
+int next_key(unsigned *seed);
+int latency_bucket(long ns);
+long bucket_value(int bucket);
+long percentile(unsigned long *hist, unsigned long total, double p);
+long now_ns();
+unsigned next_random(unsigned *seed);
+double elapsed(struct timeval *start);
+void print_lock_profile();
+
+int main(int argc, char **argv)
+{
+    int opt, n;
+    long budget = 0;
+    char name[32];
+    double locked_base = 0, lockfree_base = 0;
+    Result locked, lockfree;
+    PayloadStats payload;
+    static const char *page_kinds[] = {"none", "normal", "thp", "hugetlb"};
+
+    while ((opt = getopt(argc, argv, "Abt:w:k:m:r:z:o:")) != -1) {
+        switch (opt) {
+        case 'A':
+            set_cache_arena(1);
+            break;
+        case 'b':
+            read_body = 1;
+            break;
+        case 't':
+            max_threads = atoi(optarg);
+            break;
+        case 'w':
+            writer_count = atoi(optarg);
+            break;
+        case 'k':
+            key_count = atoi(optarg);
+            break;
+        case 'm':
+            duration_ms = atoi(optarg);
+            break;
+        case 'r':
+            read_percent = atoi(optarg);
+            break;
+        case 'z':
+            zipf_skew = atof(optarg);
+            break;
+        case 'o':
+            n = sscanf(optarg, "%d,%d", &min_size, &max_size);
+            if (n == 1)
+                max_size = min_size;
+            else if (n != 2)
+                min_size = 0;
+            break;
+        default:
+            fprintf(stderr, usage, argv[0]);
+            exit(0);
+        }
+    }
+    if (max_threads < 1 || writer_count < 0 || key_count < 1 ||
+        duration_ms < 1 || read_percent < 0 || read_percent > 100 ||
+        zipf_skew < 0 || min_size < 1 || max_size < min_size ||
+        max_size > MAX_OBJECT_LIMIT) {
+        fprintf(stderr, usage, argv[0]);
+        exit(0);
+    }
+
+    // the budget holds the first half of the keys
+    make_keys();
+    for (int i = 0; i < key_count; ++i)
+        budget += sizes[i];
+    set_cache_budget(budget);
+    if (max_size > get_object_limit())
+        set_object_limit(max_size);
+    init_cache();
+    fill_cache();
+
+    get_payload_stats(&payload);
+    printf("%d keys, %d%% lookups, ", key_count, read_percent);
+    if (zipf_skew > 0)
+        printf("zipf %.2f, ", zipf_skew);
+    else
+        printf("uniform, ");
+    if (min_size == max_size)
+        printf("%d bytes, ", min_size);
+    else
+        printf("%d-%d bytes, ", min_size, max_size);
+    printf("%d writers, %d ms per run, %s, arena %s\n", writer_count,
+           duration_ms, read_body ? "whole bodies" : "first bytes",
+           page_kinds[payload.backing]);
+    printf("%7s %-9s %12s %7s %6s %12s", "threads", "mode", "ops/s",
+           "scaling", "hit%", "ins/s");
+    for (int i = 0; i < PERCENTILES; ++i) {
+        snprintf(name, sizeof(name), "get p%g", percentiles[i]);
+        printf(" %9s", name);
+    }
+    printf(" %7s %7s %8s\n", "add p50", "add p99", "dTLB");
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+        set_cache_lockfree(0);
+        run_workers(threads, &locked);
+        set_cache_lockfree(1);
+        run_workers(threads, &lockfree);
+        if (threads == 1) {
+            locked_base = locked.ops;
+            lockfree_base = lockfree.ops;
+        }
+        print_result(threads, "rwlock", &locked, locked_base);
+        print_result(threads, "lock-free", &lockfree, lockfree_base);
+
+        // always finish with the requested thread count
+        if (threads < max_threads && threads * 2 > max_threads)
+            threads = max_threads / 2;
+    }
+
+#ifdef LOCK_PROFILE
+    print_lock_profile();
+#endif
+
+    free_cache();
+    return 0;
+}
+
+/*
+ * make_keys - make the keys of all objects, and the sizes of their
+ * objects, which stay the same whoever adds them
+ */
+void make_keys()
+{
+    double ratio = (double)max_size / min_size;
+
+    keys = Malloc(2 * key_count * sizeof(*keys));
+    hashes = Malloc(2 * key_count * sizeof(*hashes));
+    sizes = Malloc(2 * key_count * sizeof(*sizes));
+    for (int i = 0; i < 2 * key_count; ++i) {
+        unsigned seed = i * 2654435761u + 1;
+
+        sprintf(keys[i], "http://bench.example/object/%d", i);
+        hashes[i] = hash_key(keys[i]);
+        sizes[i] = min_size * pow(ratio, next_random(&seed) / 4294967296.0);
+    }
+    if (zipf_skew > 0)
+        make_zipf();
+}
+
+/*
+ * make_zipf - the cumulative distribution of the keys by rank, the one
+ * of rank i having a weight of 1 / (i + 1)^skew
+ */
+void make_zipf()
+{
+    double sum = 0;
+
+    zipf_cdf = Malloc(2 * key_count * sizeof(*zipf_cdf));
+    for (int i = 0; i < 2 * key_count; ++i) {
+        sum += 1 / pow(i + 1, zipf_skew);
+        zipf_cdf[i] = sum;
+    }
+    for (int i = 0; i < 2 * key_count; ++i)
+        zipf_cdf[i] /= sum;
+}
+
+/*
+ * fill_cache - add the objects of the first key_count keys to the cache
+ */
+void fill_cache()
+{
+    char *object = Malloc(max_size);
+
+    memset(object, 'x', max_size);
+    for (int i = 0; i < key_count; ++i)
+        add_object(keys[i], hashes[i], object, sizes[i]);
+    Free(object);
+}
+
+/*
+ * run_workers - run the given number of worker threads, along with the
+ * background writers, for duration_ms, and store what they measured in
+ * result
+ */
+void run_workers(int threads, Result *result)
+{
+    int total = threads + writer_count;
+    int counter = open_dtlb_counter();
+    pthread_t tids[total];
+    Worker *workers = NULL;
+    Latency *latency = Calloc(1, sizeof(Latency));
+    struct timeval start;
+    unsigned long reads = 0, writes = 0, misses = 0, inserts = 0;
+    unsigned long sampled_reads = 0, sampled_writes = 0;
+    long long count;
+    double seconds;
+
+    if (posix_memalign((void **)&workers, 64, total * sizeof(Worker)))
+        app_error("posix_memalign error");
+    memset(workers, 0, total * sizeof(Worker));
+
+    running = 1;
+    if (counter >= 0)
+        ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+    gettimeofday(&start, NULL);
+    for (int i = 0; i < total; ++i) {
+        workers[i].seed = i * 2654435761u + 1;
+        if (i < threads)
+            workers[i].latency = Calloc(1, sizeof(Latency));
+        Pthread_create(&tids[i], NULL,
+                       i < threads ? worker_job : writer_job, &workers[i]);
+    }
+    usleep(duration_ms * 1000);
+    running = 0;
+    for (int i = 0; i < total; ++i) {
+        Pthread_join(tids[i], NULL);
+        if (i >= threads) {
+            inserts += workers[i].writes;
+            continue;
+        }
+        reads += workers[i].reads;
+        writes += workers[i].writes;
+        misses += workers[i].misses;
+        for (int j = 0; j < LATENCY_BUCKETS; ++j) {
+            latency->reads[j] += workers[i].latency->reads[j];
+            latency->writes[j] += workers[i].latency->writes[j];
+        }
+        Free(workers[i].latency);
+    }
+    seconds = elapsed(&start);
+
+    result->tlb = -1;
+    if (counter >= 0) {
+        if (read(counter, &count, sizeof(count)) == sizeof(count))
+            result->tlb = (double)count / (reads + writes);
+        close(counter);
+    }
+    for (int j = 0; j < LATENCY_BUCKETS; ++j) {
+        sampled_reads += latency->reads[j];
+        sampled_writes += latency->writes[j];
+    }
+    for (int i = 0; i < PERCENTILES; ++i) {
+        result->read_ns[i] = percentile(latency->reads, sampled_reads,
+                                        percentiles[i]);
+        result->write_ns[i] = percentile(latency->writes, sampled_writes,
+                                         percentiles[i]);
+    }
+    result->ops = (reads + writes) / seconds;
+    result->inserts = inserts / seconds;
+    result->hit_ratio = reads ? (double)(reads - misses) / reads : 0;
+    Free(workers);
+    Free(latency);
+}
+
+/*
+ * print_result - print the row of a run, with its throughput relative to
+ * base, that of one thread in the same mode. Times are in nanoseconds.
+ */
+void print_result(int threads, char *mode, Result *result, double base)
+{
+    printf("%7d %-9s %12.0f %7.2f %6.1f %12.0f", threads, mode, result->ops,
+           result->ops / base, 100 * result->hit_ratio, result->inserts);
+    for (int i = 0; i < PERCENTILES; ++i)
+        if (result->read_ns[i] < 0)
+            printf(" %9s", "-");
+        else
+            printf(" %9ld", result->read_ns[i]);
+    if (result->write_ns[0] < 0)
+        printf(" %7s %7s", "-", "-");
+    else
+        printf(" %7ld %7ld", result->write_ns[0], result->write_ns[2]);
+    if (result->tlb < 0)
+        printf(" %8s\n", "n/a");
+    else
+        printf(" %8.3f\n", result->tlb);
+}
+
+/*
+ * open_dtlb_counter - a disabled counter of the dTLB load misses in user
+ * space of the threads created from now on, or -1 if the machine has
+ * none, as in most virtual machines
+ */
+int open_dtlb_counter()
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                  (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/*
+ * worker_job - look up keys and add objects until the run is over,
+ * timing one operation in LATENCY_SAMPLE
+ */
+void *worker_job(void *arg)
+{
+    Worker *worker = arg;
+    Latency *latency = worker->latency;
+    unsigned seed = worker->seed;
+    unsigned long reads = 0, writes = 0, misses = 0;
+    char *object = Malloc(max_size);
+    volatile char sink;
+
+    memset(object, 'x', max_size);
+    for (unsigned long op = 0; running; ++op) {
+        CacheLine *line;
+        int i = next_key(&seed), timed = op % LATENCY_SAMPLE == 0;
+        int read = next_random(&seed) % 100 < read_percent;
+        long start = timed ? now_ns() : 0;
+
+        if (!read) {
+            add_object(keys[i], hashes[i], object, sizes[i]);
+            ++writes;
+        }
+        else if ((line = get_object(keys[i], hashes[i])) != NULL) {
+            if (read_body) {
+                sink = line->head[0];
+                for (int j = 0; j < line->body->length; j += 64)
+                    sink += line->body->data[j];
+            }
+            else {
+                sink = line->body->data[0];
+            }
+            release_object(line);
+            ++reads;
+        }
+        else {
+            ++misses;
+            ++reads;
+        }
+        if (timed) {
+            int bucket = latency_bucket(now_ns() - start);
+            ++(read ? latency->reads : latency->writes)[bucket];
+        }
+    }
+    (void)sink;
+    Free(object);
+
+    worker->reads = reads;
+    worker->writes = writes;
+    worker->misses = misses;
+    return NULL;
+}
+
+/*
+ * writer_job - add random objects until the run is over. As the budget
+ * holds half of them, most inserts evict and retire a line.
+ */
+void *writer_job(void *arg)
+{
+    Worker *writer = arg;
+    unsigned seed = writer->seed;
+    unsigned long ops = 0;
+    char *object = Malloc(max_size);
+
+    memset(object, 'x', max_size);
+    while (running) {
+        int i = next_random(&seed) % (2 * key_count);
+
+        add_object(keys[i], hashes[i], object, sizes[i]);
+        ++ops;
+    }
+    Free(object);
+
+    writer->writes = ops;
+    return NULL;
+}
+
+/*
+ * next_key - the index of a random key, by the Zipf distribution if one
+ * was given
+ */
+int next_key(unsigned *seed)
+{
+    double u;
+    int low = 0, high = 2 * key_count - 1;
+
+    if (zipf_cdf == NULL)
+        return next_random(seed) % (2 * key_count);
+
+    // the first rank whose cumulative weight reaches u
+    u = next_random(seed) / 4294967296.0;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (zipf_cdf[mid] < u)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+/*
+ * latency_bucket - the histogram bucket of a time of ns nanoseconds. The
+ * times below 64 ns have a bucket each, and each power of two above is
+ * split in 32, so a bucket is within 3% of the times it holds.
+ */
+int latency_bucket(long ns)
+{
+    int shift;
+
+    if (ns < 64)
+        return ns < 0 ? 0 : ns;
+    shift = 63 - __builtin_clzl(ns) - 5;
+    return 64 + (shift - 1) * 32 + ((ns >> shift) & 31);
+}
+
+/*
+ * bucket_value - the smallest time in a bucket, in nanoseconds
+ */
+long bucket_value(int bucket)
+{
+    int shift = (bucket - 64) / 32 + 1;
+
+    if (bucket < 64)
+        return bucket;
+    return (32L + (bucket - 64) % 32) << shift;
+}
+
+/*
+ * percentile - the p-th percentile of the total times of a histogram,
+ * or -1 if it has none
+ */
+long percentile(unsigned long *hist, unsigned long total, double p)
+{
+    unsigned long rank = ceil(total * p / 100), seen = 0;
+
+    if (total == 0)
+        return -1;
+    for (int i = 0; i < LATENCY_BUCKETS; ++i)
+        if ((seen += hist[i]) >= rank)
+            return bucket_value(i);
+    return bucket_value(LATENCY_BUCKETS - 1);
+}
+
+/*
+ * now_ns - the monotonic clock in nanoseconds
+ */
+long now_ns()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+/*
+ * next_random - xorshift, cheaper than rand_r and good enough to pick
+ * keys
+ */
+unsigned next_random(unsigned *seed)
+{
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 17;
+    *seed ^= *seed << 5;
+    return *seed;
+}
+
+/*
+ * elapsed - seconds since start
+ */
+double elapsed(struct timeval *start)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - start->tv_sec) +
+           (now.tv_usec - start->tv_usec) / 1e6;
+}
+
+/*
+ * print_lock_profile - print the acquisitions of the cache locks so far
+ */
+void print_lock_profile()
+{
+    char *profile = Malloc(LOCK_DUMP_SIZE);
+
+    dump_cache_locks(profile, LOCK_DUMP_SIZE);
+    printf("\n%s", profile);
+    Free(profile);
+}
@@ -0,0 +1,271 @@
+/*
+ * cachekey.c
+ *
+ * Turn a request uri into the key used to index the cache, so that
+ * equivalent uris share one cache line. The key is the uri with
+ * 1) the scheme and host lowercased,
+ * 2) the default port 80 and the fragment removed,
+ * 3) an empty path replaced by "/",
+ * 4) percent-encoded unreserved characters decoded and the hex digits of
+ *    the remaining escapes uppercased,
+ * 5) optionally, configured query parameters dropped and the remaining
+ *    ones sorted.
+ * The key is only used by the cache; the request sent to the server still
+ * uses the original uri.
+ */
+
+#include "csapp.h"
+#include "cachekey.h"
+
+/* Parameters to drop from the query, set before any thread is created */
+static char *dropped_params[MAX_DROP_PARAMS];
+static int dropped_count = 0;
+static int sort_params = 0;
+
+/* Helper function declaration */
+static int append(char *key, int *n, int maxlen, char *src, int len);
+static int hex_value(char c);
+static int is_unreserved(char c);
+static int normalize_escapes(char *dst, char *src, int len);
+static int param_dropped(char *param);
+static int compare_params(const void *a, const void *b);
+
+/*
+ * drop_query_param - ignore query parameter name when making keys. A
+ * name ending with '*' drops every parameter starting with the prefix.
+ */
+void drop_query_param(char *name)
+{
+    if (dropped_count < MAX_DROP_PARAMS)
+        dropped_params[dropped_count++] = name;
+}
+
+/*
+ * sort_query_params - sort query parameters when making keys, so that
+ * their order does not matter
+ */
+void sort_query_params(int enable)
+{
+    sort_params = enable;
+}
+
+/*
+ * make_cache_key - normalize uri into key, which can hold maxlen bytes,
+ * and compute the hash of the key. Return 0 on success, or -1 if uri is
+ * not an absolute uri or the key does not fit.
+ */
+int make_cache_key(char *uri, char *key, int maxlen, unsigned long *hash)
+{
+    char buf[MAXLINE];
+    char *params[MAX_QUERY_PARAMS];
+    char *sep, *host, *auth_end, *port, *query;
+    int n = 0, len, count = 0, first = 1;
+
+    if ((sep = strstr(uri, "://")) == NULL || strlen(uri) >= MAXLINE)
+        return -1;
+
+    // scheme in lowercase
+    for (char *p = uri; p < sep; ++p) {
+        char c = tolower((unsigned char)*p);
+        if (append(key, &n, maxlen, &c, 1) < 0)
+            return -1;
+    }
+    if (append(key, &n, maxlen, "://", 3) < 0)
+        return -1;
+
+    // authority, keep user info as it is and lowercase the host
+    host = sep + 3;
+    auth_end = host + strcspn(host, "/?#");
+    for (char *p = host; p < auth_end; ++p) {
+        if (*p == '@')
+            host = p + 1;
+    }
+    if (append(key, &n, maxlen, sep + 3, host - (sep + 3)) < 0)
+        return -1;
+
+    // the port starts at the last ':' not inside an IPv6 literal
+    port = auth_end;
+    for (char *p = host; p < auth_end; ++p) {
+        if (*p == ':')
+            port = p;
+        else if (*p == ']')
+            port = auth_end;
+    }
+    for (char *p = host; p < port; ++p) {
+        char c = tolower((unsigned char)*p);
+        if (append(key, &n, maxlen, &c, 1) < 0)
+            return -1;
+    }
+    if (port < auth_end && !(auth_end - port == 3 &&
+                             strncmp(port, ":80", 3) == 0) &&
+        auth_end - port > 1) {
+        if (append(key, &n, maxlen, port, auth_end - port) < 0)
+            return -1;
+    }
+
+    // path and query without the fragment
+    len = normalize_escapes(buf, auth_end, strcspn(auth_end, "#"));
+    buf[len] = '\0';
+    if ((query = strchr(buf, '?')) != NULL)
+        *query++ = '\0';
+
+    if (buf[0] != '/' && append(key, &n, maxlen, "/", 1) < 0)
+        return -1;
+    if (append(key, &n, maxlen, buf, strlen(buf)) < 0)
+        return -1;
+
+    if (query != NULL) {
+        // split the query into parameters. A query with too many of them
+        // is kept as it is.
+        char *param = query;
+        while (param != NULL && count <= MAX_QUERY_PARAMS) {
+            char *next = strchr(param, '&');
+            if (next != NULL)
+                *next++ = '\0';
+            if (count < MAX_QUERY_PARAMS)
+                params[count] = param;
+            ++count;
+            param = next;
+        }
+
+        if (count > MAX_QUERY_PARAMS) {
+            for (char *p = query; p < buf + len; ++p) {
+                if (*p == '\0')
+                    *p = '&';
+            }
+            if (append(key, &n, maxlen, "?", 1) < 0 ||
+                append(key, &n, maxlen, query, strlen(query)) < 0)
+                return -1;
+        }
+        else {
+            if (sort_params)
+                qsort(params, count, sizeof(char *), compare_params);
+            for (int i = 0; i < count; ++i) {
+                if (param_dropped(params[i]))
+                    continue;
+                if (append(key, &n, maxlen, first ? "?" : "&", 1) < 0 ||
+                    append(key, &n, maxlen, params[i],
+                           strlen(params[i])) < 0)
+                    return -1;
+                first = 0;
+            }
+        }
+    }
+
+    if (n >= maxlen)
+        return -1;
+    key[n] = '\0';
+    *hash = hash_key(key);
+    return 0;
+}
+
+/*
+ * hash_key - 64-bit FNV-1a hash of a cache key
+ */
+unsigned long hash_key(char *key)
+{
+    unsigned long hash = 0xcbf29ce484222325UL;
+
+    while (*key) {
+        hash ^= (unsigned char)*key++;
+        hash *= 0x100000001b3UL;
+    }
+    return hash;
+}
+
+/*
+ * append - append len bytes of src to the key being built. Return -1 if
+ * the key is full.
+ */
+static int append(char *key, int *n, int maxlen, char *src, int len)
+{
+    if (*n + len >= maxlen)
+        return -1;
+    memcpy(key + *n, src, len);
+    *n += len;
+    return 0;
+}
+
+/*
+ * hex_value - value of a hex digit, or -1 if c is not a hex digit
+ */
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+/*
+ * is_unreserved - whether c may appear in a uri without being escaped
+ */
+static int is_unreserved(char c)
+{
+    return isalnum((unsigned char)c) || c == '-' || c == '.' || c == '_' ||
+           c == '~';
+}
+
+/*
+ * normalize_escapes - copy len bytes of src to dst, decoding escaped
+ * unreserved characters and uppercasing other escapes. Return the number
+ * of bytes written, which is never more than len.
+ */
+static int normalize_escapes(char *dst, char *src, int len)
+{
+    int n = 0;
+
+    for (int i = 0; i < len; ++i) {
+        if (src[i] == '%' && i + 2 < len && hex_value(src[i + 1]) >= 0 &&
+            hex_value(src[i + 2]) >= 0) {
+            char c = hex_value(src[i + 1]) * 16 + hex_value(src[i + 2]);
+            if (is_unreserved(c)) {
+                dst[n++] = c;
+            }
+            else {
+                dst[n++] = '%';
+                dst[n++] = toupper(src[i + 1]);
+                dst[n++] = toupper(src[i + 2]);
+            }
+            i += 2;
+        }
+        else {
+            dst[n++] = src[i];
+        }
+    }
+    return n;
+}
+
+/*
+ * param_dropped - whether the "name=value" query parameter is configured
+ * to be dropped from keys
+ */
+static int param_dropped(char *param)
+{
+    int len = strcspn(param, "=");
+
+    for (int i = 0; i < dropped_count; ++i) {
+        char *name = dropped_params[i];
+        int name_len = strlen(name);
+
+        if (name_len > 0 && name[name_len - 1] == '*') {
+            if (len >= name_len - 1 && strncmp(param, name, name_len - 1) == 0)
+                return 1;
+        }
+        else if (len == name_len && strncmp(param, name, len) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * compare_params - qsort comparator for query parameters
+ */
+static int compare_params(const void *a, const void *b)
+{
+    return strcmp(*(char **)a, *(char **)b);
+}
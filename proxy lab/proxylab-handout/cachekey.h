@@ -0,0 +1,21 @@
+/*
+ * cachekey.h
+ *
+ * Header file for cache key module
+ */
+
+#ifndef CACHEKEY_H
+#define CACHEKEY_H
+
+#define MAX_DROP_PARAMS 32  /* max number of query parameters to drop */
+#define MAX_QUERY_PARAMS 64 /* queries with more parameters are not sorted */
+
+void drop_query_param(char *name);
+
+void sort_query_params(int enable);
+
+int make_cache_key(char *uri, char *key, int maxlen, unsigned long *hash);
+
+unsigned long hash_key(char *key);
+
+#endif
@@ -0,0 +1,330 @@
+/*
+ * cachesim.c
+ *
+ * Offline replay of a proxy access log (proxy -a) against the cache
+ * module, without the network. Each request of the log is looked up in
+ * the cache, and on a miss an object of the logged size is added, just
+ * as the proxy would do. Requests the proxy passed through uncached
+ * (kind "pass": errors, partial or non-200 responses) are only looked
+ * up, so they count as misses and never become hits. The log is replayed
+ * once for every combination of the given budgets, replacement and
+ * admission policies, and the object and byte hit ratios, the evictions,
+ * and the time per lookup and per insert of each run are printed. With
+ * host partitions (-q), the hit ratio and evictions of each partition
+ * follow each run.
+ */
+
+#include "csapp.h"
+#include "cache.h"
+#include "cachekey.h"
+
+#define MAX_RUNS 16
+
+static const char *usage =
+"Usage: %s [-Ls] [-c budget,...] [-o object size] [-p lru,clock,fifo] "
+"[-a all,second] [-q host=quota]... [-d param]... <access log>\n";
+
+/*
+ * a request of the access log
+ */
+typedef struct {
+    char *key;
+    unsigned long hash;
+    int size;
+    int cacheable;  /* the proxy offered the response to the cache */
+} Request;
+
+/* Replay parameters */
+static long budgets[MAX_RUNS] = {DEFAULT_CACHE_SIZE};
+static int budget_count = 1;
+static int policies[MAX_RUNS] = {POLICY_LRU, POLICY_CLOCK, POLICY_FIFO};
+static int policy_count = 3;
+static int admissions[MAX_RUNS] = {ADMIT_ALL};
+static int admission_count = 1;
+
+static const char *policy_names[] = {"lru", "clock", "fifo"};
+static const char *admission_names[] = {"all", "second"};
+
+static Request *requests;
+static int request_count;
+static double first_time, last_time;
+static char *object;    /* contents of every object added */
+static double timer_cost;   /* seconds taken by a pair of now() */
+
+/* Helper function declaration */
+int parse_budgets(char *arg);
+int parse_names(char *arg, const char **names, int name_count, int *out);
+void load_log(char *path);
+void replay(long budget, int policy, int admission);
+double cpu_seconds();
+double now();
+double measure_timer_cost();
+
+int main(int argc, char **argv)
+{
+    int opt;
+    char *quota;
+
+    // parse options, see usage. -L, -s, -q and -d work as in the proxy
+    while ((opt = getopt(argc, argv, "Lsc:o:p:a:q:d:")) != -1) {
+        switch (opt) {
+        case 'L':
+            set_cache_lockfree(1);
+            break;
+        case 's':
+            sort_query_params(1);
+            break;
+        case 'c':
+            budget_count = parse_budgets(optarg);
+            break;
+        case 'o':
+            if (atoi(optarg) <= 0) {
+                fprintf(stderr, usage, argv[0]);
+                exit(0);
+            }
+            set_object_limit(atoi(optarg));
+            break;
+        case 'p':
+            policy_count = parse_names(optarg, policy_names, 3, policies);
+            break;
+        case 'a':
+            admission_count = parse_names(optarg, admission_names, 2,
+                                          admissions);
+            break;
+        case 'q':
+            if ((quota = strrchr(optarg, '=')) == NULL ||
+                atol(quota + 1) <= 0) {
+                fprintf(stderr, usage, argv[0]);
+                exit(0);
+            }
+            *quota = '\0';
+            if (add_cache_partition(optarg, atol(quota + 1)) < 0) {
+                fprintf(stderr, "Too many partitions.\n");
+                exit(0);
+            }
+            break;
+        case 'd':
+            drop_query_param(optarg);
+            break;
+        default:
+            fprintf(stderr, usage, argv[0]);
+            exit(0);
+        }
+    }
+    if (argc - optind != 1 || budget_count <= 0 || policy_count <= 0 ||
+        admission_count <= 0) {
+        fprintf(stderr, usage, argv[0]);
+        exit(0);
+    }
+
+    init_cache();
+    load_log(argv[optind]);
+    timer_cost = measure_timer_cost();
+    printf("%d requests over %.1f s, object limit %d\n", request_count,
+           last_time - first_time, get_object_limit());
+    printf("%-6s %-6s %10s %8s %8s %10s %10s %8s %8s %8s\n", "policy",
+           "admit", "budget", "hit%", "bytehit%", "evictions", "rejects",
+           "get ns", "add ns", "ns/req");
+
+    for (int i = 0; i < budget_count; ++i)
+        for (int j = 0; j < policy_count; ++j)
+            for (int k = 0; k < admission_count; ++k)
+                replay(budgets[i], policies[j], admissions[k]);
+    return 0;
+}
+
+/*
+ * parse_budgets - read a comma separated list of budgets to budgets.
+ * Return how many there are, or -1 if one is not positive.
+ */
+int parse_budgets(char *arg)
+{
+    int count = 0;
+
+    for (char *p = strtok(arg, ","); p != NULL && count < MAX_RUNS;
+         p = strtok(NULL, ",")) {
+        if ((budgets[count++] = atol(p)) <= 0)
+            return -1;
+    }
+    return count;
+}
+
+/*
+ * parse_names - read a comma separated list of names to out, as their
+ * index in names. Return how many there are, or -1 if one is unknown.
+ */
+int parse_names(char *arg, const char **names, int name_count, int *out)
+{
+    int count = 0;
+
+    for (char *p = strtok(arg, ","); p != NULL && count < MAX_RUNS;
+         p = strtok(NULL, ",")) {
+        int i = 0;
+        while (i < name_count && strcmp(p, names[i]) != 0)
+            ++i;
+        if (i == name_count)
+            return -1;
+        out[count++] = i;
+    }
+    return count;
+}
+
+/*
+ * load_log - read every request of the access log at path, and make its
+ * cache key the way the proxy does. Malformed lines are skipped.
+ */
+void load_log(char *path)
+{
+    FILE *fp;
+    char line[MAXLINE], uri[MAXLINE], key[MAXLINE], kind[8];
+    int capacity = 1024, max_size = 1, skipped = 0;
+    double time;
+
+    if ((fp = fopen(path, "r")) == NULL)
+        unix_error("fopen error");
+    requests = Malloc(capacity * sizeof(Request));
+
+    while (fgets(line, MAXLINE, fp) != NULL) {
+        Request *request;
+        int status, size;
+
+        // time status size kind latency uri, see log_access in proxy.c
+        if (sscanf(line, "%lf %d %d %7s %*d %s", &time, &status, &size, kind,
+                   uri) != 5 || size < 0 ||
+            (strcmp(kind, "hit") != 0 && strcmp(kind, "miss") != 0 &&
+             strcmp(kind, "pass") != 0)) {
+            ++skipped;
+            continue;
+        }
+        if (request_count == capacity) {
+            capacity *= 2;
+            requests = Realloc(requests, capacity * sizeof(Request));
+        }
+        request = &requests[request_count++];
+
+        if (make_cache_key(uri, key, MAXLINE, &request->hash) < 0) {
+            strcpy(key, uri);
+            request->hash = hash_key(key);
+        }
+        request->key = strdup(key);
+        request->size = size;
+        request->cacheable = strcmp(kind, "pass") != 0;
+        if (size > max_size)
+            max_size = size;
+
+        if (request_count == 1)
+            first_time = time;
+        last_time = time;
+    }
+    Fclose(fp);
+
+    if (skipped > 0)
+        fprintf(stderr, "skipped %d malformed lines\n", skipped);
+
+    object = Malloc(max_size);
+    memset(object, 'x', max_size);
+}
+
+/*
+ * replay - replay the whole log against an empty cache with the given
+ * budget and policies, and print the results. Only the cache calls are
+ * timed, since the keys were made when the log was loaded: each lookup
+ * and each insert on its own, less the cost of reading the clock, and
+ * the whole replay in CPU time.
+ */
+void replay(long budget, int policy, int admission)
+{
+    unsigned long hits = 0, bytes = 0, hit_bytes = 0, adds = 0;
+    CacheStats stats;
+    PartitionStats parts[MAX_PARTITIONS];
+    int count;
+    double start, seconds, get_seconds = 0, add_seconds = 0, t;
+
+    free_cache();
+    set_cache_budget(budget);
+    set_cache_policy(policy);
+    set_cache_admission(admission);
+    init_cache();
+
+    start = cpu_seconds();
+    for (int i = 0; i < request_count; ++i) {
+        Request *request = &requests[i];
+        CacheLine *line;
+
+        t = now();
+        line = get_object(request->key, request->hash);
+        get_seconds += now() - t - timer_cost;
+
+        if (line != NULL) {
+            ++hits;
+            hit_bytes += request->size;
+            release_object(line);
+        }
+        else if (request->cacheable) {
+            t = now();
+            add_object(request->key, request->hash, object, request->size);
+            add_seconds += now() - t - timer_cost;
+            ++adds;
+        }
+        bytes += request->size;
+    }
+    seconds = cpu_seconds() - start;
+
+    get_cache_stats(&stats);
+    printf("%-6s %-6s %10ld %8.2f %8.2f %10lu %10lu %8.0f %8.0f %8.0f\n",
+           policy_names[policy], admission_names[admission], budget,
+           request_count ? 100.0 * hits / request_count : 0,
+           bytes ? 100.0 * hit_bytes / bytes : 0, stats.evictions,
+           stats.rejects,
+           request_count ? get_seconds * 1e9 / request_count : 0,
+           adds ? add_seconds * 1e9 / adds : 0,
+           request_count ? seconds * 1e9 / request_count : 0);
+
+    count = get_partition_stats(parts, MAX_PARTITIONS);
+    for (int i = 0; i < count && count > 1; ++i) {
+        unsigned long lookups = parts[i].hits + parts[i].misses;
+        printf("  %-20.20s quota %10ld used %10ld hit%% %6.2f "
+               "evictions %lu\n", parts[i].pattern[0] ? parts[i].pattern :
+               "default", parts[i].quota, parts[i].used,
+               lookups ? 100.0 * parts[i].hits / lookups : 0,
+               parts[i].evictions);
+    }
+}
+
+/*
+ * cpu_seconds - CPU time used by the process so far
+ */
+double cpu_seconds()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/*
+ * now - monotonic time in seconds
+ */
+double now()
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/*
+ * measure_timer_cost - the smallest time seen between two calls of now(),
+ * taken off every timed cache call
+ */
+double measure_timer_cost()
+{
+    double best = 1;
+
+    for (int i = 0; i < 1000; ++i) {
+        double t = now(), d = now() - t;
+        if (d < best)
+            best = d;
+    }
+    return best;
+}
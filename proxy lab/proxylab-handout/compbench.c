@@ -0,0 +1,109 @@
+/*
+ * compbench.c
+ *
+ * Benchmark of the gzip codec of the compressed cache tier. Each file
+ * given is compressed and decompressed a few times, and the compressed
+ * size, the effective capacity gain (how many more such objects fit in
+ * the same budget) and the CPU time of an insert (compress) and of a hit
+ * that decompresses are printed. A file that would grow is reported as
+ * such, as the cache stores it uncompressed.
+ */
+
+#include "csapp.h"
+#include "compress.h"
+
+#define ROUNDS 20
+
+static const char *usage = "Usage: %s <file>...\n";
+
+/* Helper function declaration */
+char *read_file(char *path, int *length);
+double cpu_seconds();
+
+int main(int argc, char **argv)
+{
+    long total_raw = 0, total_packed = 0;
+
+    if (argc < 2) {
+        fprintf(stderr, usage, argv[0]);
+        exit(0);
+    }
+
+    printf("%-24s %10s %10s %6s %10s %10s %8s\n", "file", "bytes", "gzipped",
+           "gain", "insert us", "hit us", "MB/s");
+    for (int i = 1; i < argc; ++i) {
+        int length, packed_length = 0, n = 0;
+        char *data = read_file(argv[i], &length);
+        char *packed = Malloc(length + GZIP_OVERHEAD + 64);
+        char *back = Malloc(length > 0 ? length : 1);
+        double best_in = 0, best_out = 0;
+
+        for (int r = 0; r < ROUNDS; ++r) {
+            double start = cpu_seconds(), seconds;
+            packed_length = gzip_compress(data, length, packed,
+                                          length + GZIP_OVERHEAD + 64);
+            seconds = cpu_seconds() - start;
+            if (r == 0 || seconds < best_in)
+                best_in = seconds;
+
+            start = cpu_seconds();
+            n = gzip_decompress(packed, packed_length, back, length);
+            seconds = cpu_seconds() - start;
+            if (r == 0 || seconds < best_out)
+                best_out = seconds;
+        }
+        if (packed_length == 0) {
+            printf("%-24.24s %10d %10s\n", argv[i], length, "grows");
+            Free(data);
+            Free(packed);
+            Free(back);
+            continue;
+        }
+        if (n != length || memcmp(data, back, length) != 0)
+            app_error("round trip failed");
+
+        printf("%-24.24s %10d %10d %5.2fx %10.1f %10.1f %8.0f\n", argv[i],
+               length, packed_length, (double)length / packed_length,
+               best_in * 1e6, best_out * 1e6,
+               best_out > 0 ? length / best_out / 1e6 : 0);
+        total_raw += length;
+        total_packed += packed_length;
+        Free(data);
+        Free(packed);
+        Free(back);
+    }
+    if (total_packed > 0)
+        printf("all: %ld bytes in %ld, %.2fx the capacity\n", total_raw,
+               total_packed, (double)total_raw / total_packed);
+    return 0;
+}
+
+/*
+ * read_file - read the whole file at path to a new buffer, and store its
+ * length in length
+ */
+char *read_file(char *path, int *length)
+{
+    struct stat st;
+    rio_t rio;
+    char *data;
+    int fd = Open(path, O_RDONLY, 0);
+
+    Fstat(fd, &st);
+    data = Malloc(st.st_size > 0 ? st.st_size : 1);
+    Rio_readinitb(&rio, fd);
+    *length = Rio_readnb(&rio, data, st.st_size);
+    Close(fd);
+    return data;
+}
+
+/*
+ * cpu_seconds - CPU time used by the process so far
+ */
+double cpu_seconds()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
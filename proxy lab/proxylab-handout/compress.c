@@ -0,0 +1,408 @@
+/*
+ * compress.c
+ *
+ * A small gzip codec for the compressed cache tier. The compressor finds
+ * repeated strings with a hash table of 4-byte prefixes (LZ77), and codes
+ * them as one deflate block with the fixed Huffman codes. The output is
+ * plain gzip, so it can be sent as is to clients that accept gzip. The
+ * decompressor only reads what the compressor writes: a gzip member
+ * without optional header fields, made of fixed Huffman blocks. It
+ * decodes with lookup tables instead of bit by bit, and trusts the data,
+ * which never left memory, so the CRC is written but not checked.
+ */
+
+#include "csapp.h"
+#include "compress.h"
+
+#define WINDOW_SIZE     32768
+#define MIN_MATCH       4       /* shorter matches are not looked for */
+#define MAX_MATCH       258
+#define MAX_HASH_BITS   15
+#define MIN_HASH_BITS   8
+#define END_OF_BLOCK    256
+#define LIT_BITS        9       /* longest fixed literal/length code */
+#define DIST_BITS       5       /* every fixed distance code */
+
+/*
+ * an entry of a decoding table: the symbol and the bits of its code
+ */
+typedef struct {
+    unsigned short symbol;
+    unsigned char bits;
+} Code;
+
+/*
+ * output bits, written from the least significant bit of each byte
+ */
+typedef struct {
+    unsigned char *out;
+    int cap;
+    int pos;
+    int overflow;
+    unsigned long bits;
+    int count;
+} BitWriter;
+
+/*
+ * input bits. Bytes past the end read as zero, and are caught by
+ * checking how far the reader went once it is done.
+ */
+typedef struct {
+    unsigned char *in;
+    int len;
+    int pos;
+    unsigned long bits;
+    int count;
+} BitReader;
+
+static const unsigned short length_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const unsigned char length_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const unsigned short dist_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+    8193, 12289, 16385, 24577
+};
+static const unsigned char dist_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+/* Tables built once by init_tables */
+static unsigned short lit_code[288];        /* bit-reversed fixed codes */
+static unsigned char lit_bits[288];
+static unsigned char length_code[MAX_MATCH + 1];  /* length - 257 */
+static unsigned char dist_code[512];        /* see distance_code */
+static Code lit_table[1 << LIT_BITS];
+static Code dist_table[1 << DIST_BITS];
+static unsigned int crc_table[256];
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+/* Helper function declaration */
+static void init_tables(void);
+static unsigned reverse_bits(unsigned code, int n);
+static int distance_code(int dist);
+static unsigned int crc32(unsigned char *p, int n);
+static void put_bits(BitWriter *w, unsigned long value, int n);
+static void put_match(BitWriter *w, int length, int dist);
+static void put_le32(unsigned char *p, unsigned int v);
+static unsigned int get_bits(BitReader *r, int n);
+static int decode(BitReader *r, Code *table, int bits);
+
+/*
+ * gzip_compress - compress n bytes of src to dst, at most cap bytes.
+ * Return the length of the compressed data, or 0 if it would not fit.
+ */
+int gzip_compress(char *src, int n, char *dst, int cap)
+{
+    static const unsigned char header[10] = {
+        0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 0xff
+    };
+    unsigned char *in = (unsigned char *)src;
+    int head[1 << MAX_HASH_BITS];       /* last position + 1 per hash */
+    int hash_bits = MIN_HASH_BITS, pos = 0;
+    BitWriter w;
+
+    pthread_once(&tables_once, init_tables);
+    if (cap < GZIP_OVERHEAD + 1)
+        return 0;
+    memcpy(dst, header, sizeof(header));
+    w.out = (unsigned char *)dst;
+    w.cap = cap - 8;
+    w.pos = sizeof(header);
+    w.overflow = 0;
+    w.bits = 0;
+    w.count = 0;
+
+    // a table about as large as the input, so small inputs clear less
+    while (hash_bits < MAX_HASH_BITS && (1 << hash_bits) < n)
+        ++hash_bits;
+    memset(head, 0, sizeof(int) << hash_bits);
+
+    // final block with fixed Huffman codes
+    put_bits(&w, 1, 1);
+    put_bits(&w, 1, 2);
+
+    while (pos + MIN_MATCH <= n && !w.overflow) {
+        unsigned int word, h;
+        int cand;
+
+        memcpy(&word, in + pos, 4);
+        h = (word * 2654435761U) >> (32 - hash_bits);
+        cand = head[h] - 1;
+        head[h] = pos + 1;
+
+        if (cand >= 0 && pos - cand <= WINDOW_SIZE &&
+            memcmp(in + cand, in + pos, MIN_MATCH) == 0) {
+            int length = MIN_MATCH;
+            int max = n - pos < MAX_MATCH ? n - pos : MAX_MATCH;
+            while (length < max && in[cand + length] == in[pos + length])
+                ++length;
+            put_match(&w, length, pos - cand);
+
+            // remember the positions inside the match too
+            for (int i = pos + 1; i < pos + length && i + 4 <= n; ++i) {
+                memcpy(&word, in + i, 4);
+                head[(word * 2654435761U) >> (32 - hash_bits)] = i + 1;
+            }
+            pos += length;
+        }
+        else {
+            put_bits(&w, lit_code[in[pos]], lit_bits[in[pos]]);
+            ++pos;
+        }
+    }
+    for (; pos < n; ++pos)
+        put_bits(&w, lit_code[in[pos]], lit_bits[in[pos]]);
+    put_bits(&w, lit_code[END_OF_BLOCK], lit_bits[END_OF_BLOCK]);
+    put_bits(&w, 0, 7);     // the last bits of the last byte
+    if (w.overflow)
+        return 0;
+
+    put_le32(w.out + w.pos, crc32(in, n));
+    put_le32(w.out + w.pos + 4, n);
+    return w.pos + 8;
+}
+
+/*
+ * gzip_decompress - decompress n bytes of gzip data from gzip_compress
+ * to dst, at most cap bytes. Return the length of the decompressed data,
+ * or -1 if src is not such data or does not fit.
+ */
+int gzip_decompress(char *src, int n, char *dst, int cap)
+{
+    unsigned char *in = (unsigned char *)src;
+    unsigned char *out = (unsigned char *)dst;
+    unsigned int size;
+    int pos = 0, final;
+    BitReader r;
+
+    pthread_once(&tables_once, init_tables);
+    if (n < GZIP_OVERHEAD || in[0] != 0x1f || in[1] != 0x8b ||
+        in[2] != 8 || in[3] != 0)
+        return -1;
+    size = in[n - 4] | in[n - 3] << 8 | in[n - 2] << 16 |
+           (unsigned int)in[n - 1] << 24;
+    if (size > cap)
+        return -1;
+
+    r.in = in + 10;
+    r.len = n - GZIP_OVERHEAD;
+    r.pos = 0;
+    r.bits = 0;
+    r.count = 0;
+
+    do {
+        final = get_bits(&r, 1);
+        if (get_bits(&r, 2) != 1)
+            return -1;
+        while (1) {
+            int symbol = decode(&r, lit_table, LIT_BITS);
+            int length, dist;
+
+            if (symbol < 256) {
+                if (pos == size)
+                    return -1;
+                out[pos++] = symbol;
+                continue;
+            }
+            if (symbol == END_OF_BLOCK)
+                break;
+            if ((symbol -= 257) >= 29)
+                return -1;
+            length = length_base[symbol] +
+                     get_bits(&r, length_extra[symbol]);
+            if ((symbol = decode(&r, dist_table, DIST_BITS)) >= 30)
+                return -1;
+            dist = dist_base[symbol] + get_bits(&r, dist_extra[symbol]);
+            if (dist > pos || length > size - pos)
+                return -1;
+            // the match may overlap the bytes it produces
+            if (dist >= length)
+                memcpy(out + pos, out + pos - dist, length);
+            else
+                for (int i = 0; i < length; ++i)
+                    out[pos + i] = out[pos + i - dist];
+            pos += length;
+        }
+        // stop at the end of the input, which reads as zeros
+        if (r.pos - r.count / 8 > r.len)
+            return -1;
+    } while (!final);
+
+    return pos == size ? pos : -1;
+}
+
+/*
+ * init_tables - build the code tables, once
+ */
+static void init_tables(void)
+{
+    for (int s = 0; s < 288; ++s) {
+        // the fixed literal/length codes of RFC 1951, section 3.2.6
+        if (s < 144) {
+            lit_bits[s] = 8;
+            lit_code[s] = reverse_bits(0x30 + s, 8);
+        }
+        else if (s < 256) {
+            lit_bits[s] = 9;
+            lit_code[s] = reverse_bits(0x190 + s - 144, 9);
+        }
+        else if (s < 280) {
+            lit_bits[s] = 7;
+            lit_code[s] = reverse_bits(s - 256, 7);
+        }
+        else {
+            lit_bits[s] = 8;
+            lit_code[s] = reverse_bits(0xc0 + s - 280, 8);
+        }
+        // every way the code can be followed by other bits
+        for (int f = 0; f < 1 << (LIT_BITS - lit_bits[s]); ++f) {
+            Code *c = &lit_table[lit_code[s] | f << lit_bits[s]];
+            c->symbol = s;
+            c->bits = lit_bits[s];
+        }
+    }
+    for (int s = 0; s < 32; ++s) {
+        dist_table[reverse_bits(s, DIST_BITS)].symbol = s;
+        dist_table[reverse_bits(s, DIST_BITS)].bits = DIST_BITS;
+    }
+
+    for (int c = 0; c < 29; ++c)
+        for (int l = length_base[c];
+             l < length_base[c] + (1 << length_extra[c]) && l <= MAX_MATCH;
+             ++l)
+            length_code[l] = c;
+    // 258 gets its own code 28, written after the range of code 27
+    for (int c = 0; c < 30; ++c)
+        for (int d = dist_base[c]; d < dist_base[c] + (1 << dist_extra[c]);
+             ++d)
+            dist_code[d <= 256 ? d - 1 : 256 + ((d - 1) >> 7)] = c;
+
+    for (unsigned int i = 0; i < 256; ++i) {
+        unsigned int c = i;
+        for (int k = 0; k < 8; ++k)
+            c = (c & 1) ? 0xedb88320U ^ (c >> 1) : c >> 1;
+        crc_table[i] = c;
+    }
+}
+
+/*
+ * reverse_bits - the n low bits of code in reverse order. Huffman codes
+ * are stored starting from their most significant bit.
+ */
+static unsigned reverse_bits(unsigned code, int n)
+{
+    unsigned r = 0;
+
+    for (int i = 0; i < n; ++i, code >>= 1)
+        r = (r << 1) | (code & 1);
+    return r;
+}
+
+/*
+ * distance_code - the deflate code of a match distance. Distances up to
+ * 256 have an entry each, and longer ones one per 128.
+ */
+static int distance_code(int dist)
+{
+    return dist <= 256 ? dist_code[dist - 1] :
+                         dist_code[256 + ((dist - 1) >> 7)];
+}
+
+/*
+ * crc32 - the CRC of the gzip trailer
+ */
+static unsigned int crc32(unsigned char *p, int n)
+{
+    unsigned int c = 0xffffffffU;
+
+    for (int i = 0; i < n; ++i)
+        c = crc_table[(c ^ p[i]) & 0xff] ^ (c >> 8);
+    return c ^ 0xffffffffU;
+}
+
+/*
+ * put_bits - write the n low bits of value
+ */
+static void put_bits(BitWriter *w, unsigned long value, int n)
+{
+    w->bits |= value << w->count;
+    w->count += n;
+    while (w->count >= 8) {
+        if (w->pos < w->cap)
+            w->out[w->pos++] = w->bits & 0xff;
+        else
+            w->overflow = 1;
+        w->bits >>= 8;
+        w->count -= 8;
+    }
+}
+
+/*
+ * put_match - write a match of length bytes at distance dist
+ */
+static void put_match(BitWriter *w, int length, int dist)
+{
+    int lc = length_code[length], dc = distance_code(dist);
+
+    put_bits(w, lit_code[257 + lc], lit_bits[257 + lc]);
+    put_bits(w, length - length_base[lc], length_extra[lc]);
+    put_bits(w, reverse_bits(dc, DIST_BITS), DIST_BITS);
+    put_bits(w, dist - dist_base[dc], dist_extra[dc]);
+}
+
+/*
+ * put_le32 - store v in 4 bytes, least significant first
+ */
+static void put_le32(unsigned char *p, unsigned int v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+/*
+ * get_bits - read n bits, at most 16
+ */
+static unsigned int get_bits(BitReader *r, int n)
+{
+    unsigned int v;
+
+    while (r->count < n) {
+        unsigned long byte = r->pos < r->len ? r->in[r->pos] : 0;
+        r->bits |= byte << r->count;
+        r->count += 8;
+        ++r->pos;
+    }
+    v = r->bits & ((1UL << n) - 1);
+    r->bits >>= n;
+    r->count -= n;
+    return v;
+}
+
+/*
+ * decode - read one symbol with a decoding table indexed by the next
+ * bits bits
+ */
+static int decode(BitReader *r, Code *table, int bits)
+{
+    Code c;
+
+    while (r->count < bits) {
+        unsigned long byte = r->pos < r->len ? r->in[r->pos] : 0;
+        r->bits |= byte << r->count;
+        r->count += 8;
+        ++r->pos;
+    }
+    c = table[r->bits & ((1UL << bits) - 1)];
+    r->bits >>= c.bits;
+    r->count -= c.bits;
+    return c.symbol;
+}
@@ -0,0 +1,16 @@
+/*
+ * compress.h
+ *
+ * Header file for the gzip codec of the compressed cache tier
+ */
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#define GZIP_OVERHEAD  18       /* bytes of gzip header and trailer */
+
+int gzip_compress(char *src, int n, char *dst, int cap);
+
+int gzip_decompress(char *src, int n, char *dst, int cap);
+
+#endif
@@ -434,10 +434,14 @@ void Munmap(void *start, size_t length)
  * Wrappers for dynamic storage allocation functions
  ***************************************************/
 
+/* Calls of Malloc, Realloc and Calloc so far, see get_alloc_count */
+static long alloc_count = 0;
+
 void *Malloc(size_t size) 
 {
     void *p;
 
+    __atomic_fetch_add(&alloc_count, 1, __ATOMIC_RELAXED);
     if ((p  = malloc(size)) == NULL)
 	unix_error("Malloc error");
     return p;
@@ -447,6 +451,7 @@ void *Realloc(void *ptr, size_t size)
 {
     void *p;
 
+    __atomic_fetch_add(&alloc_count, 1, __ATOMIC_RELAXED);
     if ((p  = realloc(ptr, size)) == NULL)
 	unix_error("Realloc error");
     return p;
@@ -456,6 +461,7 @@ void *Calloc(size_t nmemb, size_t size)
 {
     void *p;
 
+    __atomic_fetch_add(&alloc_count, 1, __ATOMIC_RELAXED);
     if ((p = calloc(nmemb, size)) == NULL)
 	unix_error("Calloc error");
     return p;
@@ -466,6 +472,15 @@ void Free(void *ptr)
     free(ptr);
 }
 
+/*
+ * get_alloc_count - number of heap allocations made through the wrappers
+ * above since the program started
+ */
+long get_alloc_count(void)
+{
+    return __atomic_load_n(&alloc_count, __ATOMIC_RELAXED);
+}
+
 /******************************************
  * Wrappers for the Standard I/O functions.
  ******************************************/
@@ -788,10 +803,8 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
  *    read() if the internal buffer is empty.
  */
 /* $begin rio_read */
-static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
+static ssize_t rio_fill(rio_t *rp)
 {
-    int cnt;
-
     while (rp->rio_cnt <= 0) {  /* Refill if buf is empty */
 	rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, 
 			   sizeof(rp->rio_buf));
@@ -804,6 +817,16 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
 	else 
 	    rp->rio_bufptr = rp->rio_buf; /* Reset buffer ptr */
     }
+    return rp->rio_cnt;
+}
+
+static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
+{
+    int cnt;
+    ssize_t rc;
+
+    if ((rc = rio_fill(rp)) <= 0)
+	return rc;
 
     /* Copy min(n, rp->rio_cnt) bytes from internal buf to user buf */
     cnt = n;          
@@ -851,34 +874,95 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n)
 /* $end rio_readnb */
 
 /* 
- * rio_readlineb - Robustly read a text line (buffered)
+ * rio_readlineb - Robustly read a text line (buffered). The internal
+ *    buffer is searched for the newline with memchr, and whole spans
+ *    are copied at once instead of one byte per rio_read call.
  */
 /* $begin rio_readlineb */
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) 
 {
-    int n, rc;
-    char c, *bufp = usrbuf;
-
-    for (n = 1; n < maxlen; n++) { 
-        if ((rc = rio_read(rp, &c, 1)) == 1) {
-	    *bufp++ = c;
-	    if (c == '\n') {
-                n++;
-     		break;
-            }
-	} else if (rc == 0) {
-	    if (n == 1)
-		return 0; /* EOF, no data read */
-	    else
-		break;    /* EOF, some data was read */
-	} else
-	    return -1;	  /* Error */
+    size_t n = 0, cnt;
+    ssize_t rc;
+    char *nl, *bufp = usrbuf;
+
+    while (n + 1 < maxlen) {
+	if ((rc = rio_fill(rp)) < 0)
+	    return -1;    /* Error */
+	else if (rc == 0)
+	    break;        /* EOF */
+
+	cnt = rp->rio_cnt;
+	if (cnt > maxlen - 1 - n)
+	    cnt = maxlen - 1 - n;
+	if ((nl = memchr(rp->rio_bufptr, '\n', cnt)) != NULL)
+	    cnt = nl - rp->rio_bufptr + 1;
+	memcpy(bufp, rp->rio_bufptr, cnt);
+	rp->rio_bufptr += cnt;
+	rp->rio_cnt -= cnt;
+	bufp += cnt;
+	n += cnt;
+	if (nl != NULL)
+	    break;
     }
-    *bufp = 0;
-    return n-1;
+    if (maxlen > 0)
+	*bufp = 0;
+    return n;
 }
 /* $end rio_readlineb */
 
+/* 
+ * rio_readlineb_zc - Read a text line without copying it. On success
+ *    *linep points to the line inside the internal buffer, and the length
+ *    of the line, including its newline, is returned. The line is not
+ *    null-terminated, and stays valid until the next read from rp. A
+ *    partial line at the end of the buffer is moved to the front so that
+ *    the rest can be read after it. A line longer than the buffer is
+ *    returned in pieces of RIO_BUFSIZE bytes. Returns 0 on EOF with no
+ *    data read, and -1 on error.
+ */
+ssize_t rio_readlineb_zc(rio_t *rp, char **linep)
+{
+    ssize_t rc;
+    size_t cnt;
+    char *nl;
+
+    while (1) {
+	if (rp->rio_cnt > 0 &&
+	    (nl = memchr(rp->rio_bufptr, '\n', rp->rio_cnt)) != NULL) {
+	    cnt = nl - rp->rio_bufptr + 1;
+	    break;
+	}
+	if (rp->rio_cnt == RIO_BUFSIZE) {
+	    cnt = RIO_BUFSIZE;  /* Line longer than the buffer */
+	    break;
+	}
+
+	if (rp->rio_bufptr != rp->rio_buf) {
+	    memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+	    rp->rio_bufptr = rp->rio_buf;
+	}
+	rc = read(rp->rio_fd, rp->rio_buf + rp->rio_cnt,
+		  RIO_BUFSIZE - rp->rio_cnt);
+	if (rc < 0) {
+	    if (errno != EINTR) /* Interrupted by sig handler return */
+		return -1;
+	}
+	else if (rc == 0) {     /* EOF */
+	    if (rp->rio_cnt == 0)
+		return 0;
+	    cnt = rp->rio_cnt;  /* Last line without newline */
+	    break;
+	}
+	else
+	    rp->rio_cnt += rc;
+    }
+
+    *linep = rp->rio_bufptr;
+    rp->rio_bufptr += cnt;
+    rp->rio_cnt -= cnt;
+    return cnt;
+}
+
 /**********************************
  * Wrappers for robust I/O routines
  **********************************/
@@ -920,6 +1004,15 @@ ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
     return rc;
 } 
 
+ssize_t Rio_readlineb_zc(rio_t *rp, char **linep)
+{
+    ssize_t rc;
+
+    if ((rc = rio_readlineb_zc(rp, linep)) < 0)
+	unix_error("Rio_readlineb_zc error");
+    return rc;
+}
+
 /******************************** 
  * Client/server helper functions
  ********************************/
@@ -940,7 +1033,8 @@ int open_clientfd(char *hostname, char *port) {
     hints.ai_socktype = SOCK_STREAM;  /* Open a connection */
     hints.ai_flags = AI_NUMERICSERV;  /* ... using a numeric port arg. */
     hints.ai_flags |= AI_ADDRCONFIG;  /* Recommended for connections */
-    Getaddrinfo(hostname, port, &hints, &listp);
+    if (getaddrinfo(hostname, port, &hints, &listp) != 0)
+        return -2;  /* Unknown host, the caller decides what to do */
   
     /* Walk the list for one that we can successfully connect to */
     for (p = listp; p; p = p->ai_next) {
@@ -0,0 +1,324 @@
+/*
+ * hedge.c
+ *
+ * Hedged requests to origin servers. A request is sent on one
+ * connection, and if no answer has come back after a delay, the same
+ * request is sent on a second one; whichever answers first is used, and
+ * the other is closed. Only GET requests reach the origin, so sending one
+ * twice is harmless.
+ *
+ * The delay is a percentile of the recent first-byte times of all
+ * origins, kept in a histogram of quarter powers of two that is halved
+ * every HEDGE_WINDOW samples, so that it follows the origins as they
+ * change. A request whose first attempt loses is sampled with the time it
+ * waited, so the tail that hedging hides still counts.
+ *
+ * A token bucket keeps the hedges to a percentage of the requests: every
+ * request adds budget hundredths of a token, a hedge takes a whole one,
+ * and at most HEDGE_BURST tokens are saved up.
+ */
+
+#include <poll.h>
+#include "csapp.h"
+#include "origin.h"
+#include "hedge.h"
+
+/* States of an attempt */
+#define ATTEMPT_CONNECTING  0   /* waiting for the connection */
+#define ATTEMPT_WAITING     1   /* request sent, waiting for the answer */
+#define ATTEMPT_ANSWERED    2   /* the answer has started to arrive */
+#define ATTEMPT_FAILED      3
+
+/*
+ * one of the two connections a request may be sent on
+ */
+typedef struct {
+    int fd;
+    int state;
+    int reused;     /* the connection came from the pool */
+} Attempt;
+
+static int hedge_percentile = 0;        /* 0 while hedging is off */
+static int hedge_budget = DEFAULT_HEDGE_BUDGET;
+static unsigned long histogram[HEDGE_BUCKETS];
+static unsigned long samples = 0;       /* in the histogram */
+static long tokens = 100 * HEDGE_BURST; /* in hundredths of a hedge */
+static HedgeStats stats = {0, 0, 0, 0, -1};
+static pthread_mutex_t hedge_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Helper function declaration */
+static void start_attempt(Attempt *attempt, char *host, char *port,
+                          char *req, int len, int pooled);
+static void advance_attempt(Attempt *attempt, char *req, int len);
+static void fail_attempt(Attempt *attempt);
+static long next_delay(void);
+static int take_token(void);
+static void add_sample(long usec, int hedge_won);
+static int bucket_of(long usec);
+static long bucket_limit(int bucket);
+static long now_usec(void);
+
+/*
+ * hedge_init - hedge the requests whose answer takes longer than the
+ * given percentile of first-byte times, but no more than budget percent
+ * of them. Called before any request.
+ */
+void hedge_init(int percentile, int budget)
+{
+    hedge_percentile = percentile;
+    hedge_budget = budget;
+}
+
+/*
+ * hedge_enabled - whether hedge_init turned hedging on
+ */
+int hedge_enabled(void)
+{
+    return hedge_percentile > 0;
+}
+
+/*
+ * hedge_request - send the len bytes of req to host:port, hedged, and
+ * return the connection that answered first, blocking, with the answer
+ * still to be read. A pooled connection the origin has closed is replaced
+ * by a new one. Return -1 if no connection answers, with errno set to
+ * ETIMEDOUT if none did within timeout seconds.
+ *
+ * The connections change while the request waits, so the deadline is
+ * kept here rather than by a timer.
+ */
+int hedge_request(char *host, char *port, char *req, int len, int timeout)
+{
+    Attempt attempts[2];
+    struct pollfd fds[2];
+    long start = now_usec(), delay = next_delay();
+    long end = start + timeout * 1000000L;
+    int count = 1, winner = -1;
+
+    start_attempt(&attempts[0], host, port, req, len, 1);
+    while (winner < 0) {
+        int polled = count, live = 0;
+        long wait = end - now_usec();
+
+        for (int i = 0; i < count; ++i) {
+            // poll skips the negative descriptors of failed attempts
+            fds[i].fd = attempts[i].fd;
+            fds[i].events = attempts[i].state == ATTEMPT_CONNECTING ?
+                            POLLOUT : POLLIN;
+            live += attempts[i].state != ATTEMPT_FAILED;
+        }
+        if (live == 0 || wait <= 0)
+            break;
+        if (count == 1 && delay >= 0 && start + delay - now_usec() < wait)
+            wait = start + delay - now_usec();
+        if (poll(fds, count, wait > 0 ? (wait + 999) / 1000 : 0) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        // no answer in time: send the request again, once
+        if (count == 1 && delay >= 0 && fds[0].revents == 0 &&
+            now_usec() - start >= delay) {
+            if (take_token())
+                start_attempt(&attempts[count++], host, port, req, len, 0);
+            delay = -1;
+        }
+
+        for (int i = 0; i < polled && winner < 0; ++i) {
+            if (fds[i].revents == 0 || attempts[i].state == ATTEMPT_FAILED)
+                continue;
+            advance_attempt(&attempts[i], req, len);
+            if (attempts[i].state == ATTEMPT_ANSWERED)
+                winner = i;
+            else if (attempts[i].state == ATTEMPT_FAILED &&
+                     attempts[i].reused)
+                start_attempt(&attempts[i], host, port, req, len, 0);
+        }
+    }
+
+    for (int i = 0; i < count; ++i)
+        if (i != winner && attempts[i].fd >= 0)
+            close(attempts[i].fd);
+    if (winner < 0) {
+        if (now_usec() >= end)
+            errno = ETIMEDOUT;
+        return -1;
+    }
+    add_sample(now_usec() - start, winner == 1);
+    return attempts[winner].fd;
+}
+
+/*
+ * get_hedge_stats - copy the counters of the hedged requests to out
+ */
+void get_hedge_stats(HedgeStats *out)
+{
+    pthread_mutex_lock(&hedge_mutex);
+    *out = stats;
+    pthread_mutex_unlock(&hedge_mutex);
+}
+
+/*
+ * start_attempt - send req on a connection from the pool if pooled is
+ * set and there is one, or else start a new connection, on which req is
+ * sent once it is made
+ */
+static void start_attempt(Attempt *attempt, char *host, char *port,
+                          char *req, int len, int pooled)
+{
+    attempt->reused = 0;
+    attempt->fd = pooled ? origin_take(host, port) : -1;
+    if (attempt->fd >= 0) {
+        if (rio_writen(attempt->fd, req, len) == len) {
+            attempt->reused = 1;
+            attempt->state = ATTEMPT_WAITING;
+            return;
+        }
+        close(attempt->fd);
+    }
+    attempt->fd = origin_open(host, port);
+    attempt->state = attempt->fd >= 0 ? ATTEMPT_CONNECTING : ATTEMPT_FAILED;
+}
+
+/*
+ * advance_attempt - an attempt whose descriptor is ready. A new
+ * connection is made blocking and req is sent on it; on a connection
+ * waiting for the answer, there is either the answer or the end of the
+ * connection.
+ */
+static void advance_attempt(Attempt *attempt, char *req, int len)
+{
+    char c;
+
+    if (attempt->state == ATTEMPT_CONNECTING) {
+        if (origin_connected(attempt->fd) < 0 ||
+            rio_writen(attempt->fd, req, len) != len)
+            fail_attempt(attempt);
+        else
+            attempt->state = ATTEMPT_WAITING;
+        return;
+    }
+    if (recv(attempt->fd, &c, 1, MSG_PEEK) > 0)
+        attempt->state = ATTEMPT_ANSWERED;
+    else
+        fail_attempt(attempt);
+}
+
+/*
+ * fail_attempt - close the connection of an attempt that failed
+ */
+static void fail_attempt(Attempt *attempt)
+{
+    close(attempt->fd);
+    attempt->fd = -1;
+    attempt->state = ATTEMPT_FAILED;
+}
+
+/*
+ * next_delay - count a new request and add its share to the budget.
+ * Return how long to wait for its answer before hedging: the percentile
+ * of the first-byte times, at least HEDGE_MIN_USEC, or -1 while there
+ * are too few samples.
+ */
+static long next_delay(void)
+{
+    unsigned long target, seen = 0;
+    long delay = -1;
+
+    pthread_mutex_lock(&hedge_mutex);
+    ++stats.requests;
+    tokens += hedge_budget;
+    if (tokens > 100 * HEDGE_BURST)
+        tokens = 100 * HEDGE_BURST;
+    if (samples >= HEDGE_MIN_SAMPLES) {
+        target = (samples * hedge_percentile + 99) / 100;
+        for (int i = 0; i < HEDGE_BUCKETS && delay < 0; ++i) {
+            seen += histogram[i];
+            if (seen >= target)
+                delay = bucket_limit(i);
+        }
+        if (delay < HEDGE_MIN_USEC)
+            delay = HEDGE_MIN_USEC;
+    }
+    stats.delay = delay;
+    pthread_mutex_unlock(&hedge_mutex);
+    return delay;
+}
+
+/*
+ * take_token - take a token for a hedge. Return 0 if the budget is
+ * spent.
+ */
+static int take_token(void)
+{
+    int ok;
+
+    pthread_mutex_lock(&hedge_mutex);
+    ok = tokens >= 100;
+    if (ok) {
+        tokens -= 100;
+        ++stats.hedges;
+    }
+    else {
+        ++stats.denied;
+    }
+    pthread_mutex_unlock(&hedge_mutex);
+    return ok;
+}
+
+/*
+ * add_sample - add a first-byte time to the histogram, halving it when
+ * it holds HEDGE_WINDOW samples
+ */
+static void add_sample(long usec, int hedge_won)
+{
+    pthread_mutex_lock(&hedge_mutex);
+    if (hedge_won)
+        ++stats.wins;
+    ++histogram[bucket_of(usec)];
+    if (++samples >= HEDGE_WINDOW) {
+        samples = 0;
+        for (int i = 0; i < HEDGE_BUCKETS; ++i) {
+            histogram[i] /= 2;
+            samples += histogram[i];
+        }
+    }
+    pthread_mutex_unlock(&hedge_mutex);
+}
+
+/*
+ * bucket_of - the histogram bucket of a time in usec. From 4 usec on,
+ * each power of two is split in four buckets.
+ */
+static int bucket_of(long usec)
+{
+    int msb, bucket;
+
+    if (usec < 4)
+        return usec < 0 ? 0 : usec;
+    msb = 63 - __builtin_clzl(usec);
+    bucket = msb * 4 + ((usec >> (msb - 2)) & 3);
+    return bucket < HEDGE_BUCKETS ? bucket : HEDGE_BUCKETS - 1;
+}
+
+/*
+ * bucket_limit - the time in usec just past the end of a bucket
+ */
+static long bucket_limit(int bucket)
+{
+    if (bucket < 4)
+        return bucket + 1;
+    return (5L + bucket % 4) << (bucket / 4 - 2);
+}
+
+/*
+ * now_usec - monotonic time in usec
+ */
+static long now_usec(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000L + t.tv_nsec / 1000;
+}
@@ -0,0 +1,36 @@
+/*
+ * hedge.h
+ *
+ * Header file for hedged origin requests
+ */
+
+#ifndef HEDGE_H
+#define HEDGE_H
+
+#define HEDGE_BUCKETS       128     /* quarter powers of two of usec */
+#define HEDGE_WINDOW        1024    /* samples kept before halving */
+#define HEDGE_MIN_SAMPLES   32      /* samples needed before hedging */
+#define HEDGE_MIN_USEC      1000    /* never hedge sooner than this */
+#define HEDGE_BURST         10      /* hedges the budget may save up */
+#define DEFAULT_HEDGE_BUDGET 5      /* percent of requests hedged at most */
+
+/*
+ * counters of the hedged requests, see get_hedge_stats
+ */
+typedef struct hedge_stats {
+    unsigned long requests;     /* requests sent through hedge_request */
+    unsigned long hedges;       /* second requests sent */
+    unsigned long wins;         /* second requests answered first */
+    unsigned long denied;       /* hedges the budget did not allow */
+    long delay;                 /* current hedge delay in usec, or -1 */
+} HedgeStats;
+
+void hedge_init(int percentile, int budget);
+
+int hedge_enabled(void);
+
+int hedge_request(char *host, char *port, char *req, int len, int timeout);
+
+void get_hedge_stats(HedgeStats *stats);
+
+#endif
@@ -0,0 +1,167 @@
+/*
+ * http.c
+ *
+ * Helpers to inspect raw HTTP messages, such as the server responses
+ * stored in the cache. None of them modifies the message it looks at.
+ */
+
+#include <limits.h>
+#include "csapp.h"
+#include "http.h"
+
+/*
+ * http_status - return the status code in the status line of response,
+ * or -1 if the status line is malformed
+ */
+int http_status(char *resp, int length)
+{
+    int i = 0;
+    int status = 0;
+
+    if (length < 12 || strncmp(resp, "HTTP/", 5) != 0)
+        return -1;
+
+    // skip the version token and the following space
+    while (i < length && resp[i] != ' ')
+        ++i;
+    ++i;
+    if (i + 3 > length)
+        return -1;
+
+    for (int j = i; j < i + 3; ++j) {
+        if (resp[j] < '0' || resp[j] > '9')
+            return -1;
+        status = status * 10 + (resp[j] - '0');
+    }
+    return status;
+}
+
+/*
+ * http_header_length - return the length of status line and headers,
+ * including the empty line ending them, which is also the offset of the
+ * body. Return -1 if the headers are not complete.
+ */
+int http_header_length(char *resp, int length)
+{
+    for (int i = 0; i + 3 < length; ++i) {
+        if (resp[i] == '\r' && resp[i + 1] == '\n' &&
+            resp[i + 2] == '\r' && resp[i + 3] == '\n')
+            return i + 4;
+    }
+    return -1;
+}
+
+/*
+ * http_header_value - if the header line of len bytes has the given key
+ * (compared case-insensitively), copy its value without surrounding
+ * spaces and the line ending to value and return 1. Otherwise return 0.
+ * The line does not need to be null-terminated.
+ */
+int http_header_value(char *line, int len, char *key, char *value,
+                      int maxlen)
+{
+    int keylen = strlen(key);
+    char *start, *end = line + len;
+
+    if (len <= keylen || line[keylen] != ':' ||
+        strncasecmp(line, key, keylen) != 0)
+        return 0;
+
+    start = line + keylen + 1;
+    while (start < end && (*start == ' ' || *start == '\t'))
+        ++start;
+    while (end > start && (end[-1] == '\r' || end[-1] == '\n' ||
+                           end[-1] == ' ' || end[-1] == '\t'))
+        --end;
+
+    if (end - start >= maxlen)
+        end = start + maxlen - 1;
+    memcpy(value, start, end - start);
+    value[end - start] = '\0';
+    return 1;
+}
+
+/*
+ * http_get_header - search the header block hdrs for the given key. If
+ * found, copy its value to value and return 1, otherwise return 0.
+ */
+int http_get_header(char *hdrs, int length, char *key, char *value,
+                    int maxlen)
+{
+    int pos = 0;
+
+    while (pos < length) {
+        char *nl = memchr(hdrs + pos, '\n', length - pos);
+        int n = nl ? nl - (hdrs + pos) : length - pos;
+
+        // an empty line ends the headers
+        if (n == 0 || (n == 1 && hdrs[pos] == '\r'))
+            break;
+
+        if (http_header_value(hdrs + pos, n, key, value, maxlen))
+            return 1;
+        pos += n + 1;
+    }
+    return 0;
+}
+
+/*
+ * http_has_token - whether the comma separated header value contains
+ * token, compared case-insensitively, e.g. "close" in "TE, close"
+ */
+int http_has_token(char *value, char *token)
+{
+    int len = strlen(token);
+    char *p = value;
+
+    while (*p != '\0') {
+        char *end;
+        int n;
+
+        while (*p == ' ' || *p == '\t' || *p == ',')
+            ++p;
+        end = p;
+        while (*end != '\0' && *end != ',' && *end != ';')
+            ++end;
+        // ignore the spaces before the comma and any parameters
+        n = end - p;
+        while (n > 0 && (p[n - 1] == ' ' || p[n - 1] == '\t'))
+            --n;
+        if (n == len && strncasecmp(p, token, len) == 0)
+            return 1;
+        while (*end != '\0' && *end != ',')
+            ++end;
+        p = end;
+    }
+    return 0;
+}
+
+/*
+ * http_chunk_size - return the size in the chunk size line of len bytes
+ * of a chunked body, ignoring any chunk extension, or -1 if the line is
+ * malformed
+ */
+long http_chunk_size(char *line, int len)
+{
+    long size = 0;
+    int i = 0;
+
+    for (; i < len; ++i) {
+        int digit;
+        if (line[i] >= '0' && line[i] <= '9')
+            digit = line[i] - '0';
+        else if (line[i] >= 'a' && line[i] <= 'f')
+            digit = line[i] - 'a' + 10;
+        else if (line[i] >= 'A' && line[i] <= 'F')
+            digit = line[i] - 'A' + 10;
+        else
+            break;
+        if (size > (LONG_MAX >> 4))
+            return -1;
+        size = size * 16 + digit;
+    }
+    if (i == 0 || (i < len && line[i] != ';' && line[i] != '\r' &&
+                   line[i] != '\n' && line[i] != ' ' && line[i] != '\t'))
+        return -1;
+    return size;
+}
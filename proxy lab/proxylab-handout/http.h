@@ -0,0 +1,24 @@
+/*
+ * http.h
+ *
+ * Header file for HTTP message parsing helpers
+ */
+
+#ifndef HTTP_H
+#define HTTP_H
+
+int http_status(char *resp, int length);
+
+int http_header_length(char *resp, int length);
+
+int http_header_value(char *line, int len, char *key, char *value,
+                      int maxlen);
+
+int http_get_header(char *hdrs, int length, char *key, char *value,
+                    int maxlen);
+
+int http_has_token(char *value, char *token);
+
+long http_chunk_size(char *line, int len);
+
+#endif
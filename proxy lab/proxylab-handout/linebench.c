@@ -0,0 +1,195 @@
+/*
+ * linebench.c
+ *
+ * Benchmark of the rio line readers on request headers, without the
+ * network. A file of header lines is written once, then read back to the
+ * end with each reader:
+ * 1) one byte per call, the way rio_readlineb used to read a line,
+ * 2) rio_readlineb, which copies each line found with memchr,
+ * 3) rio_readlineb_zc, which returns the line in the read buffer.
+ * The best of a few rounds is printed in nanoseconds per line.
+ */
+
+#include "csapp.h"
+
+#define ROUNDS 5
+
+static const char *usage = "Usage: %s [-n lines]\n";
+
+/* A typical set of request header lines, repeated to fill the file */
+static const char *sample_lines[] = {
+    "Host: www.example.com\r\n",
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) "
+    "Gecko/20120305 Firefox/10.0.3\r\n",
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+    "*/*;q=0.8\r\n",
+    "Accept-Language: en-US,en;q=0.5\r\n",
+    "Cookie: session=0123456789abcdef0123456789abcdef; theme=dark\r\n",
+    "Range: bytes=0-1023\r\n",
+};
+
+/* Benchmark parameters */
+static int line_count = 200000;
+
+/* Helper function declaration */
+int make_header_file();
+double read_lines(int fd, int mode, long *bytes);
+ssize_t read_line_bytewise(rio_t *rp, char *usrbuf, size_t maxlen);
+ssize_t read_byte(rio_t *rp, char *c);
+double now();
+
+int main(int argc, char **argv)
+{
+    static const char *names[] = {"byte at a time", "memchr copy",
+                                  "zero-copy"};
+    int opt, fd;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        switch (opt) {
+        case 'n':
+            line_count = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, usage, argv[0]);
+            exit(0);
+        }
+    }
+    if (line_count < 1) {
+        fprintf(stderr, usage, argv[0]);
+        exit(0);
+    }
+
+    fd = make_header_file();
+    printf("%d header lines\n", line_count);
+    for (int mode = 0; mode < 3; ++mode) {
+        double best = 0;
+        long bytes = 0;
+
+        for (int i = 0; i < ROUNDS; ++i) {
+            double seconds = read_lines(fd, mode, &bytes);
+            if (i == 0 || seconds < best)
+                best = seconds;
+        }
+        printf("%-16s %10ld bytes %8.1f ns/line\n", names[mode], bytes,
+               best * 1e9 / line_count);
+    }
+
+    Close(fd);
+    return 0;
+}
+
+/*
+ * make_header_file - write line_count header lines to an unlinked
+ * temporary file and return its descriptor
+ */
+int make_header_file()
+{
+    char path[] = "/tmp/linebenchXXXXXX";
+    int count = sizeof(sample_lines) / sizeof(sample_lines[0]);
+    int fd = mkstemp(path);
+
+    if (fd < 0)
+        unix_error("mkstemp error");
+    unlink(path);
+    for (int i = 0; i < line_count; ++i)
+        Rio_writen(fd, (void *)sample_lines[i % count],
+                   strlen(sample_lines[i % count]));
+    return fd;
+}
+
+/*
+ * read_lines - read the whole file with the given reader. Return the
+ * seconds it took, and store the bytes read in bytes.
+ */
+double read_lines(int fd, int mode, long *bytes)
+{
+    char buf[MAXLINE], *line;
+    rio_t rio;
+    ssize_t n;
+    long total = 0;
+    double start;
+
+    Lseek(fd, 0, SEEK_SET);
+    rio_readinitb(&rio, fd);
+    start = now();
+    if (mode == 0) {
+        while ((n = read_line_bytewise(&rio, buf, MAXLINE)) > 0)
+            total += n;
+    }
+    else if (mode == 1) {
+        while ((n = rio_readlineb(&rio, buf, MAXLINE)) > 0)
+            total += n;
+    }
+    else {
+        while ((n = rio_readlineb_zc(&rio, &line)) > 0)
+            total += n;
+    }
+    *bytes = total;
+    return now() - start;
+}
+
+/*
+ * read_line_bytewise - read a line with one buffered read per byte, as
+ * rio_readlineb did before it used memchr
+ */
+ssize_t read_line_bytewise(rio_t *rp, char *usrbuf, size_t maxlen)
+{
+    size_t n;
+    ssize_t rc;
+    char c, *bufp = usrbuf;
+
+    for (n = 1; n < maxlen; n++) {
+        if ((rc = read_byte(rp, &c)) == 1) {
+            *bufp++ = c;
+            if (c == '\n') {
+                n++;
+                break;
+            }
+        }
+        else if (rc == 0) {
+            if (n == 1)
+                return 0;
+            break;
+        }
+        else {
+            return -1;
+        }
+    }
+    *bufp = 0;
+    return n - 1;
+}
+
+/*
+ * read_byte - read one byte through the rio buffer, refilling it when
+ * empty, like the old rio_read called with n = 1
+ */
+ssize_t read_byte(rio_t *rp, char *c)
+{
+    while (rp->rio_cnt <= 0) {
+        rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, sizeof(rp->rio_buf));
+        if (rp->rio_cnt < 0) {
+            if (errno != EINTR)
+                return -1;
+        }
+        else if (rp->rio_cnt == 0) {
+            return 0;
+        }
+        else {
+            rp->rio_bufptr = rp->rio_buf;
+        }
+    }
+    *c = *rp->rio_bufptr++;
+    rp->rio_cnt--;
+    return 1;
+}
+
+/*
+ * now - monotonic time in seconds
+ */
+double now()
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
@@ -0,0 +1,172 @@
+/*
+ * lockprof.c
+ *
+ * The lock-contention profiler. Each acquisition of a profiled rwlock is
+ * timed with the cycle counter: the time from asking for the lock to
+ * getting it is the wait, and the time from getting it to releasing it
+ * the hold. Both are added to the site the lock was taken at, and to a
+ * histogram by power of two, so that a few long waits stand out from
+ * many short ones.
+ *
+ * A thread remembers when it took each lock it holds, in a small stack,
+ * as several readers may hold the same lock at the same site at once.
+ * The counters of a site are bumped with relaxed atomics, which the
+ * threads contend on like on the lock itself; this is the price of
+ * building the profiler in, and why it is left out by default.
+ */
+
+#include "csapp.h"
+#include "lockprof.h"
+
+/*
+ * the locks the calling thread holds, and when it took them
+ */
+static __thread struct {
+    LockSite *site;
+    unsigned long since;
+} held[LOCK_DEPTH];
+static __thread int held_count = 0;
+
+/* Helper function declaration */
+static unsigned long read_cycles(void);
+static void record(unsigned long *hist, unsigned long *total,
+                   unsigned long cycles);
+static void acquired(LockSite *site, unsigned long start);
+static int dump_histogram(char *buf, int size, char *name,
+                          unsigned long *hist);
+
+/*
+ * profiled_rdlock - take lock for reading at site
+ */
+void profiled_rdlock(pthread_rwlock_t *lock, LockSite *site)
+{
+    unsigned long start = read_cycles();
+
+    pthread_rwlock_rdlock(lock);
+    acquired(site, start);
+}
+
+/*
+ * profiled_wrlock - take lock for writing at site
+ */
+void profiled_wrlock(pthread_rwlock_t *lock, LockSite *site)
+{
+    unsigned long start = read_cycles();
+
+    pthread_rwlock_wrlock(lock);
+    acquired(site, start);
+}
+
+/*
+ * profiled_unlock - release lock, taken at site
+ */
+void profiled_unlock(pthread_rwlock_t *lock, LockSite *site)
+{
+    unsigned long now = read_cycles();
+    int i = held_count - 1;
+
+    pthread_rwlock_unlock(lock);
+    while (i >= 0 && held[i].site != site)
+        --i;
+    if (i < 0)
+        return;
+    record(site->hold_hist, &site->hold_cycles, now - held[i].since);
+    held[i] = held[--held_count];
+}
+
+/*
+ * dump_lock_sites - print the counters of the sites that took their
+ * lock to buf, which holds size bytes: a line per site with its averages
+ * in cycles, and then its histograms. Return the length printed.
+ */
+int dump_lock_sites(LockSite *sites, int count, char *buf, int size)
+{
+    int n = 0;
+
+    for (int i = 0; i < count && n < size; ++i) {
+        LockSite *site = &sites[i];
+        unsigned long acquisitions = __atomic_load_n(&site->count,
+                                                     __ATOMIC_RELAXED);
+        if (acquisitions == 0)
+            continue;
+        n += snprintf(buf + n, size - n, "lock %s site %s count %lu "
+                      "wait_avg %lu hold_avg %lu\n", site->lock, site->site,
+                      acquisitions,
+                      __atomic_load_n(&site->wait_cycles, __ATOMIC_RELAXED) /
+                      acquisitions,
+                      __atomic_load_n(&site->hold_cycles, __ATOMIC_RELAXED) /
+                      acquisitions);
+        if (n < size)
+            n += dump_histogram(buf + n, size - n, "wait", site->wait_hist);
+        if (n < size)
+            n += dump_histogram(buf + n, size - n, "hold", site->hold_hist);
+    }
+    return n < size ? n : size - 1;
+}
+
+/*
+ * read_cycles - the cycle counter, or the monotonic clock in nanoseconds
+ * where there is none
+ */
+static unsigned long read_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000UL + now.tv_nsec;
+#endif
+}
+
+/*
+ * record - add a time of cycles to a total and its histogram
+ */
+static void record(unsigned long *hist, unsigned long *total,
+                   unsigned long cycles)
+{
+    int bucket = cycles > 0 ? 63 - __builtin_clzl(cycles) : 0;
+
+    if (bucket >= LOCK_BUCKETS)
+        bucket = LOCK_BUCKETS - 1;
+    __atomic_add_fetch(&hist[bucket], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(total, cycles, __ATOMIC_RELAXED);
+}
+
+/*
+ * acquired - count an acquisition at site asked for at start, and
+ * remember when it was taken for its release. A thread holding more
+ * than LOCK_DEPTH locks does not time the hold of the others.
+ */
+static void acquired(LockSite *site, unsigned long start)
+{
+    unsigned long now = read_cycles();
+
+    __atomic_add_fetch(&site->count, 1, __ATOMIC_RELAXED);
+    record(site->wait_hist, &site->wait_cycles, now - start);
+    if (held_count < LOCK_DEPTH) {
+        held[held_count].site = site;
+        held[held_count].since = now;
+        ++held_count;
+    }
+}
+
+/*
+ * dump_histogram - print the nonzero buckets of a histogram on a line,
+ * each as the power of two it is below and its count
+ */
+static int dump_histogram(char *buf, int size, char *name,
+                          unsigned long *hist)
+{
+    int n = snprintf(buf, size, "  %s", name);
+
+    for (int i = 0; i < LOCK_BUCKETS && n < size; ++i) {
+        unsigned long count = __atomic_load_n(&hist[i], __ATOMIC_RELAXED);
+        if (count > 0)
+            n += snprintf(buf + n, size - n, " <2^%d:%lu", i + 1, count);
+    }
+    if (n < size)
+        n += snprintf(buf + n, size - n, "\n");
+    return n;
+}
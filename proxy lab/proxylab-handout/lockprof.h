@@ -0,0 +1,51 @@
+/*
+ * lockprof.h
+ *
+ * Header file for the lock-contention profiler. The profiler is only
+ * built with LOCK_PROFILE defined (make LOCK_PROFILE=1); otherwise the
+ * PROFILED_* macros are the plain rwlock calls, and their sites are not
+ * referenced at all.
+ */
+
+#ifndef LOCKPROF_H
+#define LOCKPROF_H
+
+#include <pthread.h>
+
+#define LOCK_BUCKETS    32      /* histogram buckets, by power of two */
+#define LOCK_DEPTH      4       /* profiled locks a thread holds at once */
+#define LOCK_DUMP_SIZE  (64 * 1024)
+
+/*
+ * a place a lock is taken at, with the times it waited for the lock and
+ * held it, in cycles. Bucket i counts the times below 2^(i+1) cycles.
+ */
+typedef struct lock_site {
+    const char *lock;           /* name of the lock */
+    const char *site;           /* name of the place */
+    unsigned long count;        /* acquisitions */
+    unsigned long wait_cycles;  /* total waited */
+    unsigned long hold_cycles;  /* total held */
+    unsigned long wait_hist[LOCK_BUCKETS];
+    unsigned long hold_hist[LOCK_BUCKETS];
+} LockSite;
+
+#ifdef LOCK_PROFILE
+#define PROFILED_RDLOCK(lock, site) profiled_rdlock(lock, site)
+#define PROFILED_WRLOCK(lock, site) profiled_wrlock(lock, site)
+#define PROFILED_UNLOCK(lock, site) profiled_unlock(lock, site)
+#else
+#define PROFILED_RDLOCK(lock, site) pthread_rwlock_rdlock(lock)
+#define PROFILED_WRLOCK(lock, site) pthread_rwlock_wrlock(lock)
+#define PROFILED_UNLOCK(lock, site) pthread_rwlock_unlock(lock)
+#endif
+
+void profiled_rdlock(pthread_rwlock_t *lock, LockSite *site);
+
+void profiled_wrlock(pthread_rwlock_t *lock, LockSite *site);
+
+void profiled_unlock(pthread_rwlock_t *lock, LockSite *site);
+
+int dump_lock_sites(LockSite *sites, int count, char *buf, int size);
+
+#endif
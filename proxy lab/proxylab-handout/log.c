@@ -0,0 +1,246 @@
+/*
+ * log.c
+ *
+ * Logging without blocking the threads that serve requests. A thread
+ * claims one of LOG_RINGS rings the first time it logs and owns it until
+ * log_thread_done, so each ring has a single producer and needs no lock.
+ * A record is copied into the ring and published by moving its tail. One
+ * writer thread drains every ring into a batch per destination, and
+ * writes each batch with one write(2). When a ring is full, a record is
+ * dropped or its thread waits, depending on the policy given to log_init.
+ *
+ * A record is stored as two bytes of length, one byte of destination and
+ * the data, and may wrap around the end of the ring.
+ */
+
+#include <stdarg.h>
+#include "csapp.h"
+#include "log.h"
+
+#define RECORD_HEADER 3
+
+static LogRing rings[LOG_RINGS];
+static __thread LogRing *my_ring = NULL;
+static int log_fds[2] = {-1, STDERR_FILENO};
+static int log_policy = LOG_DROP;
+static int writer_running = 0;
+static long dropped = 0;
+static volatile sig_atomic_t exit_requested = 0;
+
+/* Helper function declaration */
+static LogRing *claim_ring(void);
+static void ring_put(LogRing *ring, unsigned long pos, char *src, int n);
+static void ring_get(LogRing *ring, unsigned long pos, char *dst, int n);
+static int drain_ring(LogRing *ring, char batch[][LOG_BATCH], int *used);
+static void flush_batch(int dest, char *batch, int *used);
+static void *log_writer(void *arg);
+
+/*
+ * log_init - start the writer thread. Access records go to access_fd, or
+ * nowhere if it is negative.
+ */
+void log_init(int access_fd, int policy)
+{
+    pthread_t tid;
+
+    log_fds[LOG_ACCESS] = access_fd;
+    log_policy = policy;
+    Pthread_create(&tid, NULL, log_writer, NULL);
+    writer_running = 1;
+}
+
+/*
+ * log_write - log len bytes of data to dest. This only copies the data,
+ * unless the thread finds no free ring, in which case it is written
+ * directly.
+ */
+void log_write(int dest, char *data, int len)
+{
+    LogRing *ring;
+    unsigned long tail;
+    unsigned char header[RECORD_HEADER];
+    int need = len + RECORD_HEADER;
+
+    if (log_fds[dest] < 0 || len <= 0)
+        return;
+    if (len > LOG_MAX_RECORD) {
+        __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    if (!writer_running || (ring = claim_ring()) == NULL) {
+        rio_writen(log_fds[dest], data, len);
+        return;
+    }
+
+    tail = ring->tail;
+    while (LOG_RING_SIZE - (tail - __atomic_load_n(&ring->head,
+                                                   __ATOMIC_ACQUIRE)) < need) {
+        if (log_policy == LOG_DROP) {
+            __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        usleep(LOG_IDLE_USEC / 10);
+    }
+    header[0] = len >> 8;
+    header[1] = len & 0xff;
+    header[2] = dest;
+    ring_put(ring, tail, (char *)header, RECORD_HEADER);
+    ring_put(ring, tail + RECORD_HEADER, data, len);
+    __atomic_store_n(&ring->tail, tail + need, __ATOMIC_RELEASE);
+}
+
+/*
+ * log_printf - log a formatted message to dest
+ */
+void log_printf(int dest, const char *fmt, ...)
+{
+    char buf[LOG_MAX_RECORD];
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if (n >= (int)sizeof(buf))
+        n = sizeof(buf) - 1;
+    log_write(dest, buf, n);
+}
+
+/*
+ * log_thread_done - give the ring of the calling thread back, when the
+ * thread is about to exit. Records still in it are written all the same.
+ */
+void log_thread_done(void)
+{
+    if (my_ring != NULL) {
+        __atomic_store_n(&my_ring->owned, 0, __ATOMIC_RELEASE);
+        my_ring = NULL;
+    }
+}
+
+/*
+ * log_dropped - number of records dropped so far
+ */
+long log_dropped(void)
+{
+    return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
+
+/*
+ * log_exit - exit the program once the records logged so far are
+ * written. Async-signal-safe: the writer thread does the exit.
+ */
+void log_exit(void)
+{
+    if (!writer_running)
+        _exit(0);
+    exit_requested = 1;
+}
+
+/*
+ * claim_ring - the ring of the calling thread, claimed on first use.
+ * The search starts at a slot given by the thread, so that threads
+ * seldom try the same rings. Return NULL if all rings are owned.
+ */
+static LogRing *claim_ring(void)
+{
+    unsigned long start = (unsigned long)pthread_self() / 64;
+
+    if (my_ring != NULL)
+        return my_ring;
+    for (int i = 0; i < LOG_RINGS; ++i) {
+        LogRing *ring = &rings[(start + i) % LOG_RINGS];
+        int expected = 0;
+        if (__atomic_compare_exchange_n(&ring->owned, &expected, 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return my_ring = ring;
+    }
+    return NULL;
+}
+
+/*
+ * ring_put - copy n bytes from src to the ring at byte pos
+ */
+static void ring_put(LogRing *ring, unsigned long pos, char *src, int n)
+{
+    int offset = pos & (LOG_RING_SIZE - 1);
+    int first = n < LOG_RING_SIZE - offset ? n : LOG_RING_SIZE - offset;
+
+    memcpy(ring->buf + offset, src, first);
+    memcpy(ring->buf, src + first, n - first);
+}
+
+/*
+ * ring_get - copy n bytes at byte pos of the ring to dst
+ */
+static void ring_get(LogRing *ring, unsigned long pos, char *dst, int n)
+{
+    int offset = pos & (LOG_RING_SIZE - 1);
+    int first = n < LOG_RING_SIZE - offset ? n : LOG_RING_SIZE - offset;
+
+    memcpy(dst, ring->buf + offset, first);
+    memcpy(dst + first, ring->buf, n - first);
+}
+
+/*
+ * drain_ring - move the records of a ring to the batches, writing a batch
+ * out when the next record does not fit. Return whether there were any.
+ */
+static int drain_ring(LogRing *ring, char batch[][LOG_BATCH], int *used)
+{
+    unsigned long head = ring->head;
+    unsigned long tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    unsigned char header[RECORD_HEADER];
+
+    if (head == tail)
+        return 0;
+    while (head != tail) {
+        int len, dest;
+        ring_get(ring, head, (char *)header, RECORD_HEADER);
+        len = header[0] << 8 | header[1];
+        dest = header[2];
+        if (used[dest] + len > LOG_BATCH)
+            flush_batch(dest, batch[dest], &used[dest]);
+        ring_get(ring, head + RECORD_HEADER, batch[dest] + used[dest], len);
+        used[dest] += len;
+        head += RECORD_HEADER + len;
+    }
+    __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/*
+ * flush_batch - write a batch out and empty it. A failed write loses the
+ * batch, as there is nowhere to report it.
+ */
+static void flush_batch(int dest, char *batch, int *used)
+{
+    if (*used > 0)
+        rio_writen(log_fds[dest], batch, *used);
+    *used = 0;
+}
+
+/*
+ * log_writer - the writer thread. It sleeps LOG_IDLE_USEC when all rings
+ * are empty, and exits the program after a last pass once log_exit was
+ * called.
+ */
+static void *log_writer(void *arg)
+{
+    static char batch[2][LOG_BATCH];
+    int used[2] = {0, 0};
+
+    pthread_detach(pthread_self());
+    while (1) {
+        int exiting = exit_requested, busy = 0;
+        for (int i = 0; i < LOG_RINGS; ++i)
+            busy |= drain_ring(&rings[i], batch, used);
+        flush_batch(LOG_ACCESS, batch[LOG_ACCESS], &used[LOG_ACCESS]);
+        flush_batch(LOG_ERROR, batch[LOG_ERROR], &used[LOG_ERROR]);
+        if (exiting)
+            _exit(0);
+        if (!busy)
+            usleep(LOG_IDLE_USEC);
+    }
+    return NULL;
+}
@@ -0,0 +1,48 @@
+/*
+ * log.h
+ *
+ * Header file for the asynchronous logger
+ */
+
+#ifndef LOG_H
+#define LOG_H
+
+#define LOG_RINGS       128             /* threads logging at once */
+#define LOG_RING_SIZE   (64 * 1024)     /* bytes per ring, a power of two */
+#define LOG_MAX_RECORD  8192            /* longer records are dropped */
+#define LOG_BATCH       (64 * 1024)     /* bytes written per write(2) */
+#define LOG_IDLE_USEC   1000            /* writer sleep when rings are empty */
+
+/* Policy when a ring is full */
+#define LOG_DROP   0        /* drop the record and count it */
+#define LOG_BLOCK  1        /* wait for the writer thread */
+
+/* Destinations of a record */
+#define LOG_ACCESS 0        /* the access log, if one is open */
+#define LOG_ERROR  1        /* standard error */
+
+/*
+ * a ring of records written by one thread at a time, its owner, and read
+ * by the writer thread. head and tail count bytes since the start, and
+ * sit on their own cache lines.
+ */
+typedef struct {
+    int owned __attribute__((aligned(64)));
+    unsigned long head __attribute__((aligned(64)));
+    unsigned long tail __attribute__((aligned(64)));
+    char buf[LOG_RING_SIZE] __attribute__((aligned(64)));
+} LogRing;
+
+void log_init(int access_fd, int policy);
+
+void log_write(int dest, char *data, int len);
+
+void log_printf(int dest, const char *fmt, ...);
+
+void log_thread_done(void);
+
+long log_dropped(void);
+
+void log_exit(void);
+
+#endif
@@ -0,0 +1,144 @@
+/*
+ * logbench.c
+ *
+ * Benchmark of the asynchronous logger. Each thread formats and logs
+ * access lines the way log_access in proxy.c does, to a file or to
+ * /dev/null. The CPU time a line takes in the logging threads is printed,
+ * which is what a request pays, along with the wall time of the run and
+ * the lines dropped. With -s, the lines are written with
+ * fprintf to a shared FILE instead, as the proxy used to log errors.
+ */
+
+#include "csapp.h"
+#include "log.h"
+
+static const char *usage =
+"Usage: %s [-t threads] [-n lines per thread] [-b | -s] [-f file]\n";
+
+/* Benchmark parameters */
+static int thread_count = 4;
+static int line_count = 200000;
+static FILE *stdio_log = NULL;
+static double thread_seconds[64];   /* CPU time of each logging thread */
+
+/* Helper function declaration */
+void *log_job(void *arg);
+double now();
+double thread_cpu_seconds();
+
+int main(int argc, char **argv)
+{
+    pthread_t tids[64];
+    char *path = "/dev/null";
+    int opt, fd, policy = LOG_DROP, use_stdio = 0;
+    double start, seconds, cpu = 0;
+
+    while ((opt = getopt(argc, argv, "t:n:bsf:")) != -1) {
+        switch (opt) {
+        case 't':
+            thread_count = atoi(optarg);
+            break;
+        case 'n':
+            line_count = atoi(optarg);
+            break;
+        case 'b':
+            policy = LOG_BLOCK;
+            break;
+        case 's':
+            use_stdio = 1;
+            break;
+        case 'f':
+            path = optarg;
+            break;
+        default:
+            fprintf(stderr, usage, argv[0]);
+            exit(0);
+        }
+    }
+    if (thread_count < 1 || thread_count > 64 || line_count < 1) {
+        fprintf(stderr, usage, argv[0]);
+        exit(0);
+    }
+
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+        unix_error("open error");
+    if (use_stdio)
+        stdio_log = Fdopen(fd, "w");
+    else
+        log_init(fd, policy);
+
+    start = now();
+    for (int i = 0; i < thread_count; ++i)
+        Pthread_create(&tids[i], NULL, log_job, &thread_seconds[i]);
+    for (int i = 0; i < thread_count; ++i) {
+        Pthread_join(tids[i], NULL);
+        cpu += thread_seconds[i];
+    }
+    seconds = now() - start;
+
+    printf("%d threads, %d lines each, %s\n", thread_count, line_count,
+           use_stdio ? "fprintf" : policy == LOG_DROP ? "drop" : "block");
+    printf("%.1f ns CPU per line, %.2f s in all, %ld dropped\n",
+           cpu * 1e9 / ((double)thread_count * line_count), seconds,
+           log_dropped());
+    fflush(stdout);
+    if (use_stdio) {
+        Fclose(stdio_log);
+        return 0;
+    }
+    // the writer thread exits once the lines still in the rings are out
+    log_exit();
+    while (1)
+        pause();
+}
+
+/*
+ * log_job - log line_count access lines, and store the CPU time it took
+ * in the double arg points to
+ */
+void *log_job(void *arg)
+{
+    char line[MAXLINE];
+    struct timeval start, end;
+    double cpu_start = thread_cpu_seconds();
+
+    for (int i = 0; i < line_count; ++i) {
+        int n;
+        gettimeofday(&start, NULL);
+        gettimeofday(&end, NULL);
+        n = snprintf(line, sizeof(line), "%ld.%06ld %d %d %s %ld %s\n",
+                     (long)start.tv_sec, (long)start.tv_usec, 200,
+                     10000 + i % 5000, i % 3 ? "hit" : "miss",
+                     (long)(end.tv_usec - start.tv_usec),
+                     "http://www.example.com/images/logo.png?v=12");
+        if (stdio_log != NULL)
+            fprintf(stdio_log, "%s", line);
+        else
+            log_write(LOG_ACCESS, line, n);
+    }
+    log_thread_done();
+    *(double *)arg = thread_cpu_seconds() - cpu_start;
+    return NULL;
+}
+
+/*
+ * now - monotonic time in seconds
+ */
+double now()
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/*
+ * thread_cpu_seconds - CPU time used by the calling thread so far
+ */
+double thread_cpu_seconds()
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
@@ -0,0 +1,195 @@
+/*
+ * origin.c
+ *
+ * Connections to origin servers. Once a response has been read to the
+ * end of its body, the connection is given back to a small pool instead
+ * of being closed, and the next request to the same host and port takes
+ * it from there. Idle connections are dropped after ORIGIN_IDLE_TIMEOUT
+ * seconds, or when the origin has closed them.
+ */
+
+#include <poll.h>
+#include "csapp.h"
+#include "origin.h"
+#include "timer.h"
+
+OriginConn idle_origins[MAX_IDLE_ORIGINS];
+int idle_count = 0;     /* entries in use, at the start of idle_origins */
+pthread_mutex_t origin_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Helper function declaration */
+static int origin_name(char *host, char *port, char *name);
+static int origin_alive(int fd);
+static void drop_idle(int i);
+
+/*
+ * origin_connect - return a connection to host:port, from the pool if
+ * there is one, or a new one otherwise. *reused tells which, since a
+ * pooled connection may still turn out to be closed by the origin when
+ * used. A new connection is given up when the connect deadline of the
+ * thread expires. Return -1 if no connection can be made.
+ */
+int origin_connect(char *host, char *port, int *reused)
+{
+	struct pollfd pfd;
+	int fd = origin_take(host, port);
+
+	*reused = fd >= 0;
+	if (fd >= 0 || (fd = origin_open(host, port)) < 0)
+		return fd;
+
+	// the reaper shuts the socket down when the deadline passes, which
+	// ends the poll
+	timer_arm(TIMEOUT_CONNECT, fd, -1);
+	pfd.fd = fd;
+	pfd.events = POLLOUT;
+	while (poll(&pfd, 1, -1) < 0 && errno == EINTR)
+		;
+	timer_cancel();
+	if (timer_expired() == TIMEOUT_CONNECT || origin_connected(fd) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * origin_open - start a new connection to host:port without waiting for
+ * it. The socket is non-blocking and becomes writable once connected.
+ * Return -1 if no connection can be started.
+ */
+int origin_open(char *host, char *port)
+{
+	struct addrinfo hints, *list, *p;
+	int fd = -1;
+
+	memset(&hints, 0, sizeof(struct addrinfo));
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+	if (getaddrinfo(host, port, &hints, &list) != 0)
+		return -1;
+
+	for (p = list; p != NULL; p = p->ai_next) {
+		if ((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
+			continue;
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		if (connect(fd, p->ai_addr, p->ai_addrlen) == 0 ||
+		    errno == EINPROGRESS)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(list);
+	return fd;
+}
+
+/*
+ * origin_connected - a connection from origin_open became writable. Make
+ * it blocking and return 0 if it is connected, or return -1 if it failed.
+ */
+int origin_connected(int fd)
+{
+	int error = 0;
+	socklen_t error_len = sizeof(error);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_len) < 0 ||
+	    error != 0)
+		return -1;
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+	return 0;
+}
+
+/*
+ * origin_take - take a live idle connection to host:port from the pool.
+ * Return -1 if there is none.
+ */
+int origin_take(char *host, char *port)
+{
+	char name[MAX_ORIGIN_NAME];
+	time_t now = time(NULL);
+	int fd = -1;
+
+	if (origin_name(host, port, name)) {
+		pthread_mutex_lock(&origin_mutex);
+		// the newest connections are at the end, take them first
+		for (int i = idle_count - 1; i >= 0 && fd < 0; --i) {
+			OriginConn *conn = &idle_origins[i];
+			if (now - conn->since > ORIGIN_IDLE_TIMEOUT) {
+				drop_idle(i);
+			}
+			else if (strcmp(conn->name, name) == 0) {
+				fd = conn->fd;
+				conn->fd = -1;
+				drop_idle(i);
+			}
+		}
+		pthread_mutex_unlock(&origin_mutex);
+	}
+
+	if (fd >= 0 && !origin_alive(fd)) {
+		close(fd);
+		fd = -1;
+	}
+	return fd;
+}
+
+/*
+ * origin_release - done with a connection from origin_connect. It is
+ * kept for the next request if reusable, that is if the whole response
+ * was read and the origin did not ask to close it.
+ */
+void origin_release(int fd, char *host, char *port, int reusable)
+{
+	char name[MAX_ORIGIN_NAME];
+
+	if (reusable && origin_name(host, port, name)) {
+		pthread_mutex_lock(&origin_mutex);
+		if (idle_count < MAX_IDLE_ORIGINS) {
+			OriginConn *conn = &idle_origins[idle_count++];
+			conn->fd = fd;
+			conn->since = time(NULL);
+			strcpy(conn->name, name);
+			fd = -1;
+		}
+		pthread_mutex_unlock(&origin_mutex);
+	}
+	if (fd >= 0)
+		close(fd);
+}
+
+/*
+ * origin_name - write "host:port" to name. Return 0 if it is too long
+ * to be pooled.
+ */
+static int origin_name(char *host, char *port, char *name)
+{
+	int n = snprintf(name, MAX_ORIGIN_NAME, "%s:%s", host, port);
+
+	return n > 0 && n < MAX_ORIGIN_NAME;
+}
+
+/*
+ * origin_alive - whether an idle connection is still open. An idle
+ * connection has nothing to read, so a readable one was closed by the
+ * origin, or is out of step with it.
+ */
+static int origin_alive(int fd)
+{
+	char c;
+
+	return recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 &&
+	       (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/*
+ * drop_idle - remove entry i of the pool, closing its connection if it
+ * still has one. Called with origin_mutex held.
+ */
+static void drop_idle(int i)
+{
+	if (idle_origins[i].fd >= 0)
+		close(idle_origins[i].fd);
+	--idle_count;
+	memmove(&idle_origins[i], &idle_origins[i + 1],
+	        (idle_count - i) * sizeof(OriginConn));
+}
@@ -0,0 +1,35 @@
+/*
+ * origin.h
+ *
+ * Header file for the pool of kept-alive origin connections
+ */
+
+#ifndef ORIGIN_H
+#define ORIGIN_H
+
+#include <time.h>
+
+#define MAX_IDLE_ORIGINS    32      /* idle connections kept in the pool */
+#define ORIGIN_IDLE_TIMEOUT 30      /* seconds an idle connection is kept */
+#define MAX_ORIGIN_NAME     256     /* longer "host:port" are not pooled */
+
+/*
+ * an idle connection to an origin server
+ */
+typedef struct {
+	int fd;                         /* -1 if the entry is free */
+	time_t since;                   /* when it became idle */
+	char name[MAX_ORIGIN_NAME];     /* "host:port" it is connected to */
+} OriginConn;
+
+int origin_connect(char *host, char *port, int *reused);
+
+int origin_open(char *host, char *port);
+
+int origin_connected(int fd);
+
+int origin_take(char *host, char *port);
+
+void origin_release(int fd, char *host, char *port, int reusable);
+
+#endif
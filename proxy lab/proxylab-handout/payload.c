@@ -0,0 +1,336 @@
+/*
+ * payload.c
+ *
+ * The arena the cache keeps the heads and bodies of its objects in. Each
+ * object from the heap has its own small allocation, so the objects a
+ * series of hits reads are spread over as many 4 KB pages, and each
+ * page costs a TLB entry. The arena is one mapping, backed by huge pages
+ * when the system has them, so that a few TLB entries cover the whole
+ * cache.
+ *
+ * The mapping is tried with reserved huge pages (MAP_HUGETLB) first, and
+ * then with normal pages, aligned to a huge page and marked with
+ * MADV_HUGEPAGE so that the kernel may back it with transparent huge
+ * pages. If both fail, or once the arena is full, allocations come from
+ * the heap, and payload_free tells them apart by their address.
+ *
+ * The arena is a PayloadHeap, which any region can hold: the shared
+ * cache of the worker processes keeps one in its shared memory. Blocks
+ * are carved from it with boundary tags: a header and a footer word
+ * holding the size of the block and whether it is allocated. Free blocks
+ * are kept in segregated lists, one per power of two of their size, are
+ * split when larger than needed, and are coalesced with their free
+ * neighbors when freed. The lists are linked by offsets from the heap,
+ * so that processes that map it at different addresses can share it.
+ * The heap takes no lock of its own; the arena is guarded by a mutex,
+ * since objects are added under the cache lock but freed by the last
+ * reader to release them.
+ */
+
+#include "csapp.h"
+#include "payload.h"
+
+#define WORD_SIZE   8
+#define MIN_BLOCK   (4 * WORD_SIZE)     /* header, two links, footer */
+#define ALLOCATED   1UL
+
+/* Boundary tags */
+#define BLOCK_SIZE(b)   (*(size_t *)(b) & ~ALLOCATED)
+#define IS_ALLOCATED(b) (*(size_t *)(b) & ALLOCATED)
+#define NEXT_BLOCK(b)   ((b) + BLOCK_SIZE(b))
+#define PREV_BLOCK(b)   ((b) - (*(size_t *)((b) - WORD_SIZE) & ~ALLOCATED))
+#define PAYLOAD(b)      ((b) + WORD_SIZE)
+#define BLOCK(p)        ((char *)(p) - WORD_SIZE)
+
+/* Links of a free block, in its payload, as offsets from the heap */
+#define NEXT_FREE(b)    (*(size_t *)PAYLOAD(b))
+#define PREV_FREE(b)    (*(size_t *)(PAYLOAD(b) + WORD_SIZE))
+
+/* Conversions between blocks and offsets */
+#define AT(h, off)      ((char *)(h) + (off))
+#define OFFSET(h, b)    ((size_t)((b) - (char *)(h)))
+
+static PayloadHeap *arena = NULL;
+static pthread_mutex_t payload_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Helper function declaration */
+static char *map_region(size_t size, int *backing);
+static char *find_block(PayloadHeap *heap, size_t size);
+static void place_block(PayloadHeap *heap, char *block, size_t size);
+static char *coalesce(PayloadHeap *heap, char *block);
+static void set_block(char *block, size_t size, size_t allocated);
+static void insert_free(PayloadHeap *heap, char *block);
+static void remove_free(PayloadHeap *heap, char *block);
+static int class_of(size_t size);
+
+/*
+ * payload_init - map an arena of at least size bytes, rounded up to a
+ * huge page. Return the PAYLOAD_* pages behind it, PAYLOAD_NONE if it
+ * could not be mapped or is mapped already.
+ */
+int payload_init(size_t size)
+{
+    int backing;
+    char *region;
+
+    if (arena != NULL)
+        return PAYLOAD_NONE;
+    size = (size + HUGE_PAGE_SIZE - 1) & ~((size_t)HUGE_PAGE_SIZE - 1);
+    if ((region = map_region(size, &backing)) == NULL)
+        return PAYLOAD_NONE;
+
+    payload_heap_init((PayloadHeap *)region, size);
+    ((PayloadHeap *)region)->stats.backing = backing;
+    arena = (PayloadHeap *)region;
+    return backing;
+}
+
+/*
+ * payload_alloc - size bytes from the arena, aligned to PAYLOAD_ALIGN,
+ * or from the heap if there is no arena or no room in it
+ */
+void *payload_alloc(size_t size)
+{
+    size_t offset;
+
+    if (arena != NULL) {
+        pthread_mutex_lock(&payload_mutex);
+        offset = payload_heap_alloc(arena, size);
+        if (offset == 0)
+            ++arena->stats.fallbacks;
+        pthread_mutex_unlock(&payload_mutex);
+        if (offset != 0)
+            return AT(arena, offset);
+    }
+    return Malloc(size > 0 ? size : 1);
+}
+
+/*
+ * payload_free - free what payload_alloc returned
+ */
+void payload_free(void *ptr)
+{
+    if (ptr == NULL)
+        return;
+    if (arena == NULL || (char *)ptr < (char *)arena ||
+        (char *)ptr >= AT(arena, arena->size)) {
+        Free(ptr);
+        return;
+    }
+
+    pthread_mutex_lock(&payload_mutex);
+    payload_heap_free(arena, OFFSET(arena, (char *)ptr));
+    pthread_mutex_unlock(&payload_mutex);
+}
+
+/*
+ * get_payload_stats - copy the counters of the arena to out
+ */
+void get_payload_stats(PayloadStats *out)
+{
+    memset(out, 0, sizeof(*out));
+    if (arena == NULL)
+        return;
+    pthread_mutex_lock(&payload_mutex);
+    *out = arena->stats;
+    pthread_mutex_unlock(&payload_mutex);
+}
+
+/*
+ * payload_heap_init - make the size bytes at heap a heap with all of its
+ * blocks free. size is a multiple of PAYLOAD_ALIGN.
+ */
+void payload_heap_init(PayloadHeap *heap, size_t size)
+{
+    size_t start = (sizeof(PayloadHeap) + PAYLOAD_ALIGN - 1) &
+                   ~((size_t)PAYLOAD_ALIGN - 1);
+
+    memset(heap, 0, sizeof(*heap));
+    heap->size = size;
+    heap->stats.size = size;
+
+    // a footer before the first block and a header after the last one,
+    // both allocated, so that coalescing stops at the ends. The first
+    // header is a word before an aligned payload.
+    *(size_t *)AT(heap, start) = ALLOCATED;
+    *(size_t *)AT(heap, size - WORD_SIZE) = ALLOCATED;
+    set_block(AT(heap, start + WORD_SIZE), size - start - 2 * WORD_SIZE, 0);
+    insert_free(heap, AT(heap, start + WORD_SIZE));
+}
+
+/*
+ * payload_heap_alloc - allocate size bytes of heap, aligned to
+ * PAYLOAD_ALIGN. Return their offset from heap, or 0 if there is no
+ * room.
+ */
+size_t payload_heap_alloc(PayloadHeap *heap, size_t size)
+{
+    size_t need = (size + 2 * WORD_SIZE + PAYLOAD_ALIGN - 1) &
+                  ~((size_t)PAYLOAD_ALIGN - 1);
+    char *block;
+
+    if (need < MIN_BLOCK)
+        need = MIN_BLOCK;
+    if ((block = find_block(heap, need)) == NULL)
+        return 0;
+    place_block(heap, block, need);
+    ++heap->stats.allocs;
+    heap->stats.used += BLOCK_SIZE(block);
+    return OFFSET(heap, PAYLOAD(block));
+}
+
+/*
+ * payload_heap_free - free the bytes at offset of heap, which
+ * payload_heap_alloc returned
+ */
+void payload_heap_free(PayloadHeap *heap, size_t offset)
+{
+    char *block = BLOCK(AT(heap, offset));
+
+    heap->stats.used -= BLOCK_SIZE(block);
+    set_block(block, BLOCK_SIZE(block), 0);
+    insert_free(heap, coalesce(heap, block));
+}
+
+/*
+ * map_region - map size bytes, a multiple of HUGE_PAGE_SIZE, with huge
+ * pages if possible, and store the PAYLOAD_* pages behind them in
+ * backing. Return NULL if nothing could be mapped.
+ */
+static char *map_region(size_t size, int *backing)
+{
+    char *p, *aligned;
+
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED) {
+        *backing = PAYLOAD_HUGETLB;
+        return p;
+    }
+
+    // transparent huge pages only back ranges aligned to a huge page, so
+    // map one more and trim the ends
+    p = mmap(NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+    aligned = (char *)(((unsigned long)p + HUGE_PAGE_SIZE - 1) &
+                       ~((unsigned long)HUGE_PAGE_SIZE - 1));
+    if (aligned > p)
+        munmap(p, aligned - p);
+    munmap(aligned + size, p + HUGE_PAGE_SIZE - aligned);
+    *backing = madvise(aligned, size, MADV_HUGEPAGE) == 0 ? PAYLOAD_THP :
+               PAYLOAD_PAGES;
+    return aligned;
+}
+
+/*
+ * find_block - a free block of at least size bytes: the first that fits
+ * in the list of its class, or else the first of a larger class, where
+ * any block fits. NULL if there is none.
+ */
+static char *find_block(PayloadHeap *heap, size_t size)
+{
+    int class = class_of(size);
+    size_t off;
+
+    for (off = heap->free_lists[class]; off != 0;
+         off = NEXT_FREE(AT(heap, off)))
+        if (BLOCK_SIZE(AT(heap, off)) >= size)
+            return AT(heap, off);
+    while (++class < PAYLOAD_CLASSES)
+        if (heap->free_lists[class] != 0)
+            return AT(heap, heap->free_lists[class]);
+    return NULL;
+}
+
+/*
+ * place_block - allocate size bytes of a free block, and give the rest
+ * back to the free lists if it can make a block of its own
+ */
+static void place_block(PayloadHeap *heap, char *block, size_t size)
+{
+    size_t total = BLOCK_SIZE(block);
+
+    remove_free(heap, block);
+    if (total - size >= MIN_BLOCK) {
+        set_block(block, size, ALLOCATED);
+        set_block(NEXT_BLOCK(block), total - size, 0);
+        insert_free(heap, NEXT_BLOCK(block));
+    }
+    else {
+        set_block(block, total, ALLOCATED);
+    }
+}
+
+/*
+ * coalesce - merge a block just freed with its free neighbors, which
+ * leave the free lists. Return the merged block.
+ */
+static char *coalesce(PayloadHeap *heap, char *block)
+{
+    size_t size = BLOCK_SIZE(block);
+    char *next = NEXT_BLOCK(block);
+
+    if (!IS_ALLOCATED(next)) {
+        remove_free(heap, next);
+        size += BLOCK_SIZE(next);
+    }
+    if (!IS_ALLOCATED(block - WORD_SIZE)) {
+        block = PREV_BLOCK(block);
+        remove_free(heap, block);
+        size += BLOCK_SIZE(block);
+    }
+    set_block(block, size, 0);
+    return block;
+}
+
+/*
+ * set_block - write the header and footer of a block
+ */
+static void set_block(char *block, size_t size, size_t allocated)
+{
+    *(size_t *)block = size | allocated;
+    *(size_t *)(block + size - WORD_SIZE) = size | allocated;
+}
+
+/*
+ * insert_free - add a free block at the head of the list of its class
+ */
+static void insert_free(PayloadHeap *heap, char *block)
+{
+    int class = class_of(BLOCK_SIZE(block));
+    size_t first = heap->free_lists[class];
+
+    NEXT_FREE(block) = first;
+    PREV_FREE(block) = 0;
+    if (first != 0)
+        PREV_FREE(AT(heap, first)) = OFFSET(heap, block);
+    heap->free_lists[class] = OFFSET(heap, block);
+}
+
+/*
+ * remove_free - take a free block out of the list of its class
+ */
+static void remove_free(PayloadHeap *heap, char *block)
+{
+    size_t next = NEXT_FREE(block), prev = PREV_FREE(block);
+
+    if (prev != 0)
+        NEXT_FREE(AT(heap, prev)) = next;
+    else
+        heap->free_lists[class_of(BLOCK_SIZE(block))] = next;
+    if (next != 0)
+        PREV_FREE(AT(heap, next)) = prev;
+}
+
+/*
+ * class_of - the free list of blocks of size bytes: the power of two
+ * below it, counted from MIN_BLOCK
+ */
+static int class_of(size_t size)
+{
+    int class = 63 - __builtin_clzl(size) - 5;
+
+    return class < PAYLOAD_CLASSES ? class : PAYLOAD_CLASSES - 1;
+}
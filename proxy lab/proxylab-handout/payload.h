@@ -0,0 +1,57 @@
+/*
+ * payload.h
+ *
+ * Header file for the arena the cache keeps its objects in
+ */
+
+#ifndef PAYLOAD_H
+#define PAYLOAD_H
+
+#include <stddef.h>
+
+#define HUGE_PAGE_SIZE   (2 << 20)
+#define PAYLOAD_ALIGN    16
+#define PAYLOAD_CLASSES  32     /* free lists, by power of two */
+
+/* Pages behind the arena, see payload_init */
+#define PAYLOAD_NONE     0      /* no arena, the heap is used */
+#define PAYLOAD_PAGES    1      /* normal pages */
+#define PAYLOAD_THP      2      /* transparent huge pages were asked for */
+#define PAYLOAD_HUGETLB  3      /* reserved huge pages */
+
+/*
+ * counters of the arena, see get_payload_stats
+ */
+typedef struct payload_stats {
+    size_t size;                /* bytes mapped */
+    size_t used;                /* bytes in allocated blocks */
+    int backing;                /* PAYLOAD_* */
+    unsigned long allocs;       /* allocations from the arena */
+    unsigned long fallbacks;    /* allocations from the heap instead */
+} PayloadStats;
+
+/*
+ * a heap at the start of the region it carves, whose free lists are
+ * linked by offsets from the heap
+ */
+typedef struct payload_heap {
+    size_t size;                            /* bytes of the region */
+    size_t free_lists[PAYLOAD_CLASSES];     /* offsets, 0 for none */
+    PayloadStats stats;
+} PayloadHeap;
+
+int payload_init(size_t size);
+
+void *payload_alloc(size_t size);
+
+void payload_free(void *ptr);
+
+void get_payload_stats(PayloadStats *stats);
+
+void payload_heap_init(PayloadHeap *heap, size_t size);
+
+size_t payload_heap_alloc(PayloadHeap *heap, size_t size);
+
+void payload_heap_free(PayloadHeap *heap, size_t offset);
+
+#endif
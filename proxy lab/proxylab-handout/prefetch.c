@@ -0,0 +1,347 @@
+/*
+ * prefetch.c
+ *
+ * Prefetching of the subresources of HTML pages. When a page is cached,
+ * its body is scanned for the stylesheets, icons and preloads of <link>
+ * tags, and the sources of <script> and <img> tags. Those on the same
+ * host and port as the page are queued, up to a number per page, and a
+ * few worker threads at the lowest priority hand them to a fetch
+ * function, which caches them if they are not cached yet. The client
+ * that asks for them next finds them in the cache instead of waiting for
+ * the origin.
+ *
+ * Only http urls are followed. A url queued already is not queued again,
+ * and when the queue is full, urls are dropped rather than waited for.
+ */
+
+#include <sys/resource.h>
+#include "csapp.h"
+#include "http.h"
+#include "prefetch.h"
+
+static char queue[PREFETCH_QUEUE][MAXLINE];
+static int queue_head = 0;
+static int queue_count = 0;
+static int links_per_page = 0;      /* 0 while prefetching is off */
+static void (*fetch_url)(char *url);
+static PrefetchStats stats;
+static pthread_mutex_t prefetch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prefetch_cond = PTHREAD_COND_INITIALIZER;
+
+/* Helper function declaration */
+static char *next_link(char *pos, char *end, char *link, int size);
+static char *skip_script(char *pos, char *end);
+static int tag_attribute(char *pos, char *end, char *name, char *value,
+                         int size);
+static int resolve_link(char *base, char *link, char *url);
+static int origin_length(char *url);
+static void remove_dot_segments(char *path);
+static void enqueue_url(char *url);
+static void *prefetch_worker(void *arg);
+
+/*
+ * prefetch_init - start workers threads that fetch the urls found in
+ * pages with fetch, taking at most links urls from a page
+ */
+void prefetch_init(int workers, int links, void (*fetch)(char *url))
+{
+    pthread_t tid;
+
+    fetch_url = fetch;
+    links_per_page = links;
+    for (int i = 0; i < workers; ++i)
+        Pthread_create(&tid, NULL, prefetch_worker, NULL);
+}
+
+/*
+ * prefetch_page - queue the subresources of a response just cached for
+ * url, if it is an HTML page that is not encoded. resp holds the length
+ * bytes of its headers and body.
+ */
+void prefetch_page(char *url, char *resp, int length)
+{
+    char value[MAXLINE], link[MAXLINE], target[MAXLINE];
+    int head_len, found = 0;
+    char *pos, *end = resp + length;
+
+    if (links_per_page == 0 || (head_len = http_header_length(resp,
+                                                              length)) < 0)
+        return;
+    if (!http_get_header(resp, head_len, "Content-Type", value, MAXLINE) ||
+        strncasecmp(value, "text/html", 9) != 0)
+        return;
+    if (http_get_header(resp, head_len, "Content-Encoding", value, MAXLINE)
+        && strcasecmp(value, "identity") != 0)
+        return;
+
+    pthread_mutex_lock(&prefetch_mutex);
+    ++stats.pages;
+    pthread_mutex_unlock(&prefetch_mutex);
+
+    pos = resp + head_len;
+    while (found < links_per_page &&
+           (pos = next_link(pos, end, link, MAXLINE)) != NULL) {
+        if (resolve_link(url, link, target) == 0 &&
+            origin_length(target) == origin_length(url) &&
+            strncasecmp(target, url, origin_length(url)) == 0) {
+            enqueue_url(target);
+            ++found;
+        }
+    }
+}
+
+/*
+ * get_prefetch_stats - copy the counters of the prefetcher to out
+ */
+void get_prefetch_stats(PrefetchStats *out)
+{
+    pthread_mutex_lock(&prefetch_mutex);
+    *out = stats;
+    pthread_mutex_unlock(&prefetch_mutex);
+}
+
+/*
+ * next_link - find the next subresource link of the HTML between pos and
+ * end, and copy it to link, which holds size bytes. Return where to look
+ * for the one after, or NULL if there is none.
+ */
+static char *next_link(char *pos, char *end, char *link, int size)
+{
+    char rel[MAXLINE];
+
+    while ((pos = memchr(pos, '<', end - pos)) != NULL) {
+        char *name = ++pos, *tag_end;
+        int name_len = 0;
+
+        while (name + name_len < end &&
+               isalpha((unsigned char)name[name_len]))
+            ++name_len;
+        if ((tag_end = memchr(pos, '>', end - pos)) == NULL)
+            return NULL;
+        pos = tag_end + 1;
+
+        if (name_len == 4 && strncasecmp(name, "link", 4) == 0) {
+            // only the links the page itself needs, not alternates
+            if (!tag_attribute(name + 4, tag_end, "rel", rel, MAXLINE))
+                continue;
+            for (char *c = rel; *c != '\0'; ++c)
+                *c = tolower((unsigned char)*c);
+            if ((strstr(rel, "stylesheet") != NULL ||
+                 strstr(rel, "icon") != NULL ||
+                 strstr(rel, "preload") != NULL) &&
+                tag_attribute(name + 4, tag_end, "href", link, size))
+                return pos;
+        }
+        else if (name_len == 6 && strncasecmp(name, "script", 6) == 0) {
+            // the code of a script may hold tags in strings
+            int found = tag_attribute(name + 6, tag_end, "src", link, size);
+            pos = skip_script(pos, end);
+            if (found)
+                return pos;
+        }
+        else if (name_len == 3 && strncasecmp(name, "img", 3) == 0) {
+            if (tag_attribute(name + 3, tag_end, "src", link, size))
+                return pos;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * skip_script - the end of the script element whose content starts at
+ * pos, or end if it is not closed
+ */
+static char *skip_script(char *pos, char *end)
+{
+    while ((pos = memchr(pos, '<', end - pos)) != NULL) {
+        if (end - pos >= 8 && strncasecmp(pos, "</script", 8) == 0)
+            return pos;
+        ++pos;
+    }
+    return end;
+}
+
+/*
+ * tag_attribute - if the attributes of a tag, between pos and end, have
+ * the given one, copy its value to value, which holds size bytes, and
+ * return 1. Otherwise return 0.
+ */
+static int tag_attribute(char *pos, char *end, char *name, char *value,
+                         int size)
+{
+    int name_len = strlen(name);
+
+    while (pos < end) {
+        char *start, quote = 0;
+        int n;
+
+        // an attribute name starts after a space
+        if (!isspace((unsigned char)*pos) || end - pos <= name_len ||
+            strncasecmp(pos + 1, name, name_len) != 0) {
+            ++pos;
+            continue;
+        }
+        pos += 1 + name_len;
+        while (pos < end && isspace((unsigned char)*pos))
+            ++pos;
+        if (pos == end || *pos != '=')
+            continue;
+        ++pos;
+        while (pos < end && isspace((unsigned char)*pos))
+            ++pos;
+        if (pos < end && (*pos == '"' || *pos == '\''))
+            quote = *pos++;
+        start = pos;
+        while (pos < end && (quote ? *pos != quote :
+                             !isspace((unsigned char)*pos)))
+            ++pos;
+        if ((n = pos - start) >= size)
+            return 0;
+        memcpy(value, start, n);
+        value[n] = '\0';
+        return n > 0;
+    }
+    return 0;
+}
+
+/*
+ * resolve_link - make the link found in the page at base into an
+ * absolute http url, without its fragment, in url, which holds MAXLINE
+ * bytes. Return -1 for a link to another scheme, such as data: or
+ * https:, or one that does not fit.
+ */
+static int resolve_link(char *base, char *link, char *url)
+{
+    char *p, *query;
+    int n;
+
+    if ((p = strchr(link, '#')) != NULL)
+        *p = '\0';
+    if (link[0] == '\0')
+        return -1;
+
+    if (strncasecmp(link, "http://", 7) == 0) {
+        n = snprintf(url, MAXLINE, "%s", link);
+    }
+    else if (link[0] == '/' && link[1] == '/') {
+        n = snprintf(url, MAXLINE, "http:%s", link);
+    }
+    else if (strcspn(link, ":/?") < strlen(link) &&
+             link[strcspn(link, ":/?")] == ':') {
+        return -1;
+    }
+    else if (link[0] == '/') {
+        n = snprintf(url, MAXLINE, "%.*s%s", origin_length(base), base,
+                     link);
+    }
+    else {
+        // relative to the directory of base, or to base itself for a
+        // query
+        query = strchr(base, '?');
+        n = query ? query - base : strlen(base);
+        if (link[0] != '?')
+            while (n > origin_length(base) && base[n - 1] != '/')
+                --n;
+        n = snprintf(url, MAXLINE, "%.*s%s", n, base, link);
+    }
+    if (n < 0 || n >= MAXLINE)
+        return -1;
+
+    remove_dot_segments(url + origin_length(url));
+    return 0;
+}
+
+/*
+ * origin_length - the length of the "http://host[:port]" part of url
+ */
+static int origin_length(char *url)
+{
+    return 7 + strcspn(url + 7, "/?");
+}
+
+/*
+ * remove_dot_segments - resolve the "." and ".." segments of a path in
+ * place, up to its query, so that the url is the one a browser asks for
+ */
+static void remove_dot_segments(char *path)
+{
+    char *in = path, *out = path, *query = strchr(path, '?');
+    char *end = query ? query : path + strlen(path);
+    int dots = 0;       /* the last segment was "." or ".." */
+
+    while (in < end) {
+        char *next = memchr(in + 1, '/', end - in - 1);
+        int len;
+
+        if (next == NULL)
+            next = end;
+        len = next - in;
+        dots = (len == 2 && in[1] == '.') ||
+               (len == 3 && in[1] == '.' && in[2] == '.');
+        if (len == 3 && dots) {
+            while (out > path && *--out != '/')
+                ;
+        }
+        else if (!dots) {
+            memmove(out, in, len);
+            out += len;
+        }
+        in = next;
+    }
+    // a path ending in "." or ".." still ends with a slash
+    if (out == path || dots)
+        *out++ = '/';
+    memmove(out, end, strlen(end) + 1);
+}
+
+/*
+ * enqueue_url - queue a url for the workers, unless it is queued already
+ * or the queue is full
+ */
+static void enqueue_url(char *url)
+{
+    pthread_mutex_lock(&prefetch_mutex);
+    for (int i = 0; i < queue_count; ++i) {
+        if (strcmp(queue[(queue_head + i) % PREFETCH_QUEUE], url) == 0) {
+            pthread_mutex_unlock(&prefetch_mutex);
+            return;
+        }
+    }
+    if (queue_count == PREFETCH_QUEUE) {
+        ++stats.dropped;
+    }
+    else {
+        strcpy(queue[(queue_head + queue_count) % PREFETCH_QUEUE], url);
+        ++queue_count;
+        ++stats.queued;
+        pthread_cond_signal(&prefetch_cond);
+    }
+    pthread_mutex_unlock(&prefetch_mutex);
+}
+
+/*
+ * prefetch_worker - a worker thread. It takes the urls from the queue one
+ * at a time, at the lowest priority so that prefetching only uses the CPU
+ * the requests of clients leave.
+ */
+static void *prefetch_worker(void *arg)
+{
+    char url[MAXLINE];
+
+    pthread_detach(pthread_self());
+    // on Linux, this only applies to the calling thread
+    setpriority(PRIO_PROCESS, 0, PREFETCH_NICE);
+    while (1) {
+        pthread_mutex_lock(&prefetch_mutex);
+        while (queue_count == 0)
+            pthread_cond_wait(&prefetch_cond, &prefetch_mutex);
+        strcpy(url, queue[queue_head]);
+        queue_head = (queue_head + 1) % PREFETCH_QUEUE;
+        --queue_count;
+        ++stats.fetched;
+        pthread_mutex_unlock(&prefetch_mutex);
+
+        fetch_url(url);
+    }
+    return NULL;
+}
@@ -0,0 +1,31 @@
+/*
+ * prefetch.h
+ *
+ * Header file for the prefetcher of the subresources of HTML pages
+ */
+
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#define PREFETCH_QUEUE          64  /* urls waiting, more are dropped */
+#define MAX_PREFETCH_WORKERS    16  /* fetches at once, at most */
+#define DEFAULT_PREFETCH_LINKS  8   /* urls taken from one page */
+#define PREFETCH_NICE           19  /* priority of the workers */
+
+/*
+ * counters of the prefetcher, see get_prefetch_stats
+ */
+typedef struct prefetch_stats {
+    unsigned long pages;        /* HTML pages scanned */
+    unsigned long queued;       /* urls queued */
+    unsigned long dropped;      /* urls dropped with the queue full */
+    unsigned long fetched;      /* urls handed to the fetch function */
+} PrefetchStats;
+
+void prefetch_init(int workers, int links, void (*fetch)(char *url));
+
+void prefetch_page(char *url, char *resp, int length);
+
+void get_prefetch_stats(PrefetchStats *stats);
+
+#endif
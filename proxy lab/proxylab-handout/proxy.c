@@ -10,82 +10,384 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <limits.h>
+#include <sys/uio.h>
 #include "csapp.h"
 #include "cache.h"
+#include "cachekey.h"
+#include "http.h"
+#include "range.h"
+#include "origin.h"
+#include "arena.h"
+#include "log.h"
+#include "compress.h"
+#include "hedge.h"
+#include "timer.h"
+#include "prefetch.h"
+#include "payload.h"
+#include "shmcache.h"
+#include "affinity.h"
+#include "lockprof.h"
 
-/* Recommended max cache and object sizes */
-#define MAX_CACHE_SIZE 1049000
-#define MAX_OBJECT_SIZE 102400
+/* Max size of the request header sent to the server */
+#define MAX_HEADER_SIZE 102400
 
 /* My macros */
 #define HOST       0
 #define USER_AGENT 1
 
+/* Most bytes sent in one write, so that the idle deadline follows a
+ * client that reads a large object slowly */
+#define SEND_SLICE (256 * 1024)
+
+/* Path of the admin interface, only served to local clients */
+#define ADMIN_PATH "/__proxy/cache"
+
+/* Framing of a response body, see response_framing */
+#define BODY_NONE    0      /* no body, e.g. 204 and 304 */
+#define BODY_LENGTH  1      /* Content-Length bytes */
+#define BODY_CHUNKED 2      /* Transfer-Encoding: chunked */
+#define BODY_CLOSE   3      /* up to the end of the connection */
+
+/*
+ * copy of a response kept while it is forwarded, to be cached if it
+ * turns out small enough. A cacheable response that outgrows limit goes
+ * on to a chunked line instead, if one can be started for it.
+ */
+typedef struct {
+    char *data;
+    long size;      /* bytes seen so far, even those past limit */
+    long cap;
+    int limit;
+    char *key;      /* key of the chunked line, or NULL for none */
+    unsigned long hash;
+    char *head;     /* headers sent to the client */
+    int head_len;
+    int body_start; /* bytes of data before the body */
+    long expected;  /* length of the body, or -1 if unknown */
+    CacheLine *line;    /* the chunked line, once started */
+} CacheCopy;
+
 /* You won't lose style points for including this long line in your code */
 static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
-static const char *connection = "Connection: close\r\n";
-static const char *proxy_connection = "Proxy-Connection: close\r\n";
+static const char *connection = "Connection: keep-alive\r\n";
+static const char *client_connection = "Connection: close\r\n";
 static const char *accept_hdr = 
 "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n";
 static const char *accept_encoding = "Accept-Encoding: gzip, deflate\r\n";
 static const char *method = "GET";
-static const char *version = "HTTP/1.0\r\n";
-static const char *error_read = "Error when calling Rio_readlineb.\n";
+static const char *version = "HTTP/1.1\r\n";
+static const char *error_read = "Error when calling rio_readlineb.\n";
 static const char *error_method = "Only accept GET method.\r\n";
 static const char *error_uri = "URI invalid.\r\n";
 static const char *protocol = "http://";
+static const char *error_admin = "HTTP/1.0 403 Forbidden\r\n\r\n";
+static const char *error_origin = "HTTP/1.0 502 Bad Gateway\r\n\r\n";
+static const char *error_timeout = "HTTP/1.0 504 Gateway Timeout\r\n\r\n";
+static const char *page_kinds[] = {"none", "normal", "thp", "hugetlb"};
+static const char *usage = "Usage: %s [-ALs] [-a access log] [-l drop|block] "
+"[-c budget] [-C large budget] [-o object size] [-w high,low] [-z size] "
+"[-q host=quota]... [-H percentile[,budget]] [-t header,connect,first,idle] "
+"[-p workers[,links]] [-P processes[,shared size]] [-b cpus] [-d param]... "
+"<port>\n";
 
 
 /* Global variables */
-sem_t mutex;
+int access_log = -1;        /* requests replayed by cachesim */
+pid_t *worker_pids = NULL;  /* the workers, in the master process */
+int worker_count = 0;
+int pin_connections = 0;    /* pin the thread of each connection */
+int compress_min = 0;       /* smallest body cached gzipped, 0 for none */
+long decode_count = 0;      /* hits that decompressed their object */
+long decode_ns = 0;         /* time those hits spent decompressing */
 
 /* Helper function declaration */
 int arg_is_valid(char *arg) ;
+long parse_size(char *arg, long max);
 void sigint_handler(int signal);
+void master_handler(int signal);
+int run_workers(int count);
 void *thread_job(void *arg);
-void handle_request(int connfd);
-void send_from_cache(int fd, CacheLine *cache_data);
+void handle_request(int connfd, Arena *arena);
+void handle_admin(int connfd, char *uri);
+void prefetch_object(char *url);
+int client_is_local(int connfd);
+int send_from_cache(int fd, Arena *arena, CacheLine *cache_data,
+                    char *range, char *if_range, char *accept_encoding);
+int send_encoded(int fd, CacheLine *cache_data, char *header);
+char *decode_body(Arena *arena, CacheLine *cache_data);
+void send_object(int fd, char *head, int head_len, char *body,
+                 long body_len);
+long send_stream(int fd, CacheLine *cache_data);
+void cache_response(char *key, unsigned long hash, char *resp, int length);
+void store_object(char *key, unsigned long hash, char *object, int length,
+                  int head_len, int raw_len);
+int fetch_shared(char *key, unsigned long hash);
+int compressible(char *resp, int head_len);
 void parse_uri(char *uri, char *host, char *port, char *path);
-void add_request_header(char *header, char *buffer, int *flags);
+void add_request_header(char *header, char *line, int len, int *flags);
+int header_is(char *line, int key_len, char *name);
+void append_header_line(char *header, char *line, int len);
 void complete_request_header(char *req_header, char *host, int *flags);
 void generate_request(char *req, char *path, char *req_header);
-void forward_request(int fd, char *uri, char *host, char *port, char *req);
+int forward_request(int fd, Arena *arena, char *key, unsigned long hash,
+                    char *host, char *port, char *req, int *status,
+                    int *stored);
+int send_request(char *host, char *port, char *req, rio_t *rio,
+                 char *header, int *length);
+int read_response_header(rio_t *rp, char *header, int maxlen);
+int response_framing(char *header, int length, long *content_length);
+int response_keepalive(char *header, int length);
+int make_client_header(char *header, int length, char *out, int chunked);
+int relay_bytes(rio_t *rp, long n, int fd, int *client_ok, CacheCopy *copy);
+int relay_chunked(rio_t *rp, int fd, int *client_ok, CacheCopy *copy);
+void pass_on(int fd, int *client_ok, CacheCopy *copy, char *data, int n);
+void copy_append(CacheCopy *copy, char *data, int n);
+void copy_overflow(CacheCopy *copy, char *data, int n);
+void log_access(struct timeval *start, char *uri, int status, int size,
+                char *kind);
 
 int main(int argc, char **argv)
 {
-    int listenfd, port, *connfd;
+    int listenfd, port, connfd, opt, high, low, log_policy = LOG_DROP;
+    int percentile, budget, n, seconds[TIMEOUT_KINDS];
+    int workers = 0, links = DEFAULT_PREFETCH_LINKS, processes = 0;
+    int cpus = 0, worker, *listeners = NULL;
+    long shared_size = DEFAULT_SHARED_SIZE;
+    long size;
+    char *quota;
     socklen_t clientlen;
     struct sockaddr_storage clientaddr;
     pthread_t tid;
     
+    // parse options
+    //   -a file  append a line per proxied request to file, for cachesim
+    //   -l drop  drop log lines when the log falls behind (default), or
+    //   -l block make requests wait for it instead
+    //   -d name  drop query parameter name from cache keys (repeatable)
+    //   -s       sort query parameters in cache keys
+    //   -L       look up the cache without taking locks
+    //   -A       keep the cached objects in an arena of huge pages
+    //   -c size  total cache budget in bytes
+    //   -C size  budget of the objects past the object size, kept in
+    //            chunks
+    //   -o size  largest object cached, in bytes, at most 256 MB
+    //   -w h,l   start evicting in the background above h percent of the
+    //            budget, and stop at l percent
+    //   -z size  cache text bodies of at least size bytes gzipped
+    //   -q h=size  give the hosts matching h ("host", "*.domain" or "*")
+    //            a partition of the cache with a quota of size bytes
+    //            (repeatable)
+    //   -H p,b   send a miss to the origin again if it has not answered
+    //            within the p-th percentile of first-byte times, for at
+    //            most b percent of the misses (5 by default)
+    //   -t h,c,f,i  seconds allowed for the request headers, an origin
+    //            connect, the first byte of a response, and each step of
+    //            sending a body; leading ones may be given alone
+    //   -p w,l   fetch into the cache, with w threads in the background,
+    //            the first l same-origin stylesheets, scripts and images
+    //            of the HTML pages cached (8 by default)
+    //   -P n,size  serve from n worker processes, which share a cache of
+    //            size bytes (16 MB by default) behind their own caches,
+    //            and start a worker again when it dies
+    //   -b cpus  serve each connection on one of cpus, e.g. "0-3,6": the
+    //            one its packets arrive on if listed. Worker processes
+    //            each run on one of them instead.
+    while ((opt = getopt(argc, argv, "a:l:d:sLAc:C:o:w:z:q:H:t:p:P:b:"))
+           != -1) {
+        switch (opt) {
+        case 'a':
+            if ((access_log = open(optarg, O_WRONLY | O_CREAT | O_APPEND,
+                                   0644)) < 0)
+                unix_error("open error");
+            break;
+        case 'l':
+            if (strcmp(optarg, "drop") == 0)
+                log_policy = LOG_DROP;
+            else if (strcmp(optarg, "block") == 0)
+                log_policy = LOG_BLOCK;
+            else {
+                fprintf(stderr, usage, argv[0]);
+                exit(0);
+            }
+            break;
+        case 'd':
+            drop_query_param(optarg);
+            break;
+        case 's':
+            sort_query_params(1);
+            break;
+        case 'L':
+            set_cache_lockfree(1);
+            break;
+        case 'A':
+            set_cache_arena(1);
+            break;
+        case 'c':
+            if ((size = parse_size(optarg, LONG_MAX)) < 0) {
+                fprintf(stderr, usage, argv[0]);
+                exit(0);
+            }
+            set_cache_budget(size);
+            break;
+        case 'C':
+            if ((size = parse_size(optarg, LONG_MAX)) < 0) {
+                fprintf(stderr, usage, argv[0]);
+                exit(0);
+            }
+            set_large_budget(size);
+            break;
+        case 'o':
+            if ((size = parse_size(optarg, MAX_OBJECT_LIMIT)) < 0) {
+                fprintf(stderr, usage, argv[0]);
+                exit(0);
+            }
+            set_object_limit(size);
+            break;
+        case 'w':
+            if (sscanf(optarg, "%d,%d", &high, &low) != 2 || low < 0 ||
+                low > high || high > 100) {
+                fprintf(stderr, usage, argv[0]);
+                exit(0);
+            }
+            set_cache_watermarks(high, low);
+            break;
+        case 'z':
+            if ((size = parse_size(optarg, MAX_OBJECT_LIMIT)) < 0) {
+                fprintf(stderr, usage, argv[0]);
+                exit(0);
+            }
+            compress_min = size;
+            break;
+        case 'q':
+            if ((quota = strrchr(optarg, '=')) == NULL ||
+                (size = parse_size(quota + 1, LONG_MAX)) < 0) {
+                fprintf(stderr, usage, argv[0]);
+                exit(0);
+            }
+            *quota = '\0';
+            if (add_cache_partition(optarg, size) < 0) {
+                fprintf(stderr, "Too many partitions.\n");
+                exit(0);
+            }
+            break;
+        case 'H':
+            budget = DEFAULT_HEDGE_BUDGET;
+            if (sscanf(optarg, "%d,%d", &percentile, &budget) < 1 ||
+                percentile < 1 || percentile > 99 || budget < 0 ||
+                budget > 100) {
+                fprintf(stderr, usage, argv[0]);
+                exit(0);
+            }
+            hedge_init(percentile, budget);
+            break;
+        case 't':
+            n = sscanf(optarg, "%d,%d,%d,%d", &seconds[0], &seconds[1],
+                       &seconds[2], &seconds[3]);
+            for (int i = 0; i < n; ++i)
+                if (seconds[i] < 1)
+                    n = 0;
+            if (n < 1) {
+                fprintf(stderr, usage, argv[0]);
+                exit(0);
+            }
+            for (int i = 0; i < n; ++i)
+                set_timeout(i, seconds[i]);
+            break;
+        case 'p':
+            if (sscanf(optarg, "%d,%d", &workers, &links) < 1 ||
+                workers < 1 || workers > MAX_PREFETCH_WORKERS ||
+                links < 1) {
+                fprintf(stderr, usage, argv[0]);
+                exit(0);
+            }
+            break;
+        case 'P':
+            if (sscanf(optarg, "%d,%ld", &processes, &shared_size) < 1 ||
+                processes < 1 || shared_size < MAXBUF) {
+                fprintf(stderr, usage, argv[0]);
+                exit(0);
+            }
+            break;
+        case 'b':
+            if ((cpus = affinity_init(optarg)) < 0) {
+                fprintf(stderr, "Invalid CPU list.\n");
+                exit(0);
+            }
+            break;
+        default:
+            fprintf(stderr, usage, argv[0]);
+            exit(0);
+        }
+    }
+    
     // check if input argument number meets requirements
-    if (argc != 2 || !arg_is_valid(argv[1])) {
-        fprintf(stderr, "Usage: %s <port>\n", argv[0]);
+    if (argc - optind != 1 || !arg_is_valid(argv[optind])) {
+        fprintf(stderr, usage, argv[0]);
         exit(0);
     }
     
     // check if input port number is valid
-    port = atoi(argv[1]);
+    port = atoi(argv[optind]);
     
     if ((port < 1024) || (port > 65535)) {
         fprintf(stderr, "Invalid port number.\n");
         exit(0);
     }
     
+    // in prefork mode, the master only watches the workers, which go on
+    // from here. The threads below are started in each worker, since
+    // they do not survive a fork. With CPUs given, each worker has a
+    // listening socket of its own, opened by the master so that a worker
+    // started again takes over the one of the worker it replaces.
+    if (processes > 0 && cpus > 0) {
+        listeners = Malloc(processes * sizeof(int));
+        for (int i = 0; i < processes; ++i)
+            if ((listeners[i] = open_steered_listenfd(argv[optind],
+                                                      affinity_cpu(i))) < 0)
+                unix_error("Open_listenfd error");
+    }
+    else {
+        listenfd = Open_listenfd(argv[optind]);
+    }
+    if (processes > 0) {
+        if (shared_cache_init(shared_size) < 0)
+            unix_error("shared cache error");
+        worker = run_workers(processes);
+        if (cpus > 0) {
+            for (int i = 0; i < processes; ++i)
+                if (i != worker)
+                    Close(listeners[i]);
+            listenfd = listeners[worker];
+            // the threads of the worker are created below, and inherit
+            if (pin_thread(affinity_cpu(worker)) < 0)
+                unix_error("pin_thread error");
+        }
+    }
+    else if (cpus > 0) {
+        pin_connections = 1;
+    }
+    
     // signal handlers
     Signal(SIGPIPE, SIG_IGN);
     Signal(SIGINT, sigint_handler);
+    Signal(SIGTERM, sigint_handler);
     
     // do the main job
-    Sem_init(&mutex, 0, 1);
+    log_init(access_log, log_policy);
+    timer_init();
+    set_cache_dedup(1);
+    set_cache_replicas(1);
     init_cache();
-    listenfd = Open_listenfd(argv[1]);
+    start_evictor();
+    if (workers > 0)
+        prefetch_init(workers, links, prefetch_object);
     while (1) {
         clientlen = sizeof(struct sockaddr_storage);
-        connfd = Malloc(sizeof(int));
-        *connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen);
-        // create a thread to handle client request
-        Pthread_create(&tid, NULL, thread_job, connfd);
+        connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen);
+        // create a thread to handle client request. The descriptor is
+        // passed in the pointer itself, so that no memory is allocated.
+        Pthread_create(&tid, NULL, thread_job, (void *)(long)connfd);
     }
     
     return 0;
@@ -113,26 +415,115 @@ int arg_is_valid(char *arg)
 }
 
 
+/* 
+ * parse_size - parse a size given as an option. Return -1 unless it is
+ * a number between 1 and max.
+ */
+long parse_size(char *arg, long max)
+{
+    char *end;
+    long size;
+    
+    errno = 0;
+    size = strtol(arg, &end, 10);
+    if (errno != 0 || end == arg || *end != '\0' || size < 1 || size > max)
+        return -1;
+    return size;
+}
+
+
 /* 
  * sigint_handler - handler to handle sigint. When user clicks ctrl + c, 
- * free the cache and exit the program.
+ * exit the program once the log records are written. Also used for
+ * sigterm. Only async-signal-safe calls are made, since other threads
+ * may be in the middle of anything.
  */
 void sigint_handler(int signal)
 {
-    printf("Exit\n");
-    free_cache();
-    exit(0);
+    write(STDOUT_FILENO, "Exit\n", 5);
+    log_exit();
+}
+
+/* 
+ * master_handler - handler of sigint and sigterm in the master of the
+ * prefork mode. The workers are told to exit, and each writes its log
+ * records first.
+ */
+void master_handler(int signal)
+{
+    for (int i = 0; i < worker_count; ++i)
+        kill(worker_pids[i], SIGTERM);
+    _exit(0);
+}
+
+/* 
+ * run_workers - fork count worker processes, and return in each of
+ * them its index, which a worker started again takes over. The master
+ * never returns: it starts a worker again whenever one
+ * dies, after a second if it died within one, so that a worker that
+ * crashes at once does not make the master spin.
+ */
+int run_workers(int count)
+{
+    time_t *started = Malloc(count * sizeof(time_t));
+    pid_t pid;
+    int status;
+    
+    worker_pids = Malloc(count * sizeof(pid_t));
+    worker_count = count;
+    for (int i = 0; i < count; ++i) {
+        started[i] = time(NULL);
+        if ((worker_pids[i] = Fork()) == 0)
+            return i;
+    }
+    
+    Signal(SIGINT, master_handler);
+    Signal(SIGTERM, master_handler);
+    while (1) {
+        int i = 0;
+        
+        if ((pid = wait(&status)) < 0) {
+            if (errno == EINTR)
+                continue;
+            unix_error("wait error");
+        }
+        while (i < count && worker_pids[i] != pid)
+            ++i;
+        if (i == count)
+            continue;
+        
+        fprintf(stderr, "Worker %d exited with status %d, restarting.\n",
+                (int)pid, status);
+        shared_worker_restarted();
+        if (time(NULL) - started[i] < 1)
+            sleep(1);
+        started[i] = time(NULL);
+        // the worker takes the handler of the master until it sets its
+        // own, and must not signal the others from it meanwhile
+        if ((worker_pids[i] = Fork()) == 0) {
+            worker_count = 0;
+            return i;
+        }
+    }
 }
 
 /* 
- * thread_job - the function each thread will execute
+ * thread_job - the function each thread will execute. The buffers of the
+ * request come from an arena of the pool, given back when it is done.
+ * With CPUs given, the thread stays on the one chosen for the connection
+ * until it is done.
  */
 void *thread_job(void *arg)
 {
     pthread_detach(pthread_self());
-    int connfd = *((int *)arg);
-    Free(arg);
-    handle_request(connfd);
+    int connfd = (long)arg;
+    if (pin_connections)
+        pin_thread(connection_cpu(connfd));
+    Arena *arena = arena_get();
+    handle_request(connfd, arena);
+    arena_put(arena);
+    log_thread_done();
+    timer_cancel();
     Close(connfd);
     pthread_exit(NULL);
     return 0;
@@ -140,63 +531,125 @@ void *thread_job(void *arg)
 
 /* 
  * handle_request - receives client's request, rearrange it and send to 
- * server. After that, send server's response back to client.
+ * server. After that, send server's response back to client. The buffers
+ * are taken from arena, so that a cache hit allocates no memory.
  */
-void handle_request(int connfd)
+void handle_request(int connfd, Arena *arena)
 {
     rio_t rio;
-    size_t size;
+    ssize_t size;
     int flags[2] = {0, 0};
-    char buffer[MAXLINE] = {0}, req_method[MAXLINE] = {0}, 
-         uri[MAXLINE] = {0}, host[MAXLINE] = {0}, 
-         path[MAXLINE] = {0}, req_header[MAX_OBJECT_SIZE] = {0},
-         uri_protocol[8] = {0}, req[MAX_OBJECT_SIZE] = {0},
-         port[8] = "80";
+    char *buffer = arena_string(arena, MAXLINE),
+         *req_method = arena_string(arena, MAXLINE),
+         *uri = arena_string(arena, MAXLINE),
+         *host = arena_string(arena, MAXLINE),
+         *path = arena_string(arena, MAXLINE),
+         *req_header = arena_string(arena, MAX_HEADER_SIZE),
+         *req = arena_string(arena, MAX_HEADER_SIZE),
+         *range = arena_string(arena, MAXLINE),
+         *if_range = arena_string(arena, MAXLINE),
+         *accept_encoding = arena_string(arena, MAXLINE),
+         *key = arena_string(arena, MAXLINE);
+    char port[8] = "80";
+    unsigned long hash;
+    char *line;
     CacheLine *cache_data = NULL;
+    struct timeval start;
+    int status, stored;
     
+    gettimeofday(&start, NULL);
+    // a client that resets the connection is not an error of the proxy,
+    // so the reads and writes below report errors instead of exiting.
+    // One that does not send its request in time is shut out.
+    timer_arm(TIMEOUT_HEADER, connfd, -1);
     Rio_readinitb(&rio, connfd);
-    size = Rio_readlineb(&rio, buffer, MAXLINE);
+    size = rio_readlineb(&rio, buffer, MAXLINE);
     
-    if (size < 0) {
-        fprintf(stderr, error_read);
+    if (size <= 0) {
+        if (size < 0)
+            log_printf(LOG_ERROR, "%s", error_read);
         return;
     }
+    count_request();
     
     // get request method and uri from user request and check them
     sscanf(buffer, "%s %s", req_method, uri);
     if (strcmp(req_method, "GET") != 0) {
-        Rio_writen(connfd, (void *)error_method, strlen(error_method));
-        fprintf(stderr, error_method);
+        rio_writen(connfd, (void *)error_method, strlen(error_method));
+        log_printf(LOG_ERROR, "%s", error_method);
         return;
     }
-    if (strcmp(strncpy(uri_protocol, uri, 7), protocol) != 0) {
-        Rio_writen(connfd, (void *)error_uri, strlen(error_uri));
-        fprintf(stderr, error_uri);
+    if (strncmp(uri, ADMIN_PATH, strlen(ADMIN_PATH)) == 0 &&
+        (uri[strlen(ADMIN_PATH)] == '\0' || uri[strlen(ADMIN_PATH)] == '?')) {
+        handle_admin(connfd, uri);
         return;
     }
-    
-    // check whether the object is cached. if yes, return object from cache
-    cache_data = get_object(uri);
-    if (cache_data != NULL) {
-        send_from_cache(connfd, cache_data);
+    // the scheme is case-insensitive, make_cache_key lowercases it
+    if (strncasecmp(uri, protocol, strlen(protocol)) != 0) {
+        rio_writen(connfd, (void *)error_uri, strlen(error_uri));
+        log_printf(LOG_ERROR, "%s", error_uri);
         return;
     }
     
-    // get hostname, port number and path from uri
-    parse_uri(uri, host, port, path);
-    
     // read user header line by line and add to request header.
     // if the header is "Connection" or "Proxy-Connection", ignore it.
+    // "Range", "If-Range" and "Accept-Encoding" are also remembered, since
+    // a cached object may answer them. Lines are looked at in the read
+    // buffer itself.
     while (1) {
-        strcpy(buffer, "");
-        if ((size = Rio_readlineb(&rio, buffer, MAXLINE)) < 0) {
-            fprintf(stderr, error_read);
+        if ((size = rio_readlineb_zc(&rio, &line)) < 0) {
+            log_printf(LOG_ERROR, "%s", error_read);
             return;
         }
         
-        if (strcmp(buffer, "\r\n") == 0) break;
-        add_request_header(req_header, buffer, flags);
+        if (size == 0 || (size == 2 && line[0] == '\r') ||
+            (size == 1 && line[0] == '\n'))
+            break;
+        http_header_value(line, size, "Range", range, MAXLINE);
+        http_header_value(line, size, "If-Range", if_range, MAXLINE);
+        http_header_value(line, size, "Accept-Encoding", accept_encoding,
+                          MAXLINE);
+        add_request_header(req_header, line, size, flags);
+    }
+    timer_arm(TIMEOUT_IDLE, connfd, -1);
+    
+    // normalize the uri once, so that equivalent uris share a cache line.
+    // a uri that cannot be normalized is used as the key directly.
+    if (make_cache_key(uri, key, MAXLINE, &hash) < 0) {
+        strcpy(key, uri);
+        hash = hash_key(key);
+    }
+    
+    // check whether the object is cached. if yes, return object from
+    // cache. A chunked line is sent as it fills, and ranges of it are
+    // left to the origin.
+    cache_data = get_object(key, hash);
+    if (cache_data == NULL && fetch_shared(key, hash))
+        cache_data = get_object(key, hash);
+    if (cache_data != NULL && cache_data->stream != NULL &&
+        range[0] != '\0') {
+        release_object(cache_data);
+        cache_data = NULL;
     }
+    if (cache_data != NULL) {
+        if (cache_data->stream != NULL) {
+            status = http_status(cache_data->head, cache_data->head_length);
+            size = send_stream(connfd, cache_data);
+        }
+        else {
+            status = send_from_cache(connfd, arena, cache_data, range,
+                                     if_range, accept_encoding);
+            size = cache_data->raw_length > 0 ? cache_data->raw_length :
+                   cache_data->length;
+        }
+        log_access(&start, uri, status, size, "hit");
+        release_object(cache_data);
+        return;
+    }
+    
+    // get hostname, port number and path from uri
+    parse_uri(uri, host, port, path);
+    
     // complete the header by adding lines such as "Connection" and 
     // "Proxy-Connection"
     complete_request_header(req_header, host, flags);
@@ -206,15 +659,365 @@ void handle_request(int connfd)
     generate_request(req, path, req_header);
     
     // send the request to server and get response
-    forward_request(connfd, uri, host, port, req);
+    size = forward_request(connfd, arena, key, hash, host, port, req,
+                           &status, &stored);
+    log_access(&start, uri, status, size, stored ? "miss" : "pass");
 }
 
 /* 
- * send_from_cache - send object to client from cache
+ * handle_admin - show the cache limits, and change the ones given in the
+ * query, e.g. GET /__proxy/cache?budget=4194304&object=1048576&high=90&low=80
+ * A smaller budget takes effect at once for new objects, while the lines
+ * over it are evicted in the background. large= sets the budget of the
+ * chunked lines, which shrinks at once. A line per host partition
+ * follows the limits, with its usage and hit ratio, and then a line per
+ * CPU that served requests of this process. With locks in the query,
+ * the page is the profile of the cache locks instead.
  */
-void send_from_cache(int fd, CacheLine *cache_data)
+void handle_admin(int connfd, char *uri)
 {
-    Rio_writen(fd, cache_data->object, cache_data->length);
+    char body[MAXLINE], header[MAXLINE];
+    char *param = strchr(uri, '?');
+    long budget = -1, object = -1, large = -1;
+    int high, low, n, count, locks = 0;
+    char *profile;
+    CacheStats stats;
+    PartitionStats parts[MAX_PARTITIONS];
+    HedgeStats hedge;
+    TimerStats timers;
+    PrefetchStats prefetch;
+    PayloadStats payload;
+    SharedStats shared;
+    AffinityStats affinity;
+    CpuRequests cpu_requests[MAX_CPUS];
+    
+    if (!client_is_local(connfd)) {
+        rio_writen(connfd, (void *)error_admin, strlen(error_admin));
+        return;
+    }
+    
+    get_cache_watermarks(&high, &low);
+    while (param != NULL) {
+        ++param;
+        if (strncmp(param, "budget=", 7) == 0)
+            budget = atol(param + 7);
+        else if (strncmp(param, "object=", 7) == 0)
+            object = atol(param + 7);
+        else if (strncmp(param, "large=", 6) == 0)
+            large = atol(param + 6);
+        else if (strncmp(param, "high=", 5) == 0)
+            high = atoi(param + 5);
+        else if (strncmp(param, "low=", 4) == 0)
+            low = atoi(param + 4);
+        else if (strncmp(param, "locks", 5) == 0)
+            locks = 1;
+        param = strchr(param, '&');
+    }
+    
+    if (object > 0 && object <= MAX_OBJECT_LIMIT)
+        set_object_limit(object);
+    if (low >= 0 && low <= high && high <= 100)
+        set_cache_watermarks(high, low);
+    if (budget > 0)
+        set_cache_budget(budget);
+    if (large > 0)
+        set_large_budget(large);
+    
+    // the lock profile is a page of its own, too long for the other one
+    if (locks) {
+        profile = Malloc(LOCK_DUMP_SIZE);
+        n = dump_cache_locks(profile, LOCK_DUMP_SIZE);
+        sprintf(header, "HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\n"
+                "Content-Length: %d\r\n\r\n", n);
+        rio_writen(connfd, header, strlen(header));
+        rio_writen(connfd, profile, n);
+        Free(profile);
+        return;
+    }
+    
+    get_cache_watermarks(&high, &low);
+    get_cache_stats(&stats);
+    get_hedge_stats(&hedge);
+    get_timer_stats(&timers);
+    get_prefetch_stats(&prefetch);
+    get_payload_stats(&payload);
+    get_shared_stats(&shared);
+    get_affinity_stats(&affinity);
+    n = snprintf(body, sizeof(body), "budget %ld\nobject %d\nhigh %d\n"
+                 "low %d\nused %ld\nretired %ld\nallocs %ld\n"
+                 "log_dropped %ld\ncompressed %lu\nsaved %ld\n"
+                 "decode_ns %ld\ndeduplicated %lu\nshared %ld\n"
+                 "large_budget %ld\nlarge_used %ld\nlarge_objects %lu\n"
+                 "large_aborts %lu\nhedge_delay_us %ld\nhedged %lu\n"
+                 "hedge_wins %lu\nhedge_denied %lu\ntimers_armed %lu\n"
+                 "timeouts_header %lu\ntimeouts_connect %lu\n"
+                 "timeouts_first_byte %lu\ntimeouts_idle %lu\n"
+                 "replicas %lu\nreplica_hits %lu\nprefetch_pages %lu\n"
+                 "prefetch_queued %lu\nprefetch_dropped %lu\n"
+                 "prefetch_fetched %lu\narena_size %zu\narena_used %zu\n"
+                 "arena_pages %s\narena_fallbacks %lu\npid %d\n"
+                 "shared_size %ld\nshared_used %ld\nshared_lines %d\n"
+                 "shared_hits %lu\nshared_misses %lu\nshared_evictions %lu\n"
+                 "shared_recoveries %lu\nworker_restarts %lu\n"
+                 "pinned_cpus %d\nsteered %lu\nspread %lu\n",
+                 get_cache_budget(), get_object_limit(), high, low,
+                 get_cache_used(), stats.retired_bytes, get_alloc_count(),
+                 log_dropped(), stats.compressed, stats.saved_bytes,
+                 decode_count ? decode_ns / decode_count : 0,
+                 stats.deduplicated, stats.shared_bytes, get_large_budget(),
+                 get_large_used(), stats.large_objects, stats.large_aborts,
+                 hedge.delay, hedge.hedges, hedge.wins, hedge.denied,
+                 timers.armed, timers.expired[TIMEOUT_HEADER],
+                 timers.expired[TIMEOUT_CONNECT],
+                 timers.expired[TIMEOUT_FIRST_BYTE],
+                 timers.expired[TIMEOUT_IDLE], stats.replicas,
+                 stats.replica_hits, prefetch.pages, prefetch.queued,
+                 prefetch.dropped, prefetch.fetched, payload.size,
+                 payload.used, page_kinds[payload.backing],
+                 payload.fallbacks, (int)getpid(), shared.size, shared.used,
+                 shared.lines, shared.hits, shared.misses, shared.evictions,
+                 shared.recoveries, shared.restarts, affinity.cpus,
+                 affinity.steered, affinity.spread);
+    count = get_partition_stats(parts, MAX_PARTITIONS);
+    for (int i = 0; i < count && n < (int)sizeof(body); ++i) {
+        unsigned long lookups = parts[i].hits + parts[i].misses;
+        n += snprintf(body + n, sizeof(body) - n, "partition %s quota %ld "
+                      "used %ld lines %d hits %lu misses %lu hit_ratio %.3f "
+                      "evictions %lu\n", parts[i].pattern[0] ?
+                      parts[i].pattern : "default", parts[i].quota,
+                      parts[i].used, parts[i].lines, parts[i].hits,
+                      parts[i].misses,
+                      lookups ? (double)parts[i].hits / lookups : 0,
+                      parts[i].evictions);
+    }
+    count = get_cpu_requests(cpu_requests, MAX_CPUS);
+    for (int i = 0; i < count && n < (int)sizeof(body); ++i)
+        n += snprintf(body + n, sizeof(body) - n, "cpu %d requests %lu\n",
+                      cpu_requests[i].cpu, cpu_requests[i].requests);
+    if (n >= (int)sizeof(body))
+        n = sizeof(body) - 1;
+    sprintf(header, "HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\n"
+            "Content-Length: %d\r\n\r\n", n);
+    rio_writen(connfd, header, strlen(header));
+    rio_writen(connfd, body, n);
+}
+
+/* 
+ * prefetch_object - fetch url into the cache for the prefetcher, unless
+ * it is cached already. The request is made as that of a client that
+ * sent no headers, and is not written to the access log, since no
+ * client asked for it.
+ */
+void prefetch_object(char *url)
+{
+    Arena *arena = arena_get();
+    int flags[2] = {0, 0};
+    char *host = arena_string(arena, MAXLINE),
+         *path = arena_string(arena, MAXLINE),
+         *req_header = arena_string(arena, MAX_HEADER_SIZE),
+         *req = arena_string(arena, MAX_HEADER_SIZE),
+         *key = arena_string(arena, MAXLINE);
+    char port[8] = "80";
+    unsigned long hash;
+    CacheLine *cache_data;
+    int status, stored;
+    
+    if (make_cache_key(url, key, MAXLINE, &hash) < 0) {
+        arena_put(arena);
+        return;
+    }
+    if ((cache_data = get_object(key, hash)) != NULL) {
+        release_object(cache_data);
+        arena_put(arena);
+        return;
+    }
+    if (fetch_shared(key, hash)) {
+        arena_put(arena);
+        return;
+    }
+    
+    parse_uri(url, host, port, path);
+    complete_request_header(req_header, host, flags);
+    generate_request(req, path, req_header);
+    forward_request(-1, arena, key, hash, host, port, req, &status,
+                    &stored);
+    arena_put(arena);
+}
+
+/* 
+ * client_is_local - whether the client connects from the loopback
+ * interface
+ */
+int client_is_local(int connfd)
+{
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    
+    if (getpeername(connfd, (SA *)&addr, &len) < 0)
+        return 0;
+    if (addr.ss_family == AF_INET) {
+        struct sockaddr_in *in = (struct sockaddr_in *)&addr;
+        return (ntohl(in->sin_addr.s_addr) >> 24) == 127;
+    }
+    if (addr.ss_family == AF_INET6) {
+        struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)&addr;
+        return IN6_IS_ADDR_LOOPBACK(&in6->sin6_addr);
+    }
+    return 0;
+}
+
+/* 
+ * send_from_cache - send object to client from cache. If the client asks
+ * for byte ranges of the object, only send those ranges. An object with a
+ * gzip body goes out as is to a client that accepts gzip and wants the
+ * whole object, and is decompressed for the others. Return the status
+ * sent.
+ */
+int send_from_cache(int fd, Arena *arena, CacheLine *cache_data,
+                    char *range, char *if_range, char *accept_encoding)
+{
+    char *head = cache_data->head, *body = cache_data->body->data;
+    int head_len = cache_data->head_length, status;
+    long body_len = cache_data->body->length;
+    
+    if (cache_data->raw_length > 0) {
+        if (range[0] == '\0' && http_has_token(accept_encoding, "gzip"))
+            return send_encoded(fd, cache_data,
+                                arena_alloc(arena, head_len + MAXLINE));
+        if ((body = decode_body(arena, cache_data)) == NULL) {
+            rio_writen(fd, (void *)error_origin, strlen(error_origin));
+            return 502;
+        }
+        body_len = cache_data->raw_length - head_len;
+    }
+    
+    if (range[0] != '\0' &&
+        (status = send_range(fd, head, head_len, body, body_len, range,
+                             if_range)) != 0)
+        return status;
+    send_object(fd, head, head_len, body, body_len);
+    return http_status(head, head_len);
+}
+
+/* 
+ * send_encoded - send an object with a gzip body as is, after its
+ * headers with Content-Length replaced by the compressed length and
+ * Content-Encoding added. header must have room for the headers of the
+ * object and MAXLINE more bytes.
+ */
+int send_encoded(int fd, CacheLine *cache_data, char *header)
+{
+    int head_len = cache_data->head_length, pos = 0, n = 0;
+    char *head = cache_data->head;
+    
+    while (pos < head_len) {
+        char *nl = memchr(head + pos, '\n', head_len - pos);
+        int len = nl ? nl - (head + pos) + 1 : head_len - pos;
+        char *line = head + pos;
+        char *p = memchr(line, ':', len);
+        
+        pos += len;
+        if ((len == 2 && line[0] == '\r') || (len == 1 && line[0] == '\n'))
+            break;
+        if (p != NULL && header_is(line, p - line, "Content-Length"))
+            continue;
+        memcpy(header + n, line, len);
+        n += len;
+    }
+    n += sprintf(header + n, "Content-Encoding: gzip\r\n"
+                 "Vary: Accept-Encoding\r\nContent-Length: %d\r\n\r\n",
+                 cache_data->body->length);
+    send_object(fd, header, n, cache_data->body->data,
+                cache_data->body->length);
+    return http_status(head, head_len);
+}
+
+/* 
+ * decode_body - decompress the gzip body of a cached object into a
+ * buffer from arena. Return the buffer, or NULL if the body does not
+ * decompress.
+ */
+char *decode_body(Arena *arena, CacheLine *cache_data)
+{
+    int body_len = cache_data->raw_length - cache_data->head_length;
+    char *body = arena_alloc(arena, body_len > 0 ? body_len : 1);
+    struct timespec start, end;
+    int n;
+    
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    n = gzip_decompress(cache_data->body->data, cache_data->body->length,
+                        body, body_len);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    
+    __atomic_add_fetch(&decode_count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&decode_ns, (end.tv_sec - start.tv_sec) * 1000000000L
+                       + (end.tv_nsec - start.tv_nsec), __ATOMIC_RELAXED);
+    return n == body_len ? body : NULL;
+}
+
+/* 
+ * send_object - send the head and the body of an object in as few
+ * writes as the socket allows, so that the body does not wait for the
+ * headers to be acknowledged. A client that goes away is not an error of
+ * the proxy, the rest is just not sent. Each write is cut to SEND_SLICE
+ * bytes, after which the idle deadline moves on.
+ */
+void send_object(int fd, char *head, int head_len, char *body,
+                 long body_len)
+{
+    struct iovec iov[2] = {{head, head_len}, {body, body_len}};
+    struct iovec *v = iov, slice[2];
+    int count = 2, parts;
+    ssize_t n;
+    size_t total;
+    
+    while (count > 0) {
+        for (parts = 0, total = 0; parts < count && total < SEND_SLICE;
+             ++parts) {
+            slice[parts] = v[parts];
+            if (slice[parts].iov_len > SEND_SLICE - total)
+                slice[parts].iov_len = SEND_SLICE - total;
+            total += slice[parts].iov_len;
+        }
+        if ((n = writev(fd, slice, parts)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        timer_touch();
+        while (count > 0 && n >= (ssize_t)v->iov_len) {
+            n -= v->iov_len;
+            ++v;
+            --count;
+        }
+        if (count > 0) {
+            v->iov_base = (char *)v->iov_base + n;
+            v->iov_len -= n;
+        }
+    }
+}
+
+/* 
+ * send_stream - send an object of a chunked line, following the line
+ * while it is filled. If filling is given up, the client gets a short
+ * body. Return the bytes sent.
+ */
+long send_stream(int fd, CacheLine *cache_data)
+{
+    CacheChunk *chunk = NULL;
+    long pos = 0, n;
+    char *data;
+    
+    if (rio_writen(fd, cache_data->head, cache_data->head_length) !=
+        cache_data->head_length)
+        return 0;
+    while ((n = read_stream(cache_data, pos, &chunk, &data)) > 0) {
+        if (rio_writen(fd, data, n) != n)
+            break;
+        timer_touch();
+        pos += n;
+    }
+    return cache_data->head_length + pos;
 }
 
 /* 
@@ -224,7 +1027,7 @@ void parse_uri(char *uri, char *host, char *port, char *path)
 {
     char *path_pos = NULL;
     char *port_pos = NULL;
-    sscanf(uri, "http://%s", host);
+    sscanf(uri + strlen(protocol), "%s", host);
     // start position of path and port, if they exist
     path_pos = strchr(host, '/');
     port_pos = strchr(host, ':');
@@ -246,42 +1049,73 @@ void parse_uri(char *uri, char *host, char *port, char *path)
  * add_request_header - add user request header to proxy request header
  * if necessary
  */
-void add_request_header(char *header, char *buffer, int *flags)
+void add_request_header(char *header, char *line, int len, int *flags)
 {
-    char key[MAXLINE] = {0};
-    char *p = strchr(buffer, ':');
-    strncpy(key, buffer, p - buffer);
+    char *p = memchr(line, ':', len);
+    int key_len;
+    
+    // ignore malformed header line
+    if (p == NULL)
+        return;
+    key_len = p - line;
     
     // if client's request header contains host, use that host
-    if (strcmp(key, "Host") == 0) {
+    if (header_is(line, key_len, "Host")) {
         flags[HOST] = 1;
-        strcat(header, buffer);
+        append_header_line(header, line, len);
     }
-    else if (strcmp(key, "User-Agent") == 0) {
+    else if (header_is(line, key_len, "User-Agent")) {
         flags[USER_AGENT] = 1;
-        strcat(header, buffer);
+        append_header_line(header, line, len);
     }
-    else if (strcmp(key, "Connection") == 0) {
+    else if (header_is(line, key_len, "Connection")) {
         return;
     }
-    else if (strcmp(key, "Proxy-Connection") == 0) {
+    else if (header_is(line, key_len, "Proxy-Connection")) {
         return;
     }
-    else if (strcmp(key, "Accept") == 0) {
+    else if (header_is(line, key_len, "Keep-Alive")) {
         return;
     }
-    else if (strcmp(key, "Accept-Encoding") == 0) {
+    else if (header_is(line, key_len, "Accept")) {
+        return;
+    }
+    else if (header_is(line, key_len, "Accept-Encoding")) {
         return;
     }
     else {
-        strcat(header, buffer);
+        append_header_line(header, line, len);
     }
 }
 
 /* 
- * complete_request_header - add connection and proxy-connection to proxy
- * header. If client's header does not contain host and user agent, add
- * pre-defined ones.
+ * header_is - whether the key of a header line, key_len bytes long, is
+ * name. Header names are case-insensitive.
+ */
+int header_is(char *line, int key_len, char *name)
+{
+    return key_len == strlen(name) && strncasecmp(line, name, key_len) == 0;
+}
+
+/* 
+ * append_header_line - append a header line of len bytes to header. The
+ * line is dropped if it would not leave room for the lines added by
+ * complete_request_header.
+ */
+void append_header_line(char *header, char *line, int len)
+{
+    size_t used = strlen(header);
+    
+    if (used + len + MAXLINE < MAX_HEADER_SIZE) {
+        memcpy(header + used, line, len);
+        header[used + len] = '\0';
+    }
+}
+
+/* 
+ * complete_request_header - add connection to proxy header, asking the
+ * origin to keep the connection open. If client's header does not
+ * contain host and user agent, add pre-defined ones.
  */
 void complete_request_header(char *req_header, char *host, int *flags)
 {
@@ -294,7 +1128,6 @@ void complete_request_header(char *req_header, char *host, int *flags)
         strcat(req_header, user_agent_hdr);
     }
     strcat(req_header, connection);
-    strcat(req_header, proxy_connection);
     strcat(req_header, accept_hdr);
     strcat(req_header, accept_encoding);
 }
@@ -315,36 +1148,495 @@ void generate_request(char *req, char *path, char *req_header)
 
 /* 
  * forward_request - send the request to server and get response, then 
- * send the response back to client
+ * send the response back to client. Return the size of the response,
+ * and store its status in status. stored tells whether the response
+ * could be cached, that is whether it was offered to the cache.
+ *
+ * The origin connection is kept open for the next request when the body
+ * is delimited by Content-Length or chunked encoding. A chunked body is
+ * de-chunked on the fly, both for the client, whose connection is still
+ * closed after the response, and for the cached copy, which is given a
+ * Content-Length instead. The header buffers are taken from arena.
+ *
+ * A 200 response past the object limit is cached in a chunked line
+ * while it is relayed, so that other clients can be served from the
+ * line before it is complete. fd is -1 for a prefetch, which only fills
+ * the cache.
  */
-void forward_request(int fd, char *uri, char *host, char *port, char *req)
+int forward_request(int fd, Arena *arena, char *key, unsigned long hash,
+                    char *host, char *port, char *req, int *status,
+                    int *stored)
 {
-    char response[MAX_OBJECT_SIZE];
-    char cache_buffer[MAX_OBJECT_SIZE] = {0};
-    int n;
-    int buffer_size = 0;
-    int forward_fd = Open_clientfd(host, port);
+    char *header = arena_alloc(arena, MAX_HEADER_SIZE);
+    char *client_header = arena_alloc(arena, MAX_HEADER_SIZE + MAXLINE);
+    int origin_fd, length, head_len, framing, complete = 0;
+    int client_ok = 1;
+    long content_length = 0, size;
+    CacheCopy copy = {NULL, 0, 0, get_object_limit()};
     rio_t rio;
     
-    Rio_writen(forward_fd, req, strlen(req));
-    Rio_readinitb(&rio, forward_fd);
+    *status = 502;
+    *stored = 0;
+    
+    if ((origin_fd = send_request(host, port, req, &rio, header,
+                                  &length)) < 0) {
+        if (timer_expired() == TIMEOUT_NONE && errno != ETIMEDOUT) {
+            rio_writen(fd, (void *)error_origin, strlen(error_origin));
+        }
+        else {
+            rio_writen(fd, (void *)error_timeout, strlen(error_timeout));
+            *status = 504;
+        }
+        return 0;
+    }
+    // from here on, both connections must keep making progress
+    timer_arm(TIMEOUT_IDLE, fd, origin_fd);
+    
+    *status = http_status(header, length);
+    framing = response_framing(header, length, &content_length);
+    head_len = make_client_header(header, length, client_header,
+                                  framing == BODY_CHUNKED);
+    strcpy(client_header + head_len, client_connection);
+    strcat(client_header + head_len, "\r\n");
+    // the cached copy of a chunked body gets its header once the length
+    // is known
+    pass_on(fd, &client_ok, framing == BODY_CHUNKED ? NULL : &copy,
+            client_header, strlen(client_header));
+    if (*status == 200) {
+        copy.key = key;
+        copy.hash = hash;
+        copy.head = client_header;
+        copy.head_len = strlen(client_header);
+        copy.body_start = framing == BODY_CHUNKED ? 0 : copy.head_len;
+        copy.expected = framing == BODY_LENGTH ? content_length : -1;
+    }
+    
+    switch (framing) {
+    case BODY_NONE:
+        complete = 1;
+        break;
+    case BODY_LENGTH:
+        complete = relay_bytes(&rio, content_length, fd, &client_ok, &copy);
+        break;
+    case BODY_CHUNKED:
+        complete = relay_chunked(&rio, fd, &client_ok, &copy);
+        break;
+    default:
+        complete = relay_bytes(&rio, -1, fd, &client_ok, &copy);
+        break;
+    }
+    
+    // reuse the connection only if it is exactly at the end of the
+    // response, and the origin did not ask to close it
+    timer_cancel();
+    origin_release(origin_fd, host, port,
+                   complete && framing != BODY_CLOSE && rio.rio_cnt == 0 &&
+                   response_keepalive(header, length));
+    
+    if (framing == BODY_CHUNKED) {
+        head_len += sprintf(client_header + head_len,
+                            "Content-Length: %ld\r\n%s\r\n", copy.size,
+                            client_connection);
+        size = copy.size + head_len;
+        if (complete && size <= copy.limit) {
+            copy.data = Realloc(copy.data, size);
+            memmove(copy.data + head_len, copy.data, copy.size);
+            memcpy(copy.data, client_header, head_len);
+        }
+        copy.size = size;
+    }
+    
+    // if the size of the object received is less than the object limit,
+    // store it to cache. Only complete 200 responses are cached, since
+    // anything else, such as a partial response to a range request,
+    // would be served as the full object.
+    *stored = complete && *status == 200;
+    if (*stored && copy.size < copy.limit && copy.data != NULL) {
+        cache_response(key, hash, copy.data, copy.size);
+        // the pages of clients lead to more prefetches, those prefetched
+        // do not
+        if (fd >= 0)
+            prefetch_page(key, copy.data, copy.size);
+    }
+    if (copy.line != NULL)
+        finish_object(copy.line, *stored);
+    Free(copy.data);
+    
+    return copy.size;
+}
+
+/* 
+ * send_request - send a request to the origin, and read the headers of
+ * its response to header, through rio. Store their length in length, and
+ * return the origin connection, or -1 if there is no response.
+ *
+ * A pooled connection may have been closed by the origin in the
+ * meantime. In that case the request is sent again on a new one, unless
+ * it missed the first-byte deadline instead. With -H, the request is
+ * hedged, within the connect and first-byte deadlines together, and
+ * errno is left at ETIMEDOUT if it runs out of time.
+ */
+int send_request(char *host, char *port, char *req, rio_t *rio,
+                 char *header, int *length)
+{
+    int origin_fd, reused, req_len = strlen(req);
+    
+    errno = 0;
+    if (hedge_enabled()) {
+        // hedge_request keeps its own deadline
+        timer_cancel();
+        if ((origin_fd = hedge_request(host, port, req, req_len,
+                                       get_timeout(TIMEOUT_CONNECT) +
+                                       get_timeout(TIMEOUT_FIRST_BYTE))) < 0)
+            return -1;
+        // the rest of the headers
+        timer_arm(TIMEOUT_FIRST_BYTE, origin_fd, -1);
+        rio_readinitb(rio, origin_fd);
+        if ((*length = read_response_header(rio, header,
+                                            MAX_HEADER_SIZE)) > 0)
+            return origin_fd;
+        timer_cancel();
+        close(origin_fd);
+        return -1;
+    }
+    
+    while (1) {
+        if ((origin_fd = origin_connect(host, port, &reused)) < 0)
+            return -1;
+        timer_arm(TIMEOUT_FIRST_BYTE, origin_fd, -1);
+        rio_readinitb(rio, origin_fd);
+        if (rio_writen(origin_fd, req, req_len) == req_len &&
+            (*length = read_response_header(rio, header,
+                                            MAX_HEADER_SIZE)) > 0)
+            return origin_fd;
+        timer_cancel();
+        close(origin_fd);
+        if (!reused || timer_expired() != TIMEOUT_NONE)
+            return -1;
+    }
+}
+
+/* 
+ * read_response_header - read the status line and headers of a response
+ * to header, up to and including the empty line ending them. Return their
+ * length, or -1 if the connection ends first or they do not fit.
+ */
+int read_response_header(rio_t *rp, char *header, int maxlen)
+{
+    int length = 0, line_start = 1;
+    ssize_t n;
+    
+    while (length < maxlen - 1) {
+        if ((n = rio_readlineb(rp, header + length, maxlen - length)) <= 0)
+            return -1;
+        // a line longer than the buffer of rio_readlineb comes in pieces,
+        // so only a piece at the start of a line can be the empty line
+        if (line_start && length > 0 &&
+            ((n == 2 && header[length] == '\r') ||
+             (n == 1 && header[length] == '\n')))
+            return length + n;
+        line_start = header[length + n - 1] == '\n';
+        length += n;
+    }
+    return -1;
+}
+
+/* 
+ * response_framing - how the body of a response is delimited. For
+ * BODY_LENGTH, the length is stored in content_length.
+ */
+int response_framing(char *header, int length, long *content_length)
+{
+    char value[MAXLINE], *end;
+    int status = http_status(header, length);
+    
+    if (status / 100 == 1 || status == 204 || status == 304)
+        return BODY_NONE;
+    if (http_get_header(header, length, "Transfer-Encoding", value, MAXLINE)
+        && http_has_token(value, "chunked"))
+        return BODY_CHUNKED;
+    if (http_get_header(header, length, "Content-Length", value, MAXLINE)) {
+        *content_length = strtol(value, &end, 10);
+        if (end != value && *end == '\0' && *content_length >= 0)
+            return BODY_LENGTH;
+    }
+    return BODY_CLOSE;
+}
+
+/* 
+ * response_keepalive - whether the origin lets the connection be used
+ * again after a response. HTTP/1.1 keeps it unless told to close, and
+ * HTTP/1.0 only when asked to keep it.
+ */
+int response_keepalive(char *header, int length)
+{
+    char value[MAXLINE] = {0};
+    
+    http_get_header(header, length, "Connection", value, MAXLINE);
+    if (strncmp(header, "HTTP/1.1", 8) == 0)
+        return !http_has_token(value, "close");
+    return http_has_token(value, "keep-alive");
+}
+
+/* 
+ * make_client_header - copy the status line and headers of a response to
+ * out, except the empty line ending them and the headers that only apply
+ * to the origin connection. With chunked set, the framing headers are
+ * dropped too, since the body is de-chunked. Return the length of out.
+ */
+int make_client_header(char *header, int length, char *out, int chunked)
+{
+    int pos = 0, out_len = 0;
+    
+    while (pos < length) {
+        char *nl = memchr(header + pos, '\n', length - pos);
+        int n = nl ? nl - (header + pos) + 1 : length - pos;
+        char *p = memchr(header + pos, ':', n);
+        int key_len = p ? p - (header + pos) : 0;
+        char *line = header + pos;
+        
+        pos += n;
+        if ((n == 2 && line[0] == '\r') || (n == 1 && line[0] == '\n'))
+            break;
+        if (p != NULL &&
+            (header_is(line, key_len, "Connection") ||
+             header_is(line, key_len, "Keep-Alive") ||
+             header_is(line, key_len, "Proxy-Connection") ||
+             (chunked && (header_is(line, key_len, "Transfer-Encoding") ||
+                          header_is(line, key_len, "Content-Length")))))
+            continue;
+        memcpy(out + out_len, line, n);
+        out_len += n;
+    }
+    out[out_len] = '\0';
+    return out_len;
+}
+
+/* 
+ * relay_bytes - pass the next n bytes of the response on, or all bytes
+ * up to the end of the connection if n is negative. Return 1 if all of
+ * them were read and the client is still there.
+ */
+int relay_bytes(rio_t *rp, long n, int fd, int *client_ok, CacheCopy *copy)
+{
+    char buf[MAXBUF];
+    ssize_t got;
+    
+    while (n != 0 && *client_ok) {
+        long want = (n < 0 || n > MAXBUF) ? MAXBUF : n;
+        if ((got = rio_readnb(rp, buf, want)) <= 0)
+            return n < 0 && got == 0 && timer_expired() == TIMEOUT_NONE;
+        pass_on(fd, client_ok, copy, buf, got);
+        timer_touch();
+        if (n > 0)
+            n -= got;
+    }
+    return *client_ok;
+}
+
+/* 
+ * relay_chunked - pass a chunked body on without its chunk framing.
+ * Return 1 if the whole body, including its trailer, was read and the
+ * client is still there.
+ */
+int relay_chunked(rio_t *rp, int fd, int *client_ok, CacheCopy *copy)
+{
+    char line[MAXLINE];
+    ssize_t n;
+    long size;
     
     while (1) {
-        memset(response, 0, sizeof(response));
-        if ((n = Rio_readnb(&rio, response, MAX_OBJECT_SIZE)) <= 0)
+        if ((n = rio_readlineb(rp, line, MAXLINE)) <= 0 ||
+            (size = http_chunk_size(line, n)) < 0)
+            return 0;
+        if (size == 0)
             break;
-        Rio_writen(fd, response, n);
-        strncat(cache_buffer, response, n);
-        buffer_size += n;
+        if (!relay_bytes(rp, size, fd, client_ok, copy))
+            return 0;
+        // the line ending after the chunk data
+        if ((n = rio_readlineb(rp, line, MAXLINE)) <= 0 ||
+            (line[0] != '\r' && line[0] != '\n'))
+            return 0;
     }
     
-    // if the size of the object received is less than MAX_OBJECT_SIZE,
-    // store it to cache
-    if (buffer_size < MAX_OBJECT_SIZE) {
-        add_object(uri, cache_buffer, buffer_size);
+    // skip the trailer, up to the empty line ending the body
+    while (1) {
+        if ((n = rio_readlineb(rp, line, MAXLINE)) <= 0)
+            return 0;
+        if ((n == 2 && line[0] == '\r') || (n == 1 && line[0] == '\n'))
+            return *client_ok;
     }
+}
+
+/* 
+ * pass_on - send part of a response to the client, unless it has gone
+ * away or there is none, and keep a copy of it for the cache if copy is
+ * not NULL
+ */
+void pass_on(int fd, int *client_ok, CacheCopy *copy, char *data, int n)
+{
+    if (*client_ok && fd >= 0 && rio_writen(fd, data, n) != n)
+        *client_ok = 0;
+    if (copy != NULL)
+        copy_append(copy, data, n);
+}
+
+/* 
+ * copy_append - keep a copy of data only while the object still fits in
+ * a cache line. The copy grows with the object, since the limit may be
+ * large. Past the limit, data goes to the chunked line if there is one.
+ */
+void copy_append(CacheCopy *copy, char *data, int n)
+{
+    if (copy->line != NULL) {
+        append_object(copy->line, data, n);
+    }
+    else if (copy->size + n > copy->limit) {
+        if (copy->key != NULL && copy->size <= copy->limit)
+            copy_overflow(copy, data, n);
+    }
+    else {
+        if (copy->size + n > copy->cap) {
+            copy->cap = copy->cap ? copy->cap * 2 : MAXBUF;
+            while (copy->cap < copy->size + n)
+                copy->cap *= 2;
+            if (copy->cap > copy->limit)
+                copy->cap = copy->limit;
+            copy->data = Realloc(copy->data, copy->cap);
+        }
+        memcpy(copy->data + copy->size, data, n);
+    }
+    copy->size += n;
+}
+
+/* 
+ * copy_overflow - the object outgrows a cache line. Start a chunked line
+ * with the body copied so far and data, and drop the copy.
+ */
+void copy_overflow(CacheCopy *copy, char *data, int n)
+{
+    copy->line = start_object(copy->key, copy->hash, copy->head,
+                              copy->head_len, copy->expected);
+    if (copy->line != NULL) {
+        if (copy->size > copy->body_start)
+            append_object(copy->line, copy->data + copy->body_start,
+                          copy->size - copy->body_start);
+        append_object(copy->line, data, n);
+    }
+    Free(copy->data);
+    copy->data = NULL;
+    copy->cap = 0;
+}
+
+/* 
+ * cache_response - add a complete response to the cache, with its
+ * headers apart from its body, which other lines may share. With -z, a text
+ * body of at least compress_min bytes is stored gzipped, if that saves
+ * at least an eighth of it.
+ */
+void cache_response(char *key, unsigned long hash, char *resp, int length)
+{
+    int head_len = http_header_length(resp, length);
+    int body_len = length - head_len, n;
+    char *packed;
+    
+    if (head_len < 0) {
+        store_object(key, hash, resp, length, 0, 0);
+        return;
+    }
+    if (compress_min == 0 || body_len < compress_min ||
+        !compressible(resp, head_len)) {
+        store_object(key, hash, resp, length, head_len, 0);
+        return;
+    }
+    
+    packed = Malloc(length);
+    memcpy(packed, resp, head_len);
+    n = gzip_compress(resp + head_len, body_len, packed + head_len,
+                      body_len - body_len / 8);
+    if (n > 0)
+        store_object(key, hash, packed, head_len + n, head_len, length);
+    else
+        store_object(key, hash, resp, length, head_len, 0);
+    Free(packed);
+}
+
+/* 
+ * store_object - add an object to the cache of the process, and to the
+ * shared cache in prefork mode. The arguments are those of add_response.
+ */
+void store_object(char *key, unsigned long hash, char *object, int length,
+                  int head_len, int raw_len)
+{
+    add_response(key, hash, object, length, head_len, raw_len);
+    shared_put(key, hash, object, length, head_len, raw_len);
+}
+
+/* 
+ * fetch_shared - on a miss in the cache of the process, copy the object
+ * from the shared cache into it, if the shared cache has it. Return
+ * whether it did.
+ */
+int fetch_shared(char *key, unsigned long hash)
+{
+    char *object;
+    int length, head_len, raw_len;
+    
+    if (!shared_get(key, hash, &object, &length, &head_len, &raw_len))
+        return 0;
+    add_response(key, hash, object, length, head_len, raw_len);
+    Free(object);
+    return 1;
+}
+
+/* 
+ * compressible - whether a response has a text body that is not encoded
+ * yet, such as HTML, CSS, JavaScript or JSON
+ */
+int compressible(char *resp, int head_len)
+{
+    static const char *types[] = {"text/", "application/json",
+        "application/javascript", "application/x-javascript",
+        "application/xml", "image/svg+xml", NULL};
+    char value[MAXLINE];
     
-    Close(forward_fd);
+    if (http_get_header(resp, head_len, "Content-Encoding", value, MAXLINE)
+        && strcasecmp(value, "identity") != 0)
+        return 0;
+    if (!http_get_header(resp, head_len, "Content-Type", value, MAXLINE))
+        return 0;
+    for (int i = 0; types[i] != NULL; ++i)
+        if (strncasecmp(value, types[i], strlen(types[i])) == 0)
+            return 1;
+    return 0;
+}
+
+/* 
+ * log_access - if the access log is on, log a line for a request:
+ * arrival time, status sent, size of the object or response, whether it
+ * was a cache hit, a cacheable miss or passed through uncached, the
+ * latency in microseconds, and the uri as the client sent it, so that
+ * cachesim can try other key normalizations. The line is only formatted
+ * here, and written by the log thread.
+ */
+void log_access(struct timeval *start, char *uri, int status, int size,
+                char *kind)
+{
+    char line[MAXLINE];
+    struct timeval end;
+    long latency;
+    int n;
+    
+    if (access_log < 0)
+        return;
+    gettimeofday(&end, NULL);
+    latency = (end.tv_sec - start->tv_sec) * 1000000L +
+              (end.tv_usec - start->tv_usec);
+    n = snprintf(line, sizeof(line), "%ld.%06ld %d %d %s %ld %s\n",
+                 (long)start->tv_sec, (long)start->tv_usec, status, size,
+                 kind, latency, uri);
+    if (n < sizeof(line))
+        log_write(LOG_ACCESS, line, n);
 }
  
 /***********************
@@ -0,0 +1,274 @@
+/*
+ * range.c
+ *
+ * Serve "Range: bytes=..." requests from a cached full response. A single
+ * range is answered with a plain 206 response, several ranges with a
+ * multipart/byteranges body, and a range that lies outside the object
+ * with 416.
+ */
+
+#include <limits.h>
+#include "csapp.h"
+#include "http.h"
+#include "range.h"
+
+#define BOUNDARY "PROXY_BYTERANGES_0b1d5f3e"
+
+static const char *range_not_satisfiable =
+"%s 416 Range Not Satisfiable\r\nContent-Range: bytes */%ld\r\n"
+"Content-Length: 0\r\nConnection: close\r\n\r\n";
+
+/* Helper function declaration */
+static long parse_pos(char **pos);
+static int if_range_matches(char *resp, int hdr_len, char *if_range);
+static int copy_headers(char *dst, int size, char *resp, int hdr_len,
+                        int multipart);
+static int part_header(char *buf, int size, char *type, ByteRange *r,
+                       long length);
+
+/*
+ * parse_range - parse the value of a Range header against an object of
+ * the given length. Return the number of satisfiable ranges stored in
+ * ranges, 0 if no range is satisfiable, or -1 if the header is invalid or
+ * has too many ranges, in which case it should be ignored.
+ */
+int parse_range(char *spec, long length, ByteRange *ranges, int max_ranges)
+{
+    char *pos = spec;
+    int count = 0;
+    int specs = 0;
+
+    if (strncasecmp(pos, "bytes=", 6) != 0)
+        return -1;
+    pos += 6;
+
+    while (1) {
+        long first, last;
+
+        while (*pos == ' ' || *pos == '\t')
+            ++pos;
+
+        if (*pos == '-') {
+            // suffix range, the last n bytes of the object
+            ++pos;
+            if ((last = parse_pos(&pos)) < 0)
+                return -1;
+            first = length - last;
+            if (first < 0)
+                first = 0;
+            last = length - 1;
+        }
+        else {
+            if ((first = parse_pos(&pos)) < 0 || *pos != '-')
+                return -1;
+            ++pos;
+            if (*pos >= '0' && *pos <= '9') {
+                if ((last = parse_pos(&pos)) < first)
+                    return -1;
+                if (last > length - 1)
+                    last = length - 1;
+            }
+            else {
+                last = length - 1;
+            }
+        }
+        ++specs;
+
+        // a range starting beyond the object is skipped
+        if (first <= last) {
+            if (count == max_ranges)
+                return -1;
+            ranges[count].first = first;
+            ranges[count].last = last;
+            ++count;
+        }
+
+        while (*pos == ' ' || *pos == '\t')
+            ++pos;
+        if (*pos == '\0')
+            break;
+        if (*pos != ',')
+            return -1;
+        ++pos;
+    }
+
+    return specs > 0 ? count : -1;
+}
+
+/*
+ * send_range - answer a range request from a full response, given as its
+ * headers resp, up to and including the empty line, and its body. Return
+ * the status sent, 206 or 416, or 0 if the range cannot be applied and
+ * the caller should send the whole response instead. Sending stops early
+ * if the client goes away, which is common when it seeks.
+ */
+int send_range(int fd, char *resp, int hdr_len, char *body, long body_len,
+               char *range, char *if_range)
+{
+    ByteRange ranges[MAX_RANGES];
+    char header[MAXBUF], part[MAXLINE], type[MAXLINE] = {0},
+         version[16] = {0};
+    long total = 0;
+    int n, count, i;
+
+    if (http_status(resp, hdr_len) != 200)
+        return 0;
+    if (http_header_length(resp, hdr_len) != hdr_len)
+        return 0;
+    if (if_range[0] != '\0' && !if_range_matches(resp, hdr_len, if_range))
+        return 0;
+
+    sscanf(resp, "%15s", version);
+
+    if ((count = parse_range(range, body_len, ranges, MAX_RANGES)) < 0)
+        return 0;
+
+    if (count == 0) {
+        n = snprintf(header, sizeof(header), range_not_satisfiable,
+                     version, body_len);
+        rio_writen(fd, header, n);
+        return 416;
+    }
+
+    n = snprintf(header, sizeof(header), "%s 206 Partial Content\r\n",
+                 version);
+    if ((i = copy_headers(header + n, sizeof(header) - n, resp, hdr_len,
+                          count > 1)) < 0)
+        return 0;
+    n += i;
+
+    if (count == 1) {
+        total = ranges[0].last - ranges[0].first + 1;
+        i = snprintf(header + n, sizeof(header) - n,
+                     "Content-Range: bytes %ld-%ld/%ld\r\n"
+                     "Content-Length: %ld\r\n\r\n",
+                     ranges[0].first, ranges[0].last, body_len, total);
+    }
+    else {
+        // every part is announced by its own header, so the length of
+        // the whole body has to be counted before it is sent
+        http_get_header(resp, hdr_len, "Content-Type", type, MAXLINE);
+        for (int j = 0; j < count; ++j) {
+            total += part_header(part, sizeof(part), type, &ranges[j],
+                                 body_len);
+            total += ranges[j].last - ranges[j].first + 1;
+        }
+        total += strlen("\r\n--" BOUNDARY "--\r\n");
+        i = snprintf(header + n, sizeof(header) - n,
+                     "Content-Type: multipart/byteranges; boundary="
+                     BOUNDARY "\r\nContent-Length: %ld\r\n\r\n", total);
+    }
+    if (i >= sizeof(header) - n)
+        return 0;
+    if (rio_writen(fd, header, n + i) != n + i)
+        return 206;
+
+    if (count == 1) {
+        rio_writen(fd, body + ranges[0].first, total);
+        return 206;
+    }
+
+    for (int j = 0; j < count; ++j) {
+        long part_len = ranges[j].last - ranges[j].first + 1;
+        n = part_header(part, sizeof(part), type, &ranges[j], body_len);
+        if (rio_writen(fd, part, n) != n ||
+            rio_writen(fd, body + ranges[j].first, part_len) != part_len)
+            return 206;
+    }
+    rio_writen(fd, "\r\n--" BOUNDARY "--\r\n",
+               strlen("\r\n--" BOUNDARY "--\r\n"));
+    return 206;
+}
+
+/*
+ * parse_pos - parse a non-negative decimal number at *pos and advance
+ * *pos past it. Return -1 if there is no number or it is too large.
+ */
+static long parse_pos(char **pos)
+{
+    long value = 0;
+    char *p = *pos;
+
+    if (*p < '0' || *p > '9')
+        return -1;
+    while (*p >= '0' && *p <= '9') {
+        if (value > (LONG_MAX - 9) / 10)
+            return -1;
+        value = value * 10 + (*p - '0');
+        ++p;
+    }
+    *pos = p;
+    return value;
+}
+
+/*
+ * if_range_matches - check the If-Range validator against the ETag or
+ * Last-Modified of the cached response. Weak entity tags never match.
+ */
+static int if_range_matches(char *resp, int hdr_len, char *if_range)
+{
+    char value[MAXLINE];
+
+    if (strncmp(if_range, "W/", 2) == 0)
+        return 0;
+    if (http_get_header(resp, hdr_len, "ETag", value, MAXLINE) &&
+        strcmp(value, if_range) == 0)
+        return 1;
+    if (http_get_header(resp, hdr_len, "Last-Modified", value, MAXLINE) &&
+        strcmp(value, if_range) == 0)
+        return 1;
+    return 0;
+}
+
+/*
+ * copy_headers - copy the header lines of resp except the status line and
+ * the ones describing the body, which are rewritten for a partial
+ * response. Return the number of bytes copied, or -1 if dst is too small.
+ */
+static int copy_headers(char *dst, int size, char *resp, int hdr_len,
+                        int multipart)
+{
+    char *line = (char *)memchr(resp, '\n', hdr_len) + 1;
+    char *end = resp + hdr_len - 2;   // skip the empty line
+    int n = 0;
+
+    while (line < end) {
+        char *next = memchr(line, '\n', end - line);
+        int len = (next ? next + 1 : end) - line;
+
+        if (strncasecmp(line, "Content-Length:", 15) != 0 &&
+            strncasecmp(line, "Content-Range:", 14) != 0 &&
+            strncasecmp(line, "Transfer-Encoding:", 18) != 0 &&
+            !(multipart && strncasecmp(line, "Content-Type:", 13) == 0)) {
+            if (n + len >= size)
+                return -1;
+            memcpy(dst + n, line, len);
+            n += len;
+        }
+        line += len;
+    }
+    return n;
+}
+
+/*
+ * part_header - format the boundary and headers in front of one part of a
+ * multipart/byteranges body and return its length
+ */
+static int part_header(char *buf, int size, char *type, ByteRange *r,
+                       long length)
+{
+    int n;
+
+    if (type[0] == '\0')
+        n = snprintf(buf, size, "\r\n--" BOUNDARY "\r\n"
+                     "Content-Range: bytes %ld-%ld/%ld\r\n\r\n",
+                     r->first, r->last, length);
+    else
+        n = snprintf(buf, size, "\r\n--" BOUNDARY "\r\n"
+                     "Content-Type: %s\r\n"
+                     "Content-Range: bytes %ld-%ld/%ld\r\n\r\n",
+                     type, r->first, r->last, length);
+
+    // a truncated header is still counted by what is actually sent
+    return n < size ? n : size - 1;
+}
@@ -0,0 +1,25 @@
+/*
+ * range.h
+ *
+ * Header file for byte range module
+ */
+
+#ifndef RANGE_H
+#define RANGE_H
+
+#define MAX_RANGES 16   /* more ranges than this are served as full object */
+
+/*
+ * a satisfiable byte range, both positions are inclusive
+ */
+typedef struct {
+    long first;
+    long last;
+} ByteRange;
+
+int parse_range(char *spec, long length, ByteRange *ranges, int max_ranges);
+
+int send_range(int fd, char *resp, int hdr_len, char *body, long body_len,
+               char *range, char *if_range);
+
+#endif
@@ -0,0 +1,294 @@
+/*
+ * shmcache.c
+ *
+ * The cache the worker processes of the prefork mode share, so that
+ * running a process per core does not split the hits between as many
+ * caches. It lives in a shm_open region mapped by the master before it
+ * forks the workers: a header with the index and the recency list, and
+ * a PayloadHeap the entries are carved from. Every link in the region
+ * is an offset from its start rather than a pointer, so the region means
+ * the same in every process whatever address it is mapped at.
+ *
+ * Each worker keeps its own cache in front of this one. A miss in the
+ * worker's cache looks here, and a hit is copied out into the worker's
+ * cache, which serves it and the next hits on the object. The objects a
+ * worker caches are copied in here too. Since an object is only copied
+ * in and out under the lock, no process holds a reference into the
+ * region between calls, and a worker that dies leaves nothing pinned.
+ *
+ * One mutex guards the region. It is process-shared and robust: when a
+ * worker dies holding it, the next process to take it is told so, and as
+ * the lists may have been left halfway through a change, it empties the
+ * cache before marking the mutex consistent. Losing the cache is cheap
+ * compared to wedging every worker on a lock nobody will release.
+ */
+
+#include "csapp.h"
+#include "shmcache.h"
+
+#define SHARED_MASK (SHARED_BUCKETS - 1)
+
+/* Conversions between offsets and addresses in the region */
+#define AT(off)     ((char *)region + (off))
+#define ENTRY(off)  ((SharedEntry *)AT(off))
+#define HEAP()      ((PayloadHeap *)AT(region->heap))
+
+static SharedRegion *region = NULL;
+
+/* Helper function declaration */
+static void lock_region(void);
+static void reset_region(void);
+static size_t find_entry(char *key, unsigned long hash);
+static void remove_entry(size_t off);
+static void unlink_entry(size_t off);
+static void push_entry(size_t off);
+
+/*
+ * shared_cache_init - create a shared cache whose entries take up to
+ * size bytes. Called before the workers are forked. Return -1 if the
+ * shared memory cannot be made.
+ */
+int shared_cache_init(long size)
+{
+    char name[64];
+    size_t heap = (sizeof(SharedRegion) + PAYLOAD_ALIGN - 1) &
+                  ~((size_t)PAYLOAD_ALIGN - 1);
+    size_t total;
+    pthread_mutexattr_t attr;
+    void *p;
+    int fd;
+
+    size = (size + PAYLOAD_ALIGN - 1) & ~((long)PAYLOAD_ALIGN - 1);
+    total = heap + size;
+    snprintf(name, sizeof(name), "/proxy-cache-%d", (int)getpid());
+    if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) < 0)
+        return -1;
+    // the workers inherit the mapping, so the name can go at once, and
+    // nothing is left in /dev/shm however the processes end
+    shm_unlink(name);
+    if (ftruncate(fd, total) < 0 ||
+        (p = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                  0)) == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    region = p;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&region->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    region->heap = heap;
+    region->stats.size = size;
+    reset_region();
+    return 0;
+}
+
+/*
+ * shared_cache_enabled - whether shared_cache_init made a shared cache
+ */
+int shared_cache_enabled(void)
+{
+    return region != NULL;
+}
+
+/*
+ * shared_get - look up key. On a hit, store a copy of the object, taken
+ * from the heap, in object, and its lengths as given to add_response,
+ * and return 1. Return 0 on a miss.
+ */
+int shared_get(char *key, unsigned long hash, char **object, int *length,
+               int *head_length, int *raw_length)
+{
+    SharedEntry *entry;
+    size_t off;
+
+    if (region == NULL)
+        return 0;
+    lock_region();
+    if ((off = find_entry(key, hash)) == 0) {
+        ++region->stats.misses;
+        pthread_mutex_unlock(&region->lock);
+        return 0;
+    }
+
+    unlink_entry(off);
+    push_entry(off);
+    entry = ENTRY(off);
+    *object = Malloc(entry->length > 0 ? entry->length : 1);
+    memcpy(*object, entry->data + entry->key_length + 1, entry->length);
+    *length = entry->length;
+    *head_length = entry->head_length;
+    *raw_length = entry->raw_length;
+    ++region->stats.hits;
+    pthread_mutex_unlock(&region->lock);
+    return 1;
+}
+
+/*
+ * shared_put - cache a copy of an object for key, replacing the one
+ * cached already, and evicting the least recently used ones to make
+ * room. An object larger than half of the cache is not cached.
+ */
+void shared_put(char *key, unsigned long hash, char *object, int length,
+                int head_length, int raw_length)
+{
+    int key_length = strlen(key);
+    size_t need = sizeof(SharedEntry) + key_length + 1 + length, off;
+    SharedEntry *entry;
+
+    if (region == NULL || need > (size_t)region->stats.size / 2)
+        return;
+    lock_region();
+    if ((off = find_entry(key, hash)) != 0)
+        remove_entry(off);
+    while ((off = payload_heap_alloc(HEAP(), need)) == 0 &&
+           region->tail != 0) {
+        remove_entry(region->tail);
+        ++region->stats.evictions;
+    }
+    if (off == 0) {
+        pthread_mutex_unlock(&region->lock);
+        return;
+    }
+
+    off += region->heap;
+    entry = ENTRY(off);
+    entry->hash = hash;
+    entry->length = length;
+    entry->head_length = head_length;
+    entry->raw_length = raw_length;
+    entry->key_length = key_length;
+    memcpy(entry->data, key, key_length + 1);
+    memcpy(entry->data + key_length + 1, object, length);
+    entry->hnext = region->index[hash & SHARED_MASK];
+    region->index[hash & SHARED_MASK] = off;
+    push_entry(off);
+    ++region->stats.inserts;
+    ++region->stats.lines;
+    region->stats.used += length;
+    pthread_mutex_unlock(&region->lock);
+}
+
+/*
+ * shared_worker_restarted - count a worker the master started again
+ */
+void shared_worker_restarted(void)
+{
+    if (region == NULL)
+        return;
+    lock_region();
+    ++region->stats.restarts;
+    pthread_mutex_unlock(&region->lock);
+}
+
+/*
+ * get_shared_stats - copy the counters of the shared cache to out
+ */
+void get_shared_stats(SharedStats *out)
+{
+    if (region == NULL) {
+        memset(out, 0, sizeof(*out));
+        return;
+    }
+    lock_region();
+    *out = region->stats;
+    pthread_mutex_unlock(&region->lock);
+}
+
+/*
+ * lock_region - take the lock of the region. If its holder died, the
+ * cache it may have left inconsistent is emptied.
+ */
+static void lock_region(void)
+{
+    if (pthread_mutex_lock(&region->lock) == EOWNERDEAD) {
+        reset_region();
+        ++region->stats.recoveries;
+        pthread_mutex_consistent(&region->lock);
+    }
+}
+
+/*
+ * reset_region - empty the cache, keeping the counters. Called with the
+ * lock held, or before any worker is forked.
+ */
+static void reset_region(void)
+{
+    region->head = 0;
+    region->tail = 0;
+    memset(region->index, 0, sizeof(region->index));
+    payload_heap_init(HEAP(), region->stats.size);
+    region->stats.used = 0;
+    region->stats.lines = 0;
+}
+
+/*
+ * find_entry - the offset of the entry for key, or 0 if there is none.
+ * Called with the lock held.
+ */
+static size_t find_entry(char *key, unsigned long hash)
+{
+    size_t off = region->index[hash & SHARED_MASK];
+
+    while (off != 0 &&
+           (ENTRY(off)->hash != hash || strcmp(ENTRY(off)->data, key) != 0))
+        off = ENTRY(off)->hnext;
+    return off;
+}
+
+/*
+ * remove_entry - take an entry out of the index and the list, and free
+ * it. Called with the lock held.
+ */
+static void remove_entry(size_t off)
+{
+    SharedEntry *entry = ENTRY(off);
+    size_t *cursor = &region->index[entry->hash & SHARED_MASK];
+
+    while (*cursor != 0 && *cursor != off)
+        cursor = &ENTRY(*cursor)->hnext;
+    if (*cursor != 0)
+        *cursor = entry->hnext;
+    unlink_entry(off);
+    --region->stats.lines;
+    region->stats.used -= entry->length;
+    payload_heap_free(HEAP(), off - region->heap);
+}
+
+/*
+ * unlink_entry - take an entry out of the list. Called with the lock
+ * held.
+ */
+static void unlink_entry(size_t off)
+{
+    SharedEntry *entry = ENTRY(off);
+
+    if (entry->prev != 0)
+        ENTRY(entry->prev)->next = entry->next;
+    else
+        region->head = entry->next;
+    if (entry->next != 0)
+        ENTRY(entry->next)->prev = entry->prev;
+    else
+        region->tail = entry->prev;
+}
+
+/*
+ * push_entry - put an entry at the head of the list. Called with the
+ * lock held.
+ */
+static void push_entry(size_t off)
+{
+    SharedEntry *entry = ENTRY(off);
+
+    entry->prev = 0;
+    entry->next = region->head;
+    if (region->head != 0)
+        ENTRY(region->head)->prev = off;
+    else
+        region->tail = off;
+    region->head = off;
+}
@@ -0,0 +1,72 @@
+/*
+ * shmcache.h
+ *
+ * Header file for the cache the worker processes share
+ */
+
+#ifndef SHMCACHE_H
+#define SHMCACHE_H
+
+#include <pthread.h>
+#include "payload.h"
+
+#define SHARED_BITS         14      /* the index has 2^SHARED_BITS buckets */
+#define SHARED_BUCKETS      (1 << SHARED_BITS)
+#define DEFAULT_SHARED_SIZE (16 << 20)
+
+/*
+ * counters of the shared cache, see get_shared_stats
+ */
+typedef struct shared_stats {
+    long size;                  /* bytes of the heap of the entries */
+    long used;                  /* bytes of the objects cached */
+    int lines;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long inserts;
+    unsigned long evictions;
+    unsigned long recoveries;   /* resets after a worker died locked */
+    unsigned long restarts;     /* workers started again */
+} SharedStats;
+
+/*
+ * an object in the shared cache. The links are offsets from the region,
+ * since each process may map it at a different address.
+ */
+typedef struct shared_entry {
+    size_t prev, next;          /* in the list, most recent first */
+    size_t hnext;               /* next entry in the same bucket */
+    unsigned long hash;
+    int length;                 /* of the object */
+    int head_length;
+    int raw_length;             /* as in add_response */
+    int key_length;
+    char data[];                /* the key and its NUL, then the object */
+} SharedEntry;
+
+/*
+ * the start of the shared memory, followed by the heap of the entries
+ */
+typedef struct shared_region {
+    pthread_mutex_t lock;       /* process-shared and robust */
+    size_t head, tail;          /* offsets of entries, or 0 */
+    size_t heap;                /* offset of the heap */
+    size_t index[SHARED_BUCKETS];
+    SharedStats stats;
+} SharedRegion;
+
+int shared_cache_init(long size);
+
+int shared_cache_enabled(void);
+
+int shared_get(char *key, unsigned long hash, char **object, int *length,
+               int *head_length, int *raw_length);
+
+void shared_put(char *key, unsigned long hash, char *object, int length,
+                int head_length, int raw_length);
+
+void shared_worker_restarted(void);
+
+void get_shared_stats(SharedStats *stats);
+
+#endif
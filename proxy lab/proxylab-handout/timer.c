@@ -0,0 +1,289 @@
+/*
+ * timer.c
+ *
+ * Deadlines of the connections, so that a stalled client or origin does
+ * not hold its thread forever. Each thread has one timer, armed for the
+ * step it is blocked in: reading the request headers, connecting to the
+ * origin, waiting for the first byte of the response, or sending a body,
+ * where the deadline moves on with every read or write. A reaper thread
+ * shuts down the descriptors of a timer that expires, so that the read or
+ * write blocked on them returns with an error.
+ *
+ * The timers are kept in a hierarchical wheel: TIMER_LEVELS wheels of
+ * TIMER_SLOTS slots, each slot of a wheel as long as the whole wheel
+ * below it. A timer goes in the slot of the coarsest wheel its deadline
+ * needs, and moves down a wheel when the reaper reaches that slot, so
+ * that arming, cancelling and expiring are O(1). A timer whose deadline
+ * was moved on by timer_touch is placed again when its slot comes up,
+ * instead of being moved at each touch.
+ */
+
+#include "csapp.h"
+#include "timer.h"
+
+static Timer wheel[TIMER_LEVELS][TIMER_SLOTS];  /* heads of the slots */
+static unsigned long now_tick = 0;              /* ticks since timer_init */
+static long start_msec;
+static int timeouts[TIMEOUT_KINDS] = {DEFAULT_HEADER_TIMEOUT,
+    DEFAULT_CONNECT_TIMEOUT, DEFAULT_FIRST_BYTE_TIMEOUT, DEFAULT_IDLE_TIMEOUT};
+static TimerStats stats;
+static __thread Timer my_timer = {NULL, NULL, 0, 0, {-1, -1}, TIMEOUT_NONE,
+                                  TIMEOUT_NONE};
+static pthread_mutex_t timer_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Helper function declaration */
+static void place_timer(Timer *t);
+static void unlink_timer(Timer *t);
+static void advance_wheel(void);
+static void take_slot(Timer *head, Timer *list);
+static void expire_timer(Timer *t);
+static unsigned long ticks_of(int kind);
+static long now_msec(void);
+static void *reaper(void *arg);
+
+/*
+ * timer_init - start the reaper thread
+ */
+void timer_init(void)
+{
+    pthread_t tid;
+
+    for (int level = 0; level < TIMER_LEVELS; ++level)
+        for (int i = 0; i < TIMER_SLOTS; ++i)
+            wheel[level][i].next = wheel[level][i].prev = &wheel[level][i];
+    start_msec = now_msec();
+    Pthread_create(&tid, NULL, reaper, NULL);
+}
+
+/*
+ * set_timeout - set the deadline of kind, in seconds. Timers already
+ * armed keep theirs.
+ */
+void set_timeout(int kind, int seconds)
+{
+    __atomic_store_n(&timeouts[kind], seconds, __ATOMIC_RELAXED);
+}
+
+/*
+ * get_timeout - the deadline of kind, in seconds
+ */
+int get_timeout(int kind)
+{
+    return __atomic_load_n(&timeouts[kind], __ATOMIC_RELAXED);
+}
+
+/*
+ * timer_arm - arm the timer of the calling thread for the deadline of
+ * kind, replacing the one it is armed for. When it expires, fd and
+ * other_fd are shut down; either may be -1.
+ */
+void timer_arm(int kind, int fd, int other_fd)
+{
+    Timer *t = &my_timer;
+
+    pthread_mutex_lock(&timer_mutex);
+    if (t->next != NULL)
+        unlink_timer(t);
+    t->kind = kind;
+    t->fds[0] = fd;
+    t->fds[1] = other_fd;
+    t->fired = TIMEOUT_NONE;
+    t->expires = now_tick + ticks_of(kind);
+    t->deadline = t->expires;
+    place_timer(t);
+    ++stats.armed;
+    pthread_mutex_unlock(&timer_mutex);
+}
+
+/*
+ * timer_touch - progress was made, so move the deadline of the calling
+ * thread on by its whole timeout. This takes no lock.
+ */
+void timer_touch(void)
+{
+    __atomic_store_n(&my_timer.deadline,
+                     __atomic_load_n(&now_tick, __ATOMIC_RELAXED) +
+                     ticks_of(my_timer.kind), __ATOMIC_RELAXED);
+}
+
+/*
+ * timer_cancel - disarm the timer of the calling thread. Must be called
+ * before any descriptor it was armed with is closed, since the number
+ * may be reused by then.
+ */
+void timer_cancel(void)
+{
+    pthread_mutex_lock(&timer_mutex);
+    if (my_timer.next != NULL)
+        unlink_timer(&my_timer);
+    my_timer.fds[0] = my_timer.fds[1] = -1;
+    pthread_mutex_unlock(&timer_mutex);
+}
+
+/*
+ * timer_expired - the deadline the timer of the calling thread missed
+ * since it was last armed, or TIMEOUT_NONE
+ */
+int timer_expired(void)
+{
+    return __atomic_load_n(&my_timer.fired, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * get_timer_stats - copy the counters of the deadlines to out
+ */
+void get_timer_stats(TimerStats *out)
+{
+    pthread_mutex_lock(&timer_mutex);
+    *out = stats;
+    pthread_mutex_unlock(&timer_mutex);
+}
+
+/*
+ * place_timer - add a timer to the slot of its expiry tick, in the finest
+ * wheel that reaches it. A tick past the last wheel is cut to its end,
+ * and the timer is placed again from there. Called with timer_mutex
+ * held.
+ */
+static void place_timer(Timer *t)
+{
+    unsigned long span = 1UL << (TIMER_LEVELS * TIMER_SLOT_BITS), delta;
+    int level = 0;
+    Timer *head;
+
+    // a timer taken down from a coarser wheel may be due this very tick
+    if ((long)(t->expires - now_tick) < 0)
+        t->expires = now_tick;
+    if (t->expires - now_tick >= span)
+        t->expires = now_tick + span - 1;
+    delta = t->expires - now_tick;
+    while (delta >= 1UL << ((level + 1) * TIMER_SLOT_BITS))
+        ++level;
+
+    head = &wheel[level][(t->expires >> (level * TIMER_SLOT_BITS)) &
+                         (TIMER_SLOTS - 1)];
+    t->next = head;
+    t->prev = head->prev;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+/*
+ * unlink_timer - remove a timer from its slot. Called with timer_mutex
+ * held.
+ */
+static void unlink_timer(Timer *t)
+{
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = t->prev = NULL;
+}
+
+/*
+ * advance_wheel - move to the next tick. The slots of the coarser wheels
+ * that start at this tick are moved down first, then the timers of the
+ * current slot of the finest wheel expire, or are placed again if they
+ * were touched. Called with timer_mutex held.
+ */
+static void advance_wheel(void)
+{
+    unsigned long tick = now_tick + 1;
+    Timer list, *t;
+
+    __atomic_store_n(&now_tick, tick, __ATOMIC_RELAXED);
+    for (int level = 1; level < TIMER_LEVELS; ++level) {
+        if ((tick & ((1UL << (level * TIMER_SLOT_BITS)) - 1)) != 0)
+            break;
+        take_slot(&wheel[level][(tick >> (level * TIMER_SLOT_BITS)) &
+                                (TIMER_SLOTS - 1)], &list);
+        while ((t = list.next) != &list) {
+            unlink_timer(t);
+            place_timer(t);
+        }
+    }
+
+    take_slot(&wheel[0][tick & (TIMER_SLOTS - 1)], &list);
+    while ((t = list.next) != &list) {
+        unsigned long deadline = __atomic_load_n(&t->deadline,
+                                                 __ATOMIC_RELAXED);
+        unlink_timer(t);
+        if ((long)(deadline - tick) > 0) {
+            t->expires = deadline;
+            place_timer(t);
+        }
+        else {
+            expire_timer(t);
+        }
+    }
+}
+
+/*
+ * take_slot - move the timers of the slot at head to list, so that those
+ * placed again do not come around in the same pass
+ */
+static void take_slot(Timer *head, Timer *list)
+{
+    if (head->next == head) {
+        list->next = list->prev = list;
+        return;
+    }
+    list->next = head->next;
+    list->prev = head->prev;
+    list->next->prev = list;
+    list->prev->next = list;
+    head->next = head->prev = head;
+}
+
+/*
+ * expire_timer - shut down the descriptors of a timer whose deadline has
+ * passed. Its thread sees that from the failed read or write, and can
+ * tell which deadline it missed from timer_expired. Called with
+ * timer_mutex held, and unlinked.
+ */
+static void expire_timer(Timer *t)
+{
+    for (int i = 0; i < 2; ++i)
+        if (t->fds[i] >= 0)
+            shutdown(t->fds[i], SHUT_RDWR);
+    ++stats.expired[t->kind];
+    __atomic_store_n(&t->fired, t->kind, __ATOMIC_RELEASE);
+}
+
+/*
+ * ticks_of - the timeout of kind in ticks
+ */
+static unsigned long ticks_of(int kind)
+{
+    return (unsigned long)get_timeout(kind) * 1000 / TIMER_TICK_MSEC;
+}
+
+/*
+ * now_msec - monotonic time in msec
+ */
+static long now_msec(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000L + t.tv_nsec / 1000000;
+}
+
+/*
+ * reaper - the reaper thread. It wakes up every tick, and catches up
+ * with the clock if it slept longer.
+ */
+static void *reaper(void *arg)
+{
+    pthread_detach(pthread_self());
+    while (1) {
+        unsigned long target;
+
+        usleep(TIMER_TICK_MSEC * 1000);
+        target = (now_msec() - start_msec) / TIMER_TICK_MSEC;
+        pthread_mutex_lock(&timer_mutex);
+        while (now_tick < target)
+            advance_wheel();
+        pthread_mutex_unlock(&timer_mutex);
+    }
+    return NULL;
+}
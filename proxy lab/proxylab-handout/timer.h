@@ -0,0 +1,66 @@
+/*
+ * timer.h
+ *
+ * Header file for the connection deadlines and their timer wheel
+ */
+
+#ifndef TIMER_H
+#define TIMER_H
+
+#define TIMER_TICK_MSEC     10      /* resolution of the deadlines */
+#define TIMER_LEVELS        4       /* wheels, each 64 times coarser */
+#define TIMER_SLOT_BITS     6
+#define TIMER_SLOTS         (1 << TIMER_SLOT_BITS)
+
+/* Deadlines of a connection, see timer_arm */
+#define TIMEOUT_NONE        -1
+#define TIMEOUT_HEADER      0   /* the client sends its request */
+#define TIMEOUT_CONNECT     1   /* a new origin connection is made */
+#define TIMEOUT_FIRST_BYTE  2   /* the origin starts its response */
+#define TIMEOUT_IDLE        3   /* no progress while a body is sent */
+#define TIMEOUT_KINDS       4
+
+#define DEFAULT_HEADER_TIMEOUT      10  /* seconds */
+#define DEFAULT_CONNECT_TIMEOUT     5
+#define DEFAULT_FIRST_BYTE_TIMEOUT  30
+#define DEFAULT_IDLE_TIMEOUT        60
+
+/*
+ * the deadline of a thread, in a slot of the wheel while armed. It
+ * expires at deadline, which timer_touch moves on without taking the
+ * wheel lock, so the slot is only that of the tick it was armed for.
+ */
+typedef struct Timer {
+    struct Timer *next, *prev;  /* in its slot, NULL while not armed */
+    unsigned long expires;      /* tick of its slot */
+    unsigned long deadline;     /* tick it expires at */
+    int fds[2];                 /* shut down when it expires, or -1 */
+    int kind;                   /* TIMEOUT_* it is armed for */
+    int fired;                  /* TIMEOUT_* that expired, or TIMEOUT_NONE */
+} Timer;
+
+/*
+ * counters of the deadlines, see get_timer_stats
+ */
+typedef struct timer_stats {
+    unsigned long armed;                    /* timer_arm calls */
+    unsigned long expired[TIMEOUT_KINDS];   /* deadlines missed, by kind */
+} TimerStats;
+
+void timer_init(void);
+
+void set_timeout(int kind, int seconds);
+
+int get_timeout(int kind);
+
+void timer_arm(int kind, int fd, int other_fd);
+
+void timer_touch(void);
+
+void timer_cancel(void);
+
+int timer_expired(void);
+
+void get_timer_stats(TimerStats *stats);
+
+#endif